@@ -8,11 +8,17 @@
 extern "C" {
 #include "champ.h"
 #include "champ_fns.h"
+#include <pthread.h>
+#include "stm_rc.h"
+#include "chunk_list.h"
+#include "list.h"
 
 struct node {
 	uint8_t element_arity;
 	uint8_t branch_arity;
 	uint16_t ref_count;
+	uint32_t size;
+	uint32_t hash;
 	uint32_t element_map;
 	uint32_t branch_map;
 	struct {CHAMP_KEY_T a; CHAMP_VALUE_T b;} content[];
@@ -22,14 +28,56 @@ struct collision_node {
 	uint8_t element_arity;
 	uint8_t branch_arity;
 	uint16_t ref_count;
+	uint32_t size;
+	uint32_t hash;
+	uint32_t element_map;
+	uint32_t branch_map;
 	struct {CHAMP_KEY_T a; CHAMP_VALUE_T b;} content[];
 };
+
+struct chunk {
+	struct chunk_list *tail;
+	unsigned tail_length;
+	unsigned ref_count;
+	unsigned used;
+	void *elements[15];
+};
+
+struct list {
+	struct list *tail;
+	void *head;
+	unsigned length;
+	unsigned ref_count;
+};
+
+struct block {
+	unsigned ref_count;
+	unsigned count;
+	struct list cells[];
+};
+
+struct suspension {
+	struct list list;
+	struct list *left;
+	struct list *right;
+	struct list *forced;
+};
 }
 
+#define BLOCK_OF(cell) ((struct block *)((char *)(cell) - offsetof(struct block, cells)))
+#define CHUNK_OF(list) ((struct chunk *)((uintptr_t)(list) & ~(uintptr_t)15))
+
 #include <fstream>
 #include <string>
 #include <map>
+#include <vector>
 #include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
 #include "catch.hpp"
 
 
@@ -45,6 +93,107 @@ int equals_mock(const char *l, const char *r) {
 	return champ_equals_str(l, r);
 };
 
+int owned_keys = 0;
+
+// keys decoded from deltas, with their reference counts, freed when those drop to 0
+std::map<const char *, int> decoded_keys;
+
+CHAMP_MAKE_KEY_DECODEFN(decode_owned_key, buffer, size) {
+	char *key = (char *)malloc(size);
+	memcpy(key, buffer, size);
+	decoded_keys[key] = 0;
+	return key;
+}
+
+CHAMP_MAKE_VALUE_ENCODEFN(encode_decimal, value, buffer, capacity) {
+	return (size_t)snprintf((char *)buffer, capacity, "%lu", (unsigned long)(uintptr_t)value) + 1;
+}
+
+CHAMP_MAKE_VALUE_DECODEFN(decode_decimal, buffer, size) {
+	(void)size;
+	return (int *)(uintptr_t)strtoul((const char *)buffer, nullptr, 10);
+}
+
+/*
+ * References held by atoms in tests. They are never freed, so their counts can still be checked once released.
+ */
+struct counted {
+	int ref_count;
+};
+
+int counted_acquires = 0;
+int counted_releases = 0;
+
+atom_ref counted_acquire(atom_ref ref) {
+	if (ref) {
+		++counted_acquires;
+		++((struct counted *)ref)->ref_count;
+	}
+	return ref;
+}
+
+void counted_release(atom_ref *ref) {
+	if (*ref) {
+		++counted_releases;
+		--((struct counted *)*ref)->ref_count;
+	}
+	*ref = nullptr;
+}
+
+atom_ref compute_arg(atom_ref current, void *arg) {
+	(void)current;
+	return arg;
+}
+
+// publishes interloper on the first call, as if another thread had won the race
+atom_ref compute_interrupted(atom_ref current, void *arg) {
+	static int interrupted = 0;
+	auto atom = (struct atom *)((void **)arg)[0];
+	if (!interrupted) {
+		interrupted = 1;
+		auto ref = atom_swap(atom, compute_arg, ((void **)arg)[1]);
+		counted_release(&ref);
+	} else {
+		interrupted = 0;
+	}
+	(void)current;
+	return ((void **)arg)[2];
+}
+
+// a CLOCK_MONOTONIC time that everything published from now on is known to come after
+uint64_t nsecs_passed() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const uint64_t passed = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec == passed);
+	return passed;
+}
+
+/*
+ * Pulls served from a child process, over a pair of pipes.
+ */
+struct champ *sync_from_child(const struct champ *served, const struct champ *replica, unsigned long *nodes_received) {
+	int requests[2], responses[2];
+	if (pipe(requests) || pipe(responses))
+		return nullptr;
+	pid_t child = fork();
+	if (child == 0) {
+		close(requests[1]);
+		close(responses[0]);
+		_exit(champ_sync_serve(served, requests[0], responses[1], nullptr, encode_decimal) ? 1 : 0);
+	}
+	close(requests[0]);
+	close(responses[1]);
+	struct champ *result = champ_sync_pull(replica, responses[0], requests[1], nullptr, decode_decimal, nodes_received);
+	close(requests[1]);
+	close(responses[0]);
+	int status = -1;
+	waitpid(child, &status, 0);
+	return status == 0 ? result : nullptr;
+}
+
 SCENARIO("The default champ implementation") {
 	GIVEN("a champ<string, ?>") {
 
@@ -437,7 +586,9 @@ SCENARIO("The default champ implementation") {
 				REQUIRE(before[2] != after[2]);
 				REQUIRE(before[3] != after[3]);
 
-				REQUIRE(before[0]->ref_count == 1);
+				// the root is allocated together with its map
+				REQUIRE(before[0]->ref_count == 0xfff1);
+				REQUIRE((char *)before[0] == (char *)map + sizeof(struct champ));
 				REQUIRE(before[1]->ref_count == 1);
 				REQUIRE(before[2]->ref_count == 1);
 				REQUIRE(before[3]->ref_count == 1);
@@ -445,7 +596,7 @@ SCENARIO("The default champ implementation") {
 				champ_destroy(&map);
 				map = tmp;
 
-				REQUIRE(after[0]->ref_count == 1);
+				REQUIRE(after[0]->ref_count == 0xfff1);
 				REQUIRE(after[1]->ref_count == 1);
 				REQUIRE(after[2]->ref_count == 1);
 				REQUIRE(after[3]->ref_count == 1);
@@ -1319,4 +1470,1869 @@ SCENARIO("The default champ implementation") {
 		champ_destroy(&l0);
 		champ_destroy(&r0);
 	}
+
+	GIVEN("A snapshot of a map with colliding keys") {
+		auto hash = [](const char *key) {
+			return key[0] == 'c' ? 0u : champ_hash_str(key);
+		};
+		auto codec = [](const char *key, void *buffer, size_t capacity) {
+			size_t size = strlen(key) + 1;
+			if (size <= capacity) memcpy(buffer, key, size);
+			return size;
+		};
+		auto value_equals = [](const int *l, const int *r) {
+			return (int)(l == r);
+		};
+
+		const char *keys[] = {"c1", "c2", "c3", "one", "two", "three", "four", "five", "six", "seven", "eight", "nine"};
+		auto map = champ_new(hash, champ_equals_str);
+		for (long i = 0; i < 12; ++i) {
+			auto tmp = champ_set(map, keys[i], (int *)(i + 1), nullptr);
+			champ_destroy(&map);
+			map = tmp;
+		}
+
+		char path[] = "/tmp/champ_snapshot_XXXXXX";
+		int fd = mkstemp(path);
+		REQUIRE(fd >= 0);
+		REQUIRE(champ_write_snapshot(map, fd, codec, nullptr) == 0);
+		close(fd);
+
+		auto mapped = champ_open_snapshot(path, hash, champ_equals_str, nullptr);
+		unlink(path);
+		REQUIRE(mapped != nullptr);
+
+		WHEN("Looking up keys") {
+			THEN("All entries should be found") {
+				REQUIRE(champ_length(mapped) == 12);
+				for (long i = 0; i < 12; ++i) {
+					int found = 0;
+					REQUIRE(champ_get(mapped, keys[i], &found) == (int *)(i + 1));
+					REQUIRE(found == 1);
+				}
+				REQUIRE(champ_get(mapped, "ten", nullptr) == nullptr);
+				REQUIRE(champ_get(mapped, "c4", nullptr) == nullptr);
+			}
+		}
+
+		WHEN("Iterating") {
+			struct champ_iter iter;
+			char *key;
+			int *value;
+			long sum = 0, count = 0;
+
+			champ_iter_init(&iter, mapped);
+			while (champ_iter_next(&iter, &key, &value)) {
+				REQUIRE(champ_get(map, key, nullptr) == value);
+				sum += (long)value;
+				++count;
+			}
+
+			THEN("Every entry should be visited once") {
+				REQUIRE(count == 12);
+				REQUIRE(sum == 78);
+			}
+		}
+
+		WHEN("Deriving maps from the snapshot") {
+			auto set = champ_set(mapped, "c2", (int *)42, nullptr);
+			auto del = champ_del(mapped, "c1", nullptr);
+
+			THEN("They should share the snapshot's nodes but not modify them") {
+				REQUIRE(champ_get(set, "c2", nullptr) == (int *)42);
+				REQUIRE(champ_get(mapped, "c2", nullptr) == (int *)2);
+				REQUIRE(champ_get(del, "c1", nullptr) == nullptr);
+				REQUIRE(champ_get(del, "c3", nullptr) == (int *)3);
+				REQUIRE(champ_get(del, "nine", nullptr) == (int *)12);
+				REQUIRE(champ_equals(mapped, map, value_equals));
+			}
+
+			champ_destroy(&set);
+			champ_destroy(&del);
+		}
+
+		WHEN("The snapshot is opened from memory") {
+			// values are written as decimal strings
+			auto value_codec = [](const int *value, void *buffer, size_t capacity) {
+				char digits[16];
+				size_t size = (size_t)snprintf(digits, sizeof digits, "%ld", (long)value) + 1;
+				if (size <= capacity) memcpy(buffer, digits, size);
+				return size;
+			};
+			char path[] = "/tmp/champ_snapshot_XXXXXX";
+			int fd = mkstemp(path);
+			REQUIRE(fd >= 0);
+			REQUIRE(champ_write_snapshot(map, fd, codec, value_codec) == 0);
+			struct stat stat;
+			REQUIRE(fstat(fd, &stat) == 0);
+			std::vector<uint64_t> image((stat.st_size + 7) / 8);
+			REQUIRE(pread(fd, image.data(), stat.st_size, 0) == stat.st_size);
+			close(fd);
+			unlink(path);
+			const std::vector<uint64_t> pristine = image;
+
+			auto in_memory = champ_open_snapshot_image(image.data(), stat.st_size, hash, champ_equals_str, nullptr);
+			REQUIRE(in_memory != nullptr);
+			auto set = champ_set(in_memory, "ten", (int *)"10", nullptr);
+
+			THEN("Keys and values should be read from the image, which stays untouched") {
+				REQUIRE(champ_length(in_memory) == 12);
+				for (long i = 0; i < 12; ++i) {
+					auto value = (const char *)champ_get(in_memory, keys[i], nullptr);
+					REQUIRE(value > (const char *)image.data());
+					REQUIRE(value < (const char *)image.data() + stat.st_size);
+				}
+				REQUIRE(strcmp((const char *)champ_get(in_memory, "c3", nullptr), "3") == 0);
+				REQUIRE(champ_get(in_memory, "ten", nullptr) == nullptr);
+				REQUIRE(champ_get(set, "ten", nullptr) == (int *)"10");
+				REQUIRE(strcmp((const char *)champ_get(set, "nine", nullptr), "12") == 0);
+
+				struct champ_iter iter;
+				char *key;
+				int *value;
+				long sum = 0, count = 0;
+				champ_iter_init(&iter, in_memory);
+				while (champ_iter_next(&iter, &key, &value)) {
+					REQUIRE(atol((const char *)value) == (long)champ_get(map, key, nullptr));
+					sum += atol((const char *)value);
+					++count;
+				}
+				REQUIRE(count == 12);
+				REQUIRE(sum == 78);
+				REQUIRE(image == pristine);
+			}
+
+			THEN("Truncated or misaligned images should be refused") {
+				REQUIRE(champ_open_snapshot_image(image.data(), 16, hash, champ_equals_str, nullptr) == nullptr);
+				REQUIRE(champ_open_snapshot_image((char *)image.data() + 1, stat.st_size - 1, hash,
+								  champ_equals_str, nullptr) == nullptr);
+			}
+
+			champ_destroy(&set);
+			champ_close_snapshot(&in_memory);
+		}
+
+		champ_close_snapshot(&mapped);
+		champ_destroy(&map);
+	}
+
+	GIVEN("A store with two versions of a map") {
+		auto codec = [](const char *key, void *buffer, size_t capacity) {
+			size_t size = strlen(key) + 1;
+			if (size <= capacity) memcpy(buffer, key, size);
+			return size;
+		};
+		auto file_size = [](const char *path) {
+			struct stat st;
+			stat(path, &st);
+			return (long)st.st_size;
+		};
+
+		char path[] = "/tmp/champ_store_XXXXXX";
+		close(mkstemp(path));
+		auto store = champ_store_open(path, champ_hash_str, champ_equals_str, nullptr, codec, nullptr);
+		REQUIRE(store != nullptr);
+		REQUIRE(champ_store_latest(store) == 0);
+
+		std::ifstream words("lorem_ipsum_words");
+		std::string word;
+		std::vector<std::string> keys;
+		while (words >> word && keys.size() < 500) keys.push_back(word);
+
+		auto map = champ_new(champ_hash_str, champ_equals_str);
+		for (size_t i = 0; i < keys.size(); ++i) {
+			auto tmp = champ_set(map, (char *)keys[i].c_str(), (int *)(i + 1), nullptr);
+			champ_destroy(&map);
+			map = tmp;
+		}
+
+		auto first = champ_store_commit(store, map);
+		long first_size = file_size(path);
+		auto v1 = champ_store_load(store, first);
+		auto changed = champ_set(v1, (char *)"a completely new key", (int *)-1, nullptr);
+		auto second = champ_store_commit(store, changed);
+		long second_size = file_size(path);
+		auto v2 = champ_store_load(store, second);
+
+		WHEN("Committing a derived map") {
+			THEN("Only the changed nodes should be appended") {
+				REQUIRE(first != 0);
+				REQUIRE(second != 0);
+				REQUIRE(second_size - first_size < first_size / 10);
+			}
+
+			THEN("Both versions should be readable") {
+				REQUIRE(champ_store_latest(store) == second);
+				REQUIRE(champ_store_previous(store, second) == first);
+				REQUIRE(champ_store_previous(store, first) == 0);
+				REQUIRE(champ_length(v2) == champ_length(v1) + 1);
+				REQUIRE(champ_get(v1, "a completely new key", nullptr) == nullptr);
+				REQUIRE(champ_get(v2, "a completely new key", nullptr) == (int *)-1);
+				REQUIRE(champ_equals(v1, map, [](const int *l, const int *r) { return (int)(l == r); }));
+			}
+		}
+
+		WHEN("Compacting to the latest version") {
+			char compacted_path[] = "/tmp/champ_store_XXXXXX";
+			close(mkstemp(compacted_path));
+			REQUIRE(champ_store_compact(store, compacted_path, 1) == 0);
+			long compacted_size = file_size(compacted_path);
+			auto compacted = champ_store_open(compacted_path, champ_hash_str, champ_equals_str, nullptr, codec, nullptr);
+			unlink(compacted_path);
+
+			THEN("Only the latest version should be left") {
+				REQUIRE(compacted != nullptr);
+				REQUIRE(champ_store_previous(compacted, champ_store_latest(compacted)) == 0);
+				REQUIRE(compacted_size < second_size);
+				auto latest = champ_store_load(compacted, champ_store_latest(compacted));
+				REQUIRE(champ_equals(latest, v2, [](const int *l, const int *r) { return (int)(l == r); }));
+				champ_destroy(&latest);
+			}
+
+			champ_store_close(&compacted);
+		}
+
+		WHEN("Storing maps with value hashes") {
+			auto value_hash = [](const int *value) { return (uint32_t)(uintptr_t)value; };
+			auto value_equals = [](const int *l, const int *r) { return (int)(l == r); };
+			auto hashed = champ_new_hashed(champ_hash_str, champ_equals_str, value_hash);
+			for (size_t i = 0; i < keys.size(); ++i) {
+				auto tmp = champ_set(hashed, (char *)keys[i].c_str(), (int *)(i + 1), nullptr);
+				champ_destroy(&hashed);
+				hashed = tmp;
+			}
+
+			char hashed_path[] = "/tmp/champ_store_XXXXXX";
+			close(mkstemp(hashed_path));
+			auto hashed_store = champ_store_open(hashed_path, champ_hash_str, champ_equals_str, value_hash, codec,
+							     nullptr);
+			REQUIRE(hashed_store != nullptr);
+			auto record = champ_store_commit(hashed_store, hashed);
+			auto loaded = champ_store_load(hashed_store, record);
+			auto updated = champ_set(loaded, keys[3].c_str(), (int *)-1, nullptr);
+			auto expected = champ_set(hashed, keys[3].c_str(), (int *)-1, nullptr);
+
+			THEN("Loaded versions should keep their hashes up to date") {
+				REQUIRE(record != 0);
+				REQUIRE(champ_hash(loaded) == champ_hash(hashed));
+				REQUIRE(champ_hash(updated) == champ_hash(expected));
+				REQUIRE(champ_equals(updated, expected, value_equals));
+				REQUIRE_FALSE(champ_equals(updated, hashed, value_equals));
+			}
+
+			THEN("Stores should only take maps and value hashes of their kind") {
+				REQUIRE(champ_store_commit(hashed_store, map) == 0);
+				REQUIRE(champ_store_commit(store, hashed) == 0);
+				auto reopened = champ_store_open(hashed_path, champ_hash_str, champ_equals_str, nullptr, codec,
+								 nullptr);
+				REQUIRE(reopened == nullptr);
+				reopened = champ_store_open(path, champ_hash_str, champ_equals_str, value_hash, codec, nullptr);
+				REQUIRE(reopened == nullptr);
+			}
+
+			champ_destroy(&expected);
+			champ_destroy(&updated);
+			champ_destroy(&loaded);
+			champ_destroy(&hashed);
+			champ_store_close(&hashed_store);
+			unlink(hashed_path);
+		}
+
+		champ_destroy(&v2);
+		champ_destroy(&changed);
+		champ_destroy(&v1);
+		champ_destroy(&map);
+		champ_store_close(&store);
+		unlink(path);
+	}
+
+	GIVEN("A map and a slightly changed version of it") {
+		std::ifstream words("lorem_ipsum_words");
+		std::string word;
+		std::vector<std::string> keys;
+		while (words >> word && keys.size() < 1000) keys.push_back(word);
+
+		auto map = champ_new(champ_hash_str, champ_equals_str);
+		for (size_t i = 0; i < keys.size(); ++i) {
+			auto tmp = champ_set(map, (char *)keys[i].c_str(), (int *)(i + 1), nullptr);
+			champ_destroy(&map);
+			map = tmp;
+		}
+		auto changed = champ_set(map, (char *)"a completely new key", (int *)-1, nullptr);
+
+		struct champ_stats stats, changed_stats;
+		champ_stats(map, &stats);
+		champ_stats(changed, &changed_stats);
+
+		WHEN("Collecting statistics") {
+			THEN("Every entry should be accounted for") {
+				unsigned long entries = 0, nodes = 0, arity_nodes = 0;
+				for (int depth = 0; depth < 8; ++depth) {
+					entries += stats.entries_by_depth[depth];
+					nodes += stats.nodes_by_depth[depth];
+				}
+				for (int arity = 0; arity <= 32; ++arity) arity_nodes += stats.nodes_by_arity[arity];
+
+				REQUIRE(stats.entries == champ_length(map));
+				REQUIRE(entries == stats.entries);
+				REQUIRE(nodes == stats.nodes + stats.collision_nodes);
+				REQUIRE(arity_nodes == stats.nodes);
+				REQUIRE(stats.nodes_by_depth[0] == 1);
+				REQUIRE(stats.average_fill > 0);
+				REQUIRE(stats.average_fill <= 1);
+				REQUIRE(stats.bytes_per_entry * stats.entries == Approx(stats.bytes + stats.pinned_bytes));
+			}
+		}
+
+		WHEN("Measuring structural sharing") {
+			THEN("Most of the nodes should be shared") {
+				size_t own = stats.bytes - sizeof(struct champ);
+				REQUIRE(champ_shared_bytes(map, map) == own);
+				REQUIRE(champ_shared_bytes(map, changed) > own / 2);
+				REQUIRE(champ_shared_bytes(map, changed) < own);
+				REQUIRE(champ_shared_bytes(changed, map) == champ_shared_bytes(map, changed));
+			}
+		}
+
+		champ_destroy(&changed);
+		champ_destroy(&map);
+	}
+
+	GIVEN("A frozen map") {
+		std::ifstream words("lorem_ipsum_words");
+		std::string word;
+		std::vector<std::string> keys;
+		while (words >> word) keys.push_back(word);
+
+		auto map = champ_new(champ_hash_str, champ_equals_str);
+		for (size_t i = 0; i < keys.size(); ++i) {
+			auto tmp = champ_set(map, (char *)keys[i].c_str(), (int *)(i + 1), nullptr);
+			champ_destroy(&map);
+			map = tmp;
+		}
+		auto frozen = champ_freeze(map, 0);
+		auto value_equals = [](const int *l, const int *r) { return (int)(l == r); };
+
+		WHEN("Reading from it") {
+			THEN("It should be equal to the original") {
+				REQUIRE(champ_length(frozen) == champ_length(map));
+				REQUIRE(champ_equals(frozen, map, value_equals));
+				for (auto &key : keys) {
+					REQUIRE(champ_get(frozen, key.c_str(), nullptr) == champ_get(map, key.c_str(), nullptr));
+				}
+			}
+
+			THEN("Its nodes should be pinned and contiguous") {
+				struct champ_stats stats;
+				champ_stats(frozen, &stats);
+				REQUIRE(frozen->root->ref_count == 0xfff0);
+				REQUIRE(stats.bytes == sizeof(struct champ));
+				REQUIRE(stats.pinned_bytes > 0);
+				auto first_branch = *(struct node **)&frozen->root->content[frozen->root->element_arity];
+				REQUIRE((char *)first_branch == (char *)frozen->root + sizeof(struct node)
+					+ frozen->root->element_arity * sizeof frozen->root->content[0]
+					+ frozen->root->branch_arity * sizeof(struct node *));
+			}
+		}
+
+		WHEN("Deriving a map from it") {
+			auto changed = champ_set(frozen, (char *)"a completely new key", (int *)-1, nullptr);
+
+			THEN("Only the changed path should be copied to the heap") {
+				REQUIRE(changed->root->ref_count == 0xfff1);
+				REQUIRE(champ_get(changed, "a completely new key", nullptr) == (int *)-1);
+				REQUIRE(champ_get(frozen, "a completely new key", nullptr) == nullptr);
+				REQUIRE(champ_shared_bytes(frozen, changed) > 0);
+			}
+
+			champ_destroy(&changed);
+		}
+
+		champ_destroy(&frozen);
+		champ_destroy(&map);
+	}
+
+	GIVEN("A map and updates that change nothing") {
+		int a = 1, b = 2;
+		auto map0 = champ_new(champ_hash_str, champ_equals_str);
+		auto map1 = champ_set(map0, (char *)"a", &a, nullptr);
+		auto map2 = champ_set(map1, (char *)"b", &b, nullptr);
+		auto keep = [](const char *key, const int *current, void *user_data) {
+			(void)key;
+			return current ? (int *)current : (int *)user_data;
+		};
+
+		WHEN("Setting a key to its current value") {
+			int replaced = 0;
+			auto same = champ_set(map2, (char *)"a", &a, &replaced);
+
+			THEN("The same map should be returned") {
+				REQUIRE(same == map2);
+				REQUIRE(replaced == 1);
+			}
+		}
+
+		WHEN("An assoc function returns the current value") {
+			auto same = champ_assoc(map2, (char *)"b", keep, &a);
+
+			THEN("The same map should be returned") {
+				REQUIRE(same == map2);
+				REQUIRE(champ_get(map2, "b", nullptr) == &b);
+			}
+		}
+
+		WHEN("Setting a key to an equal but not identical value") {
+			int a2 = 1;
+			auto changed = champ_set(map2, (char *)"a", &a2, nullptr);
+
+			THEN("A new map should be returned") {
+				REQUIRE(changed != map2);
+				REQUIRE(champ_get(changed, "a", nullptr) == &a2);
+			}
+
+			champ_destroy(&changed);
+		}
+
+		champ_destroy(&map2);
+		champ_destroy(&map1);
+		champ_destroy(&map0);
+	}
+
+	GIVEN("Maps with value hashes") {
+		std::ifstream words("lorem_ipsum_words");
+		std::string word;
+		std::vector<std::string> keys;
+		while (words >> word && keys.size() < 2000) keys.push_back(word);
+
+		auto value_hash = [](const int *value) { return (uint32_t)(uintptr_t)value; };
+		auto value_equals = [](const int *l, const int *r) { return (int)(l == r); };
+		auto forward = champ_new_hashed(champ_hash_str, champ_equals_str, value_hash);
+		auto backward = champ_new_hashed(champ_hash_str, champ_equals_str, value_hash);
+		for (size_t i = 0; i < keys.size(); ++i) {
+			auto tmp = champ_set(forward, (char *)keys[i].c_str(), (int *)(uintptr_t)keys[i].size(), nullptr);
+			if (tmp != forward) {
+				champ_destroy(&forward);
+				forward = tmp;
+			}
+			tmp = champ_set(backward, (char *)keys[keys.size() - 1 - i].c_str(), (int *)(uintptr_t)keys[keys.size() - 1 - i].size(), nullptr);
+			if (tmp != backward) {
+				champ_destroy(&backward);
+				backward = tmp;
+			}
+		}
+
+		WHEN("They have the same contents") {
+			THEN("Their hashes should be equal regardless of insertion order") {
+				REQUIRE(champ_hash(forward) == champ_hash(backward));
+				REQUIRE(champ_equals(forward, backward, value_equals));
+			}
+		}
+
+		WHEN("A value differs") {
+			auto changed = champ_set(forward, (char *)keys[0].c_str(), (int *)-1, nullptr);
+			auto restored = champ_set(changed, (char *)keys[0].c_str(), (int *)(uintptr_t)keys[0].size(), nullptr);
+
+			THEN("The hashes should differ until the value is restored") {
+				REQUIRE(champ_hash(changed) != champ_hash(forward));
+				REQUIRE_FALSE(champ_equals(changed, forward, value_equals));
+				REQUIRE(champ_hash(restored) == champ_hash(forward));
+				REQUIRE(champ_equals(restored, forward, value_equals));
+			}
+
+			champ_destroy(&restored);
+			champ_destroy(&changed);
+		}
+
+		WHEN("One of them is written to a snapshot") {
+			auto codec = [](const char *key, void *buffer, size_t capacity) {
+				size_t size = strlen(key) + 1;
+				if (size <= capacity) memcpy(buffer, key, size);
+				return size;
+			};
+			char path[] = "/tmp/champ_snapshot_XXXXXX";
+			int fd = mkstemp(path);
+			REQUIRE(fd >= 0);
+			REQUIRE(champ_write_snapshot(forward, fd, codec, nullptr) == 0);
+			close(fd);
+			auto unhashed = champ_open_snapshot(path, champ_hash_str, champ_equals_str, nullptr);
+			auto mapped = champ_open_snapshot(path, champ_hash_str, champ_equals_str, value_hash);
+			unlink(path);
+			REQUIRE(mapped != nullptr);
+
+			auto changed = champ_set(mapped, keys[0].c_str(), (int *)-1, nullptr);
+			auto expected = champ_set(forward, keys[0].c_str(), (int *)-1, nullptr);
+
+			THEN("It should only open with a value hash, and keep its hashes up to date") {
+				REQUIRE(unhashed == nullptr);
+				REQUIRE(champ_hash(mapped) == champ_hash(forward));
+				REQUIRE(champ_hash(changed) == champ_hash(expected));
+				REQUIRE(champ_equals(changed, expected, value_equals));
+				REQUIRE_FALSE(champ_equals(changed, forward, value_equals));
+			}
+
+			champ_destroy(&expected);
+			champ_destroy(&changed);
+			champ_close_snapshot(&mapped);
+		}
+
+		WHEN("Entries are removed and added back") {
+			auto smaller = forward;
+			for (size_t i = 0; i < 100; ++i) {
+				auto tmp = champ_del(smaller, keys[i].c_str(), nullptr);
+				if (tmp != smaller && smaller != forward) champ_destroy(&smaller);
+				smaller = tmp;
+			}
+			auto empty = champ_new_hashed(champ_hash_str, champ_equals_str, value_hash);
+
+			THEN("The hash should follow the contents") {
+				REQUIRE(champ_hash(smaller) != champ_hash(forward));
+				REQUIRE(champ_hash(empty) == 0);
+
+				auto grown = smaller;
+				for (size_t i = 0; i < 100; ++i) {
+					auto tmp = champ_set(grown, (char *)keys[i].c_str(), (int *)(uintptr_t)keys[i].size(), nullptr);
+					if (tmp != grown && grown != smaller) champ_destroy(&grown);
+					grown = tmp;
+				}
+				REQUIRE(champ_hash(grown) == champ_hash(forward));
+				REQUIRE(champ_equals(grown, forward, value_equals));
+				if (grown != smaller) champ_destroy(&grown);
+			}
+
+			champ_destroy(&empty);
+			if (smaller != forward) champ_destroy(&smaller);
+		}
+
+		champ_destroy(&backward);
+		champ_destroy(&forward);
+	}
+
+	GIVEN("Deferred reclamation") {
+		std::ifstream words("lorem_ipsum_words");
+		std::string word;
+		std::vector<std::string> keys;
+		while (words >> word && keys.size() < 2000) keys.push_back(word);
+
+		auto map = champ_new(champ_hash_str, champ_equals_str);
+		for (size_t i = 0; i < keys.size(); ++i) {
+			auto tmp = champ_set(map, (char *)keys[i].c_str(), (int *)(i + 1), nullptr);
+			if (tmp != map) champ_destroy(&map);
+			map = tmp;
+		}
+		auto smaller = champ_del(map, (char *)keys[0].c_str(), nullptr);
+
+		champ_defer_reclamation(1);
+		champ_destroy(&map);
+		champ_destroy(&smaller);
+		champ_defer_reclamation(0);
+
+		THEN("Nodes should only be freed by champ_reclaim, a slice at a time") {
+			REQUIRE(champ_reclaim_pending() > 0);
+			REQUIRE(champ_reclaim(5) == 5);
+			while (champ_reclaim(5) > 0);
+			REQUIRE(champ_reclaim_pending() == 0);
+		}
+
+		champ_reclaim(SIZE_MAX);
+	}
+
+	GIVEN("A small map") {
+		auto hash = [](const char *key) { return (uint32_t)(uintptr_t)key; };
+		auto equals = [](const char *l, const char *r) { return (int)(l == r); };
+		auto value_hash = [](const int *value) { return (uint32_t)(uintptr_t)value; };
+		auto value_equals = [](const int *l, const int *r) { return (int)(l == r); };
+		auto constant = [](const char *, const int *, void *user_data) { return (int *)user_data; };
+
+		auto map = champ_new_hashed(hash, equals, value_hash);
+		auto assoced = champ_new_hashed(hash, equals, value_hash);
+		for (uintptr_t i = 0; i < 8; ++i) {
+			auto tmp = champ_set(map, (char *)i, (int *)(i + 1), nullptr);
+			champ_destroy(&map);
+			map = tmp;
+			tmp = champ_assoc(assoced, (char *)i, constant, (int *)(i + 1));
+			champ_destroy(&assoced);
+			assoced = tmp;
+		}
+
+		THEN("Its root should live inside the map") {
+			struct champ_stats stats;
+			champ_stats(map, &stats);
+			REQUIRE(stats.nodes == 1);
+			REQUIRE(stats.pinned_bytes == 0);
+			REQUIRE(stats.bytes > sizeof(struct champ));
+		}
+
+		THEN("All its versions should share one type") {
+			REQUIRE(map->type == assoced->type);
+			REQUIRE(map->type == champ_type_intern(hash, equals, value_hash));
+			REQUIRE(map->type != champ_type_intern(hash, equals, nullptr));
+		}
+
+		THEN("It should equal the same map built through the trie") {
+			REQUIRE(champ_hash(map) == champ_hash(assoced));
+			REQUIRE(champ_equals(map, assoced, value_equals));
+		}
+
+		WHEN("It grows beyond the inline limit") {
+			auto bigger = map;
+			for (uintptr_t i = 8; i < 40; ++i) {
+				auto tmp = champ_set(bigger, (char *)i, (int *)(i + 1), nullptr);
+				if (bigger != map) champ_destroy(&bigger);
+				bigger = tmp;
+			}
+
+			THEN("Every entry should still be found") {
+				REQUIRE(champ_length(bigger) == 40);
+				for (uintptr_t i = 0; i < 40; ++i) {
+					REQUIRE(champ_get(bigger, (char *)i, nullptr) == (int *)(i + 1));
+				}
+			}
+
+			champ_destroy(&bigger);
+		}
+
+		WHEN("Its entries are replaced and deleted") {
+			int replaced = 0, modified = 0;
+			auto changed = champ_set(map, (char *)3, (int *)42, &replaced);
+			auto smaller = champ_del(changed, (char *)5, &modified);
+
+			THEN("The map should reflect the changes") {
+				REQUIRE(replaced);
+				REQUIRE(modified);
+				REQUIRE(champ_length(changed) == 8);
+				REQUIRE(champ_get(changed, (char *)3, nullptr) == (int *)42);
+				REQUIRE(champ_length(smaller) == 7);
+				REQUIRE(champ_get(smaller, (char *)5, nullptr) == nullptr);
+				REQUIRE(champ_get(smaller, (char *)6, nullptr) == (int *)7);
+				REQUIRE(champ_del(smaller, (char *)5, nullptr) == smaller);
+				REQUIRE(champ_hash(map) != champ_hash(changed));
+			}
+
+			champ_destroy(&smaller);
+			champ_destroy(&changed);
+		}
+
+		champ_destroy(&assoced);
+		champ_destroy(&map);
+	}
+
+	GIVEN("A map that owns its entries") {
+		std::ifstream words("lorem_ipsum_words");
+		std::string word;
+		std::vector<std::string> keys;
+		while (words >> word && keys.size() < 1000) keys.push_back(word);
+		std::vector<int> refs(keys.size(), 0);
+
+		struct champ_type type = {};
+		// few enough hashes for a good share of the keys to end up in collision nodes
+		type.hash = [](const char *key) { return champ_hash_str(key) % 1024u; };
+		type.equals = champ_equals_str;
+		type.key_acquire = [](const char *) { ++owned_keys; };
+		type.key_release = [](const char *) { --owned_keys; };
+		type.value_acquire = [](const int *value) { ++*(int *)value; };
+		type.value_release = [](const int *value) { --*(int *)value; };
+
+		auto map = champ_new_typed(&type);
+		std::vector<struct champ *> versions;
+		for (size_t i = 0; i < keys.size(); ++i) {
+			auto tmp = champ_set(map, (char *)keys[i].c_str(), &refs[i], nullptr);
+			if (tmp != map) versions.push_back(map);
+			map = tmp;
+		}
+		for (size_t i = 0; i < keys.size(); i += 2) {
+			auto tmp = champ_del(map, (char *)keys[i].c_str(), nullptr);
+			if (tmp != map) versions.push_back(map);
+			map = tmp;
+		}
+		versions.push_back(map);
+
+		THEN("Its entries should only be released once no version refers to them") {
+			auto empty = champ_new_typed(&type);
+			REQUIRE(empty->type == map->type);
+			champ_destroy(&empty);
+			while (versions.size() > 1) {
+				champ_destroy(&versions.front());
+				versions.erase(versions.begin());
+			}
+			REQUIRE(owned_keys == (int)champ_length(map));
+			std::map<std::string, size_t> live;
+			for (size_t i = 0; i < keys.size(); ++i) live[keys[i]] = i;
+			for (size_t i = 0; i < keys.size(); i += 2) live.erase(keys[i]);
+			for (size_t i = 0; i < keys.size(); ++i) {
+				REQUIRE(refs[i] == (int)(live.count(keys[i]) && live[keys[i]] == i));
+			}
+
+			struct champ *parts[32];
+			champ_split(map, parts);
+			champ_destroy(&versions.front());
+			versions.clear();
+			auto joined = champ_join(parts);
+			for (auto &part : parts) champ_destroy(&part);
+			REQUIRE(owned_keys == (int)champ_length(joined));
+
+			champ_destroy(&joined);
+			REQUIRE(owned_keys == 0);
+			REQUIRE(std::count(refs.begin(), refs.end(), 0) == (long)refs.size());
+		}
+
+		WHEN("Its changes are sent as a delta") {
+			auto codec = [](const char *key, void *buffer, size_t capacity) {
+				size_t size = strlen(key) + 1;
+				if (size <= capacity) memcpy(buffer, key, size);
+				return size;
+			};
+			struct champ_type hashed_type = type;
+			hashed_type.value_hash = [](const int *value) { return (uint32_t)(uintptr_t)value; };
+			hashed_type.key_acquire = [](const char *key) {
+				if (decoded_keys.count(key)) ++decoded_keys[key];
+			};
+			hashed_type.key_release = [](const char *key) {
+				if (decoded_keys.count(key) && --decoded_keys[key] == 0) {
+					decoded_keys.erase(key);
+					free((void *)key);
+				}
+			};
+			auto base = champ_new_typed(&hashed_type);
+			for (size_t i = 0; i < 60; ++i) {
+				auto tmp = champ_set(base, (char *)keys[i].c_str(), &refs[i], nullptr);
+				if (tmp != base) champ_destroy(&base);
+				base = tmp;
+			}
+			auto target = base;
+			for (size_t i = 50; i < 70; ++i) {
+				auto tmp = i < 60 ? champ_del(target, keys[i].c_str(), nullptr) :
+					champ_set(target, (char *)keys[i].c_str(), &refs[i], nullptr);
+				if (tmp != target && target != base) champ_destroy(&target);
+				target = tmp;
+			}
+
+			int pair[2];
+			REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+			const int unhashed = champ_encode_delta(versions.front(), map, pair[0], codec, nullptr);
+			REQUIRE(champ_encode_delta(base, target, pair[0], codec, nullptr) == 0);
+			shutdown(pair[0], SHUT_WR);
+			std::vector<char> delta(65536);
+			delta.resize((size_t)read(pair[1], delta.data(), delta.size()));
+			close(pair[0]);
+			close(pair[1]);
+
+			auto apply = [&](size_t size) {
+				int pair[2];
+				REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+				REQUIRE(write(pair[0], delta.data(), size) == (ssize_t)size);
+				shutdown(pair[0], SHUT_WR);
+				auto applied = champ_apply_delta(base, pair[1], decode_owned_key, nullptr);
+				close(pair[0]);
+				close(pair[1]);
+				return applied;
+			};
+
+			THEN("Maps without value hashes should be refused") {
+				REQUIRE(unhashed == -1);
+			}
+
+			THEN("A truncated delta should release everything it decoded") {
+				for (size_t size = 0; size < delta.size(); ++size) {
+					REQUIRE(apply(size) == nullptr);
+					REQUIRE(decoded_keys.empty());
+				}
+				auto applied = apply(delta.size());
+				REQUIRE(applied != nullptr);
+				REQUIRE(champ_equals(applied, target, [](const int *l, const int *r) { return (int)(l == r); }));
+				REQUIRE(decoded_keys.size() == 10);
+				champ_destroy(&applied);
+				REQUIRE(decoded_keys.empty());
+			}
+
+			THEN("A base with the same keys but other values should be refused") {
+				auto other = champ_set(base, (char *)keys[0].c_str(), &refs[1], nullptr);
+				int pair[2];
+				REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+				REQUIRE(write(pair[0], delta.data(), delta.size()) == (ssize_t)delta.size());
+				REQUIRE(champ_apply_delta(other, pair[1], decode_owned_key, nullptr) == nullptr);
+				REQUIRE(decoded_keys.empty());
+				close(pair[0]);
+				close(pair[1]);
+				champ_destroy(&other);
+			}
+
+			if (target != base) champ_destroy(&target);
+			champ_destroy(&base);
+		}
+
+		WHEN("Reclamation is deferred") {
+			champ_defer_reclamation(1);
+			for (auto &version : versions) champ_destroy(&version);
+			champ_defer_reclamation(0);
+
+			THEN("Its entries should be released by champ_reclaim") {
+				REQUIRE(owned_keys > 0);
+				champ_reclaim(SIZE_MAX);
+				REQUIRE(owned_keys == 0);
+				REQUIRE(std::count(refs.begin(), refs.end(), 0) == (long)refs.size());
+			}
+		}
+
+		for (auto &version : versions) if (version) champ_destroy(&version);
+		champ_reclaim(SIZE_MAX);
+	}
+
+	GIVEN("Two replicas of a map") {
+		auto hash = [](const char *key) {
+			uint32_t h = (uint32_t)(uintptr_t)key * 0x9e3779b1u;
+			return h ^ (h >> 15);
+		};
+		auto value_hash = [](const int *value) { return (uint32_t)(uintptr_t)value; };
+		auto value_equals = [](const int *l, const int *r) { return (int)(l == r); };
+		auto original = champ_new_hashed(hash, [](const char *l, const char *r) { return (int)(l == r); }, value_hash);
+		for (uintptr_t i = 1; i <= 5000; ++i) {
+			auto tmp = champ_set(original, (char *)i, (int *)i, nullptr);
+			champ_destroy(&original);
+			original = tmp;
+		}
+		auto changed = original;
+		for (uintptr_t i : {17, 2500, 4999, 6000}) {
+			auto tmp = champ_set(changed, (char *)i, (int *)(i * 2), nullptr);
+			if (changed != original) champ_destroy(&changed);
+			changed = tmp;
+		}
+		auto tmp = champ_del(changed, (char *)3, nullptr);
+		champ_destroy(&changed);
+		changed = tmp;
+
+		WHEN("The outdated one pulls from the other") {
+			unsigned long nodes = 0;
+			auto pulled = sync_from_child(changed, original, &nodes);
+
+			THEN("It should receive only the nodes on the paths to the differences") {
+				REQUIRE(pulled != nullptr);
+				REQUIRE(champ_length(pulled) == champ_length(changed));
+				REQUIRE(champ_hash(pulled) == champ_hash(changed));
+				REQUIRE(champ_equals(pulled, changed, value_equals));
+				struct champ_stats stats;
+				champ_stats(changed, &stats);
+				REQUIRE(nodes > 0);
+				REQUIRE(nodes <= 5 * 4);
+				REQUIRE(nodes < stats.nodes / 10);
+				REQUIRE(champ_shared_bytes(original, pulled) > 0);
+			}
+
+			if (pulled && pulled != original) champ_destroy(&pulled);
+		}
+
+		WHEN("It pulls from a map it is in sync with") {
+			unsigned long nodes = 1;
+			auto pulled = sync_from_child(original, original, &nodes);
+
+			THEN("Nothing should be received") {
+				REQUIRE(pulled == original);
+				REQUIRE(nodes == 0);
+			}
+		}
+
+		WHEN("The changes are sent as a delta") {
+			int pair[2];
+			REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+			REQUIRE(champ_encode_delta(original, changed, pair[0], nullptr, encode_decimal) == 0);
+			int pending = 0;
+			ioctl(pair[1], FIONREAD, &pending);
+			auto applied = champ_apply_delta(original, pair[1], nullptr, decode_decimal);
+
+			THEN("Only the changes should have been sent") {
+				REQUIRE(pending < 200);
+				REQUIRE(applied != nullptr);
+				REQUIRE(champ_hash(applied) == champ_hash(changed));
+				REQUIRE(champ_equals(applied, changed, value_equals));
+			}
+
+			THEN("A delta between equal versions should leave the base as it is") {
+				REQUIRE(champ_encode_delta(changed, changed, pair[0], nullptr, encode_decimal) == 0);
+				REQUIRE(champ_apply_delta(changed, pair[1], nullptr, decode_decimal) == changed);
+			}
+
+			THEN("A delta should not apply to another base") {
+				REQUIRE(champ_encode_delta(original, changed, pair[0], nullptr, encode_decimal) == 0);
+				REQUIRE(champ_apply_delta(changed, pair[1], nullptr, decode_decimal) == nullptr);
+			}
+
+			if (applied) champ_destroy(&applied);
+			close(pair[0]);
+			close(pair[1]);
+		}
+
+		WHEN("The other side sends corrupt nodes") {
+			// a sync_node header: element_map, branch_map, hash, size, seed, element_arity, branch_arity
+			struct {
+				uint32_t maps_hash_size_seed[5];
+				uint16_t arities[2];
+			} oversized = {{1, 0, 0, 1, 0}, {0xfffe, 0}}, truncated = {{1, 0, 0, 1, 0}, {1, 0}};
+
+			auto pull_from = [&](const void *answer, size_t size) {
+				int pair[2];
+				REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+				REQUIRE(write(pair[1], answer, size) == (ssize_t)size);
+				shutdown(pair[1], SHUT_WR);
+				auto pulled = champ_sync_pull(original, pair[0], pair[0], nullptr, nullptr, nullptr);
+				close(pair[0]);
+				close(pair[1]);
+				return pulled;
+			};
+
+			THEN("The pull should fail without trusting their arities") {
+				REQUIRE(pull_from(&oversized, sizeof oversized) == nullptr);
+				REQUIRE(pull_from(&truncated, sizeof truncated) == nullptr);
+			}
+		}
+
+		WHEN("It has nothing to start from") {
+			auto empty = champ_new_hashed(hash, [](const char *l, const char *r) { return (int)(l == r); }, value_hash);
+			unsigned long nodes = 0;
+			auto pulled = sync_from_child(changed, empty, &nodes);
+
+			THEN("It should receive the whole map") {
+				REQUIRE(pulled != nullptr);
+				REQUIRE(champ_equals(pulled, changed, value_equals));
+				REQUIRE(champ_get(pulled, (char *)6000, nullptr) == (int *)12000);
+			}
+
+			if (pulled) champ_destroy(&pulled);
+			champ_destroy(&empty);
+		}
+
+		champ_destroy(&changed);
+		champ_destroy(&original);
+	}
+
+	GIVEN("A map to transform in bulk") {
+		std::ifstream words("lorem_ipsum_words");
+		std::string word;
+		std::vector<std::string> keys;
+		while (words >> word && keys.size() < 1000) keys.push_back(word);
+
+		auto hash = [](const char *key) { return champ_hash_str(key) % 1024u; };
+		auto value_hash = [](const int *value) { return (uint32_t)(uintptr_t)value; };
+		auto value_equals = [](const int *l, const int *r) { return (int)(l == r); };
+		auto map = champ_new_hashed(hash, champ_equals_str, value_hash);
+		for (size_t i = 0; i < keys.size(); ++i) {
+			auto tmp = champ_set(map, (char *)keys[i].c_str(), (int *)(uintptr_t)keys[i].size(), nullptr);
+			if (tmp != map) champ_destroy(&map);
+			map = tmp;
+		}
+
+		auto same_shape = [](const struct champ *l, const struct champ *r) {
+			struct champ_stats left, right;
+			champ_stats(l, &left);
+			champ_stats(r, &right);
+			return left.nodes == right.nodes && left.collision_nodes == right.collision_nodes &&
+				!memcmp(left.entries_by_depth, right.entries_by_depth, sizeof left.entries_by_depth);
+		};
+
+		THEN("Transforms that change nothing should return the map itself") {
+			REQUIRE(champ_map_values(map, [](const char *, const int *value, void *) { return (int *)value; }, nullptr) == map);
+			REQUIRE(champ_filter(map, [](const char *, const int *, void *) { return 1; }, nullptr) == map);
+			REQUIRE(champ_remove_if(map, [](const char *, const int *, void *) { return 0; }, nullptr) == map);
+		}
+
+		WHEN("Some values are replaced") {
+			auto mapped = champ_map_values(map, [](const char *key, const int *value, void *) {
+				return key[0] == 'a' ? (int *)((uintptr_t)value * 10) : (int *)value;
+			}, nullptr);
+			auto expected = map;
+			for (auto &key : keys) {
+				if (key[0] != 'a') continue;
+				auto tmp = champ_set(expected, (char *)key.c_str(), (int *)(uintptr_t)(key.size() * 10), nullptr);
+				if (expected != map && tmp != expected) champ_destroy(&expected);
+				expected = tmp;
+			}
+
+			THEN("The result should equal the map built with champ_set, and share the untouched subtrees") {
+				REQUIRE(champ_length(mapped) == champ_length(expected));
+				REQUIRE(champ_hash(mapped) == champ_hash(expected));
+				REQUIRE(champ_equals(mapped, expected, value_equals));
+				REQUIRE(champ_shared_bytes(map, mapped) > 0);
+			}
+
+			if (expected != map) champ_destroy(&expected);
+			champ_destroy(&mapped);
+		}
+
+		WHEN("Entries are filtered") {
+			auto even = [](const char *key, const int *, void *) { return (int)(strlen(key) % 2 == 0); };
+			auto filtered = champ_filter(map, even, nullptr);
+			auto removed = champ_remove_if(map, even, nullptr);
+			auto expected = map;
+			for (auto &key : keys) {
+				if (key.size() % 2 == 0) continue;
+				auto tmp = champ_del(expected, (char *)key.c_str(), nullptr);
+				if (expected != map && tmp != expected) champ_destroy(&expected);
+				expected = tmp;
+			}
+
+			THEN("The result should be the very trie champ_del leaves behind") {
+				REQUIRE(champ_length(filtered) + champ_length(removed) == champ_length(map));
+				REQUIRE(champ_equals(filtered, expected, value_equals));
+				REQUIRE(champ_hash(filtered) == champ_hash(expected));
+				REQUIRE(same_shape(filtered, expected));
+				REQUIRE(champ_get(removed, (char *)keys[0].c_str(), nullptr) == (int *)(uintptr_t)keys[0].size());
+			}
+
+			AND_WHEN("The changes are sent as a delta") {
+				int pair[2];
+				REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+				REQUIRE(champ_encode_delta(map, filtered, pair[0], nullptr, nullptr) == 0);
+				auto applied = champ_apply_delta(map, pair[1], nullptr, nullptr);
+				REQUIRE(champ_encode_delta(filtered, map, pair[0], nullptr, nullptr) == 0);
+				auto restored = champ_apply_delta(filtered, pair[1], nullptr, nullptr);
+
+				THEN("Either side should be rebuilt from the other") {
+					REQUIRE(applied != nullptr);
+					REQUIRE(champ_equals(applied, filtered, value_equals));
+					REQUIRE(same_shape(applied, filtered));
+					REQUIRE(restored != nullptr);
+					REQUIRE(champ_equals(restored, map, value_equals));
+				}
+
+				if (restored) champ_destroy(&restored);
+				if (applied) champ_destroy(&applied);
+				close(pair[0]);
+				close(pair[1]);
+			}
+
+			AND_WHEN("Everything is removed") {
+				auto empty = champ_remove_if(filtered, [](const char *, const int *, void *) { return 1; }, nullptr);
+
+				THEN("The result should be empty") {
+					REQUIRE(champ_length(empty) == 0);
+					REQUIRE(champ_hash(empty) == 0);
+				}
+
+				champ_destroy(&empty);
+			}
+
+			if (expected != map) champ_destroy(&expected);
+			champ_destroy(&removed);
+			champ_destroy(&filtered);
+		}
+
+		champ_destroy(&map);
+	}
+
+	GIVEN("A map with colliding and nested entries") {
+		auto hash = [](const char *key) {
+			return key[0] == 'c' ? 0u : champ_hash_str(key);
+		};
+		std::ifstream words("lorem_ipsum_words");
+		std::string word;
+		std::vector<std::string> keys {"c1", "c2", "c3"};
+		while (words >> word && keys.size() < 1000) keys.push_back(word);
+
+		auto map = champ_new(hash, champ_equals_str);
+		for (size_t i = 0; i < keys.size(); ++i) {
+			auto tmp = champ_set(map, (char *)keys[i].c_str(), (int *)(i + 1), nullptr);
+			champ_destroy(&map);
+			map = tmp;
+		}
+
+		WHEN("Accessing entries by position") {
+			THEN("The positions should follow iteration order") {
+				struct champ_iter iter;
+				char *key, *nth_key;
+				int *value, *nth_value;
+				unsigned index = 0;
+
+				champ_iter_init(&iter, map);
+				while (champ_iter_next(&iter, &key, &value)) {
+					REQUIRE(champ_nth(map, index, &nth_key, &nth_value));
+					REQUIRE(nth_key == key);
+					REQUIRE(nth_value == value);
+					++index;
+				}
+				REQUIRE(index == champ_length(map));
+				REQUIRE_FALSE(champ_nth(map, index, &nth_key, &nth_value));
+			}
+		}
+
+		WHEN("Sampling entries") {
+			auto random = [](void *state) {
+				uint32_t *x = (uint32_t *)state;
+				*x ^= *x << 13;
+				*x ^= *x >> 17;
+				*x ^= *x << 5;
+				return *x;
+			};
+			uint32_t state = 42;
+			char *sampled_keys[100];
+			int *sampled_values[100];
+
+			THEN("Every sample should be an entry of the map") {
+				REQUIRE(champ_sample(map, random, &state, 100, sampled_keys, sampled_values) == 100);
+				for (int i = 0; i < 100; ++i) {
+					REQUIRE(champ_get(map, sampled_keys[i], nullptr) == sampled_values[i]);
+				}
+			}
+		}
+
+		WHEN("Deleting entries") {
+			auto smaller = champ_del(map, "c2", nullptr);
+
+			THEN("Positions should be updated") {
+				char *key;
+				REQUIRE(champ_nth(smaller, champ_length(smaller) - 1, &key, nullptr));
+				REQUIRE_FALSE(champ_nth(smaller, champ_length(smaller), &key, nullptr));
+			}
+
+			champ_destroy(&smaller);
+		}
+
+		WHEN("Iterating over hash prefix partitions") {
+			THEN("Every entry should be visited exactly once, in the partition of its hash") {
+				for (unsigned bits : {0u, 3u, 5u, 7u, 12u}) {
+					unsigned count = 0;
+					for (uint32_t prefix = 0; prefix < (1u << bits); ++prefix) {
+						struct champ_iter iter;
+						char *key;
+						int *value;
+						champ_iter_init_prefix(&iter, map, prefix, bits);
+						while (champ_iter_next(&iter, &key, &value)) {
+							REQUIRE((hash(key) & ((1u << bits) - 1)) == prefix);
+							++count;
+						}
+					}
+					REQUIRE(count == champ_length(map));
+				}
+			}
+
+			THEN("A full hash should select the entries with exactly that hash") {
+				struct champ_iter iter;
+				char *key;
+				int *value;
+				unsigned count = 0;
+				champ_iter_init_prefix(&iter, map, 0u, 32);
+				while (champ_iter_next(&iter, &key, &value)) {
+					REQUIRE(key[0] == 'c');
+					++count;
+				}
+				unsigned colliding = 0;
+				champ_iter_init(&iter, map);
+				while (champ_iter_next(&iter, &key, &value)) colliding += key[0] == 'c';
+				REQUIRE(count == colliding);
+
+				count = 0;
+				champ_iter_init_prefix(&iter, map, champ_hash_str("Lorem"), 32);
+				while (champ_iter_next(&iter, &key, &value)) {
+					REQUIRE(strcmp(key, "Lorem") == 0);
+					++count;
+				}
+				REQUIRE(count == 1);
+			}
+		}
+
+		WHEN("Splitting the map") {
+			struct champ *parts[32];
+			unsigned non_empty = champ_split(map, parts);
+
+			THEN("Every part should hold the entries of its slot") {
+				unsigned length = 0, counted = 0;
+				for (unsigned i = 0; i < 32; ++i) {
+					length += champ_length(parts[i]);
+					counted += champ_length(parts[i]) > 0;
+					struct champ_iter iter;
+					char *key;
+					int *value;
+					champ_iter_init(&iter, parts[i]);
+					while (champ_iter_next(&iter, &key, &value)) {
+						REQUIRE((hash(key) & 31u) == i);
+						REQUIRE(champ_get(map, key, nullptr) == value);
+					}
+				}
+				REQUIRE(length == champ_length(map));
+				REQUIRE(counted == non_empty);
+			}
+
+			THEN("Joining the parts should give back the map") {
+				auto joined = champ_join(parts);
+				REQUIRE(joined != nullptr);
+				REQUIRE(champ_length(joined) == champ_length(map));
+				REQUIRE(champ_hash(joined) == champ_hash(map));
+				REQUIRE(champ_equals(joined, map, [](const int *l, const int *r) { return (int)(l == r); }));
+				champ_destroy(&joined);
+			}
+
+			THEN("Joining overlapping parts should fail") {
+				struct champ *overlapping[32];
+				for (unsigned i = 0; i < 32; ++i) overlapping[i] = parts[i];
+				overlapping[1] = map;
+				REQUIRE(champ_join(overlapping) == nullptr);
+			}
+
+			for (auto &part : parts) champ_destroy(&part);
+		}
+
+		champ_destroy(&map);
+	}
+
+	GIVEN("A hash function that only spreads its high bits") {
+		auto hash = [](const char *key) { return (uint32_t)(uintptr_t)key << 20; };
+		auto equals = [](const char *l, const char *r) { return (int)(l == r); };
+		auto value_hash = [](const int *value) { return (uint32_t)(uintptr_t)value; };
+		auto value_equals = [](const int *l, const int *r) { return (int)(l == r); };
+		auto clustered = champ_new_hashed(hash, equals, value_hash);
+		for (uintptr_t i = 1; i <= 2000; ++i) {
+			auto tmp = champ_set(clustered, (char *)i, (int *)i, nullptr);
+			champ_destroy(&clustered);
+			clustered = tmp;
+		}
+		auto map = champ_reseed(clustered, 0x9e3779b9u);
+		struct champ_stats stats;
+		champ_stats(map, &stats);
+
+		THEN("Only an explicit reseed should switch the map to a seed") {
+			struct champ_stats clustered_stats;
+			champ_stats(clustered, &clustered_stats);
+			REQUIRE(clustered_stats.seed == 0);
+			REQUIRE(champ_clusters(clustered));
+			REQUIRE(champ_reseed(map, 0x9e3779b9u) == map);
+			REQUIRE(champ_equals(map, clustered, value_equals));
+			auto unseeded = champ_reseed(map, 0);
+			REQUIRE(champ_clusters(unseeded));
+			REQUIRE(champ_key_hash(unseeded, (char *)1) == hash((char *)1));
+			champ_destroy(&unseeded);
+		}
+
+		THEN("The reseeded map should stay shallow") {
+			REQUIRE(stats.seed == 0x9e3779b9u);
+			REQUIRE_FALSE(champ_clusters(map));
+			REQUIRE(stats.chain_nodes * 4 < stats.nodes);
+			REQUIRE(stats.entries_by_depth[5] + stats.entries_by_depth[6] + stats.entries_by_depth[7] == 0);
+			REQUIRE(champ_key_hash(map, (char *)1) != hash((char *)1));
+			for (uintptr_t i = 1; i <= 2000; ++i) {
+				REQUIRE(champ_get(map, (char *)i, nullptr) == (int *)i);
+			}
+		}
+
+		THEN("Hash prefixes should refer to the mixed hash") {
+			unsigned count = 0;
+			for (uint32_t prefix = 0; prefix < 32; ++prefix) {
+				struct champ_iter iter;
+				char *key;
+				int *value;
+				champ_iter_init_prefix(&iter, map, prefix, 5);
+				while (champ_iter_next(&iter, &key, &value)) {
+					REQUIRE((champ_key_hash(map, key) & 31u) == prefix);
+					++count;
+				}
+			}
+			REQUIRE(count == 2000);
+		}
+
+		WHEN("Another map has the same entries but another seed") {
+			struct champ_type type = {hash, equals, value_hash, nullptr, nullptr, nullptr, nullptr, 12345u};
+			auto other = champ_new_typed(&type);
+			for (uintptr_t i = 2000; i >= 1; --i) {
+				auto tmp = champ_set(other, (char *)i, (int *)(i == 1000 ? 0 : i), nullptr);
+				champ_destroy(&other);
+				other = tmp;
+			}
+
+			THEN("The maps should be compared by their entries") {
+				REQUIRE_FALSE(champ_equals(map, other, value_equals));
+				auto same = champ_set(other, (char *)1000, (int *)1000, nullptr);
+				REQUIRE(champ_hash(same) == champ_hash(map));
+				REQUIRE(champ_equals(map, same, value_equals));
+				REQUIRE(champ_equals(same, map, value_equals));
+				champ_destroy(&same);
+			}
+
+			THEN("A delta between them should still apply") {
+				int pair[2];
+				REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+				REQUIRE(champ_encode_delta(other, map, pair[0], nullptr, nullptr) == 0);
+				auto applied = champ_apply_delta(other, pair[1], nullptr, nullptr);
+				REQUIRE(applied != nullptr);
+				REQUIRE(champ_equals(applied, map, value_equals));
+				champ_destroy(&applied);
+				close(pair[0]);
+				close(pair[1]);
+			}
+
+			THEN("Pulling from the map should take over its seed") {
+				unsigned long nodes = 0;
+				auto pulled = sync_from_child(map, other, &nodes);
+				REQUIRE(pulled != nullptr);
+				REQUIRE(champ_equals(pulled, map, value_equals));
+				struct champ_stats pulled_stats;
+				champ_stats(pulled, &pulled_stats);
+				REQUIRE(pulled_stats.seed == stats.seed);
+				if (pulled != other) champ_destroy(&pulled);
+			}
+
+			champ_destroy(&other);
+		}
+
+		WHEN("The map is written to a snapshot") {
+			char path[] = "/tmp/champ_snapshot_XXXXXX";
+			int fd = mkstemp(path);
+			REQUIRE(fd >= 0);
+			REQUIRE(champ_write_snapshot(map, fd, nullptr, nullptr) == 0);
+			close(fd);
+			auto mapped = champ_open_snapshot(path, hash, equals, value_hash);
+			unlink(path);
+
+			THEN("The snapshot should keep the seed") {
+				REQUIRE(mapped != nullptr);
+				REQUIRE(champ_key_hash(mapped, (char *)7) == champ_key_hash(map, (char *)7));
+				REQUIRE(champ_get(mapped, (char *)7, nullptr) == (int *)7);
+			}
+
+			if (mapped) champ_close_snapshot(&mapped);
+		}
+
+		champ_destroy(&map);
+		champ_destroy(&clustered);
+	}
+
+	GIVEN("Maps built independently from the same entries") {
+		auto hash = [](const char *key) {
+			uint32_t h = (uint32_t)(uintptr_t)key;
+			h ^= h >> 16;
+			h *= 0x85ebca6bu;
+			h ^= h >> 13;
+			return h;
+		};
+		auto equals = [](const char *l, const char *r) { return (int)(l == r); };
+		auto value_equals = [](const int *l, const int *r) { return (int)(l == r); };
+		auto ascending = champ_new(hash, equals);
+		auto descending = champ_new(hash, equals);
+		for (uintptr_t i = 1; i <= 3000; ++i) {
+			auto tmp = champ_set(ascending, (char *)i, (int *)i, nullptr);
+			champ_destroy(&ascending);
+			ascending = tmp;
+			tmp = champ_set(descending, (char *)(3001 - i), (int *)(3001 - i), nullptr);
+			champ_destroy(&descending);
+			descending = tmp;
+		}
+		auto changed = champ_set(ascending, (char *)1500, (int *)0, nullptr);
+
+		WHEN("They are interned") {
+			auto left = champ_intern(ascending);
+			auto right = champ_intern(descending);
+			auto other = champ_intern(changed);
+			const size_t interned = champ_interned_nodes();
+
+			THEN("Equal maps should share all of their nodes") {
+				REQUIRE(left->root == right->root);
+				REQUIRE(champ_equals(left, right, value_equals));
+				REQUIRE(champ_equals(left, descending, value_equals));
+				REQUIRE(champ_intern(left) == left);
+			}
+
+			THEN("Maps that differ should only differ on the path to the difference") {
+				struct champ_stats stats;
+				champ_stats(left, &stats);
+				REQUIRE(champ_shared_bytes(left, other) + 5 * 300 > stats.bytes);
+				REQUIRE(champ_get(other, (char *)1500, nullptr) == nullptr);
+				REQUIRE_FALSE(champ_equals(left, other, value_equals));
+			}
+
+			THEN("Nodes should only be collected once no map uses them") {
+				champ_destroy(&ascending);
+				champ_destroy(&descending);
+				champ_destroy(&changed);
+				REQUIRE(champ_intern_collect() == 0);
+				champ_destroy(&other);
+				const size_t collected = champ_intern_collect();
+				REQUIRE(collected > 0);
+				REQUIRE(champ_interned_nodes() == interned - collected);
+			}
+
+			if (left) champ_destroy(&left);
+			if (right) champ_destroy(&right);
+			if (other) champ_destroy(&other);
+		}
+
+		WHEN("A shared node is referenced more often than its count can hold") {
+			auto root = (struct node *)ascending->root;
+			auto branch = ((struct node **)(root->content + root->element_arity))[0];
+			const uint32_t branch_slot = __builtin_ctz(root->branch_map);
+			uintptr_t elsewhere = 1;
+			while ((champ_key_hash(ascending, (char *)elsewhere) & 31) == branch_slot) ++elsewhere;
+			const uint16_t ref_count = branch->ref_count;
+			branch->ref_count = 0xffec;
+
+			std::vector<struct champ *> versions;
+			for (long i = 0; i < 6; ++i) {
+				versions.push_back(champ_set(ascending, (char *)elsewhere, (int *)(5000 + i), nullptr));
+			}
+
+			THEN("Its count should saturate below the reserved range and stay there") {
+				REQUIRE(branch->ref_count == 0xffef);
+				for (auto &version : versions) {
+					REQUIRE(((struct node **)(version->root->content + version->root->element_arity))[0] == branch);
+					champ_destroy(&version);
+				}
+				REQUIRE(branch->ref_count == 0xffef);
+				for (uintptr_t i = 1; i <= 3000; ++i) {
+					REQUIRE(champ_get(ascending, (char *)i, nullptr) == (int *)i);
+				}
+			}
+
+			for (auto &version : versions) {
+				if (version) champ_destroy(&version);
+			}
+			branch->ref_count = ref_count;
+		}
+
+		if (ascending) champ_destroy(&ascending);
+		if (descending) champ_destroy(&descending);
+		if (changed) champ_destroy(&changed);
+		champ_intern_collect();
+		REQUIRE(champ_interned_nodes() == 0);
+	}
+
+	GIVEN("An atom that retains its last three versions") {
+		struct counted versions[6] = {};
+		counted_acquires = 0;
+		counted_releases = 0;
+		struct atom atom;
+		atom_init(&atom, &versions[0], counted_acquire, counted_release);
+		versions[0].ref_count = 1;
+		const uint64_t before = nsecs_passed();
+		atom_enable_history(&atom, 3);
+
+		THEN("Only the current version should be retained") {
+			auto ref = atom_deref_at(&atom, 0);
+			REQUIRE(ref == &versions[0]);
+			counted_release(&ref);
+			REQUIRE(atom_deref_at(&atom, 1) == nullptr);
+			REQUIRE(atom_deref_before(&atom, before) == nullptr);
+			REQUIRE(versions[0].ref_count == 2);
+		}
+
+		WHEN("More versions are published than it retains") {
+			uint64_t published[6];
+			published[0] = nsecs_passed();
+			for (int i = 1; i < 6; ++i) {
+				auto ref = atom_swap(&atom, compute_arg, &versions[i]);
+				REQUIRE(ref == &versions[i]);
+				counted_release(&ref);
+				published[i] = nsecs_passed();
+			}
+			REQUIRE(atom.version == 5);
+
+			THEN("The oldest versions should be evicted and released") {
+				for (int i = 0; i < 3; ++i) {
+					REQUIRE(versions[i].ref_count == 0);
+					REQUIRE(atom_deref_at(&atom, i) == nullptr);
+				}
+				REQUIRE(versions[3].ref_count == 1);
+				REQUIRE(versions[4].ref_count == 1);
+				REQUIRE(versions[5].ref_count == 2);
+				size_t retained = 0;
+				atom_history_bytes(&atom, [](atom_ref, atom_ref) { return (size_t)0; }, &retained);
+				REQUIRE(retained == 3);
+			}
+
+			THEN("Retained versions should be found by number, but not future ones") {
+				for (int i = 3; i < 6; ++i) {
+					auto ref = atom_deref_at(&atom, i);
+					REQUIRE(ref == &versions[i]);
+					counted_release(&ref);
+				}
+				REQUIRE(atom_deref_at(&atom, 6) == nullptr);
+				REQUIRE(atom_deref_at(&atom, (unsigned long)-1) == nullptr);
+			}
+
+			THEN("Retained versions should be found by time, but not evicted ones") {
+				for (int i = 3; i < 6; ++i) {
+					auto ref = atom_deref_before(&atom, published[i]);
+					REQUIRE(ref == &versions[i]);
+					counted_release(&ref);
+				}
+				REQUIRE(atom_deref_before(&atom, published[2]) == nullptr);
+				REQUIRE(atom_deref_before(&atom, before) == nullptr);
+			}
+
+			THEN("Cleaning up the atom should release every retained version") {
+				atom_cleanup(&atom);
+				for (auto &version : versions) {
+					REQUIRE(version.ref_count == 0);
+				}
+				REQUIRE(counted_releases == counted_acquires + 1);
+				REQUIRE(atom.history == nullptr);
+			}
+		}
+
+		atom_cleanup(&atom);
+		for (auto &version : versions) {
+			REQUIRE(version.ref_count == 0);
+		}
+	}
+
+	GIVEN("An atom without a history") {
+		struct counted versions[2] = {};
+		struct atom atom;
+		atom_init(&atom, &versions[0], counted_acquire, counted_release);
+		versions[0].ref_count = 1;
+		auto ref = atom_swap(&atom, compute_arg, &versions[1]);
+		counted_release(&ref);
+
+		THEN("Only the current version should be found") {
+			ref = atom_deref_at(&atom, 1);
+			REQUIRE(ref == &versions[1]);
+			counted_release(&ref);
+			REQUIRE(atom_deref_at(&atom, 0) == nullptr);
+			REQUIRE(atom_deref_before(&atom, nsecs_passed()) == nullptr);
+			REQUIRE(atom_history_bytes(&atom, [](atom_ref, atom_ref) { return (size_t)1; }, nullptr) == 0);
+			REQUIRE(versions[0].ref_count == 0);
+		}
+
+		atom_cleanup(&atom);
+		REQUIRE(versions[1].ref_count == 0);
+	}
+
+	GIVEN("An atom read through a cache") {
+		struct counted versions[2] = {};
+		counted_acquires = 0;
+		counted_releases = 0;
+		struct atom atom;
+		atom_init(&atom, &versions[0], counted_acquire, counted_release);
+		versions[0].ref_count = 1;
+		atom_enable_stats(&atom);
+		struct atom_cache cache;
+		atom_cache_init(&cache, &atom);
+		struct atom_stats stats;
+
+		THEN("The first deref should miss and acquire the current version") {
+			REQUIRE(atom_cache_deref(&cache) == &versions[0]);
+			REQUIRE(versions[0].ref_count == 2);
+			REQUIRE(atom_stats_read(&atom, &stats));
+			REQUIRE(stats.cache_misses == 1);
+			REQUIRE(stats.cache_hits == 0);
+		}
+
+		THEN("Cleaning up a cache that never held anything should release nothing") {
+			atom_cache_cleanup(&cache);
+			REQUIRE(counted_releases == 0);
+		}
+
+		WHEN("It is dereferenced again") {
+			atom_cache_deref(&cache);
+			const int acquires = counted_acquires;
+			auto ref = atom_cache_deref(&cache);
+
+			THEN("It should hit and leave every count alone") {
+				REQUIRE(ref == &versions[0]);
+				REQUIRE(counted_acquires == acquires);
+				REQUIRE(counted_releases == 0);
+				REQUIRE(versions[0].ref_count == 2);
+				atom_stats_read(&atom, &stats);
+				REQUIRE(stats.cache_misses == 1);
+				REQUIRE(stats.cache_hits == 1);
+			}
+		}
+
+		WHEN("The atom changes after the cache was filled") {
+			atom_cache_deref(&cache);
+			auto swapped = atom_swap(&atom, compute_arg, &versions[1]);
+			counted_release(&swapped);
+			REQUIRE(versions[0].ref_count == 1);
+			auto ref = atom_cache_deref(&cache);
+
+			THEN("It should miss, and release the stale version") {
+				REQUIRE(ref == &versions[1]);
+				REQUIRE(versions[0].ref_count == 0);
+				REQUIRE(versions[1].ref_count == 2);
+				atom_stats_read(&atom, &stats);
+				REQUIRE(stats.cache_misses == 2);
+				REQUIRE(stats.cache_hits == 0);
+			}
+
+			THEN("The next deref should hit the new version") {
+				REQUIRE(atom_cache_deref(&cache) == &versions[1]);
+				atom_stats_read(&atom, &stats);
+				REQUIRE(stats.cache_hits == 1);
+			}
+		}
+
+		atom_cache_cleanup(&cache);
+		atom_cache_cleanup(&cache);
+		atom_cleanup(&atom);
+		for (auto &version : versions) {
+			REQUIRE(version.ref_count == 0);
+		}
+		REQUIRE(counted_releases == counted_acquires + 1);
+	}
+
+	GIVEN("An atom that another swap gets ahead of") {
+		struct counted versions[3] = {};
+		counted_acquires = 0;
+		counted_releases = 0;
+		struct atom atom;
+		atom_init(&atom, &versions[0], counted_acquire, counted_release);
+		versions[0].ref_count = 1;
+		atom_enable_stats(&atom);
+		void *args[] = {&atom, &versions[1], &versions[2]};
+		auto ref = atom_swap(&atom, compute_interrupted, args);
+
+		THEN("The swap should be retried once, and its first result released") {
+			REQUIRE(ref == &versions[2]);
+			REQUIRE(atom.version == 2);
+			struct atom_stats stats;
+			REQUIRE(atom_stats_read(&atom, &stats));
+			REQUIRE(stats.swaps == 2);
+			REQUIRE(stats.retries == 1);
+			REQUIRE(stats.elided == 0);
+			REQUIRE(stats.swap.count == 2);
+			REQUIRE(versions[0].ref_count == 0);
+			REQUIRE(versions[1].ref_count == 0);
+			REQUIRE(versions[2].ref_count == 2);
+		}
+
+		counted_release(&ref);
+		atom_cleanup(&atom);
+		for (auto &version : versions) {
+			REQUIRE(version.ref_count == 0);
+		}
+		REQUIRE(counted_releases == counted_acquires + 1);
+	}
+
+	GIVEN("An empty histogram") {
+		auto histogram = new struct histogram;
+		histogram_init(histogram);
+
+		THEN("It should report no values") {
+			REQUIRE(histogram->count == 0);
+			REQUIRE(histogram->sum == 0);
+			REQUIRE(histogram->max == 0);
+			REQUIRE(histogram_percentile(histogram, 0.) == 0);
+			REQUIRE(histogram_percentile(histogram, 50.) == 0);
+			REQUIRE(histogram_percentile(histogram, 100.) == 0);
+			auto snapshot = new struct histogram;
+			histogram_copy(snapshot, histogram);
+			REQUIRE(snapshot->count == 0);
+			REQUIRE(histogram_percentile(snapshot, 99.) == 0);
+			delete snapshot;
+		}
+
+		WHEN("Values below the sub-bucket count are recorded") {
+			for (uint64_t value = 0; value < HISTOGRAM_SUB_BUCKETS; ++value) {
+				histogram_record(histogram, value);
+			}
+
+			THEN("Every one of them should be reported exactly") {
+				REQUIRE(histogram->count == HISTOGRAM_SUB_BUCKETS);
+				REQUIRE(histogram->sum == HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_SUB_BUCKETS - 1) / 2);
+				REQUIRE(histogram->min == 0);
+				REQUIRE(histogram->max == HISTOGRAM_SUB_BUCKETS - 1);
+				for (uint64_t value = 0; value < HISTOGRAM_SUB_BUCKETS; ++value) {
+					const double percentile = 100. * (double)(value + 1) / HISTOGRAM_SUB_BUCKETS;
+					REQUIRE(histogram_percentile(histogram, percentile) == value);
+				}
+			}
+		}
+
+		WHEN("Values at either side of a power of two are recorded") {
+			THEN("They should land in different buckets, each as wide as a sub-bucket of its power of two") {
+				for (unsigned bits = HISTOGRAM_SUB_BUCKET_BITS; bits < 64; ++bits) {
+					const uint64_t power = (uint64_t)1 << bits;
+					for (uint64_t value : {power - 1, power, power + (power >> HISTOGRAM_SUB_BUCKET_BITS) - 1}) {
+						histogram_init(histogram);
+						histogram_record(histogram, value);
+						histogram_record(histogram, UINT64_MAX);
+						const uint64_t expected = value < power ? value : power + (power >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+						REQUIRE(histogram_percentile(histogram, 50.) == expected);
+					}
+				}
+				histogram_init(histogram);
+				histogram_record(histogram, UINT64_MAX);
+				REQUIRE(histogram_percentile(histogram, 100.) == UINT64_MAX);
+			}
+		}
+
+		delete histogram;
+	}
+
+	GIVEN("A chunked list of 100 elements") {
+		struct chunk_list *list = empty_chunk_list;
+		struct chunk_list *prefixes[101];
+		prefixes[0] = empty_chunk_list;
+		for (uintptr_t i = 1; i <= 100; ++i) {
+			auto tmp = chunk_list_acquire(chunk_list_push(list, (void *)i));
+			prefixes[i] = tmp;
+			list = tmp;
+		}
+
+		THEN("Chunks should fill up before a new one is started") {
+			REQUIRE(chunk_list_length(list) == 100);
+			for (uintptr_t i = 1; i < 100; ++i) {
+				REQUIRE((CHUNK_OF(prefixes[i]) == CHUNK_OF(prefixes[i + 1])) == (i % 15 != 0));
+			}
+			REQUIRE(CHUNK_OF(prefixes[15])->used == 15);
+			REQUIRE(CHUNK_OF(prefixes[16])->tail == prefixes[15]);
+			REQUIRE(CHUNK_OF(prefixes[16])->tail_length == 15);
+		}
+
+		THEN("Popping should walk across chunk edges") {
+			const struct chunk_list *rest = list;
+			for (uintptr_t i = 100; i > 0; --i) {
+				REQUIRE(chunk_list_length(rest) == i);
+				REQUIRE(chunk_list_peek(rest) == (void *)i);
+				void *element;
+				rest = chunk_list_pop(rest, &element);
+				REQUIRE(element == (void *)i);
+				REQUIRE(rest == prefixes[i - 1]);
+			}
+			REQUIRE(rest == empty_chunk_list);
+			void *element = (void *)1;
+			REQUIRE(chunk_list_pop(rest, &element) == empty_chunk_list);
+			REQUIRE(element == nullptr);
+			REQUIRE(chunk_list_peek(rest) == nullptr);
+		}
+
+		THEN("Reversing it should keep its elements across chunk edges") {
+			auto reversed = chunk_list_acquire(chunk_list_reverse(list));
+			REQUIRE(chunk_list_length(reversed) == 100);
+			const struct chunk_list *rest = reversed;
+			for (uintptr_t i = 1; i <= 100; ++i) {
+				void *element;
+				rest = chunk_list_pop(rest, &element);
+				REQUIRE(element == (void *)i);
+			}
+			chunk_list_release(&reversed);
+		}
+
+		WHEN("Two versions are pushed onto the same prefix") {
+			// the last chunk holds elements 91 to 100, so it has free slots left
+			const auto prefix = prefixes[100];
+			const unsigned shared = CHUNK_OF(prefixes[90])->ref_count;
+			auto in_place = chunk_list_acquire(chunk_list_push(prefix, (void *)1000));
+			auto copied = chunk_list_acquire(chunk_list_push(prefix, (void *)2000));
+
+			THEN("Only the first should claim the slot in place, the second should start a chunk") {
+				REQUIRE(CHUNK_OF(in_place) == CHUNK_OF(prefix));
+				REQUIRE(CHUNK_OF(copied) != CHUNK_OF(prefix));
+				REQUIRE(CHUNK_OF(copied)->tail == prefix);
+				REQUIRE(chunk_list_peek(in_place) == (void *)1000);
+				REQUIRE(chunk_list_peek(copied) == (void *)2000);
+				REQUIRE(chunk_list_peek(prefix) == (void *)100);
+				REQUIRE(chunk_list_length(in_place) == 101);
+				REQUIRE(chunk_list_length(copied) == 101);
+				void *element;
+				REQUIRE(chunk_list_pop(in_place, &element) == prefix);
+				REQUIRE(chunk_list_pop(copied, &element) == prefix);
+			}
+
+			THEN("Releasing the versions should keep the shared tail until the last one is gone") {
+				REQUIRE(CHUNK_OF(prefix)->ref_count == 10 + 2);
+				for (uintptr_t i = 91; i <= 100; ++i) {
+					chunk_list_release(&prefixes[i]);
+				}
+				REQUIRE(CHUNK_OF(prefix)->ref_count == 2);
+				chunk_list_release(&in_place);
+				REQUIRE(CHUNK_OF(prefix)->ref_count == 1);
+				REQUIRE(CHUNK_OF(prefixes[90])->ref_count == shared);
+				const struct chunk_list *rest = copied;
+				for (uintptr_t i = 0; i <= 20; ++i) {
+					void *element;
+					rest = chunk_list_pop(rest, &element);
+					REQUIRE(element == (void *)(i ? 101 - i : 2000));
+				}
+			}
+
+			if (in_place) chunk_list_release(&in_place);
+			chunk_list_release(&copied);
+		}
+
+		for (auto &prefix : prefixes) {
+			if (prefix) chunk_list_release(&prefix);
+		}
+	}
+
+	GIVEN("A list concatenated lazily with a list built from an array") {
+		struct list *left = empty_list;
+		for (uintptr_t i = 1; i <= 3; ++i) {
+			auto tmp = list_acquire(list_push(left, (void *)i));
+			list_release(&left);
+			left = tmp;
+		}
+		void *elements[] = {(void *)4, (void *)5, (void *)6};
+		auto right = list_acquire(list_from_array(elements, 3));
+		auto concat = list_acquire(list_concat(left, right));
+		auto suspension = (struct suspension *)concat;
+
+		THEN("Nothing should be evaluated before it is needed") {
+			REQUIRE(list_length(concat) == 6);
+			REQUIRE(suspension->forced == nullptr);
+			REQUIRE(left->ref_count == 2);
+			REQUIRE(BLOCK_OF(right)->ref_count == 2);
+			REQUIRE(list_concat(left, empty_list) == left);
+			REQUIRE(list_concat(empty_list, right) == right);
+			REQUIRE(list_from_array(elements, 0) == empty_list);
+		}
+
+		WHEN("It is peeked") {
+			REQUIRE(list_peek(concat) == (void *)3);
+			auto forced = suspension->forced;
+
+			THEN("It should be evaluated once, into a block in front of the right list") {
+				REQUIRE(forced != nullptr);
+				REQUIRE(BLOCK_OF(forced)->count == 3);
+				REQUIRE(list_peek(concat) == (void *)3);
+				void *element;
+				auto rest = list_pop(concat, &element);
+				REQUIRE(list_pop(concat, &element) == rest);
+				REQUIRE(suspension->forced == forced);
+				REQUIRE(rest == forced->tail);
+				unsigned remaining = 6;
+				for (uintptr_t expected : {3, 2, 1, 4, 5, 6}) {
+					REQUIRE(list_length(forced) == remaining--);
+					forced = list_pop(forced, &element);
+					REQUIRE(element == (void *)expected);
+					if (expected == 1) REQUIRE(forced == right);
+				}
+				REQUIRE(forced == empty_list);
+			}
+
+			THEN("The evaluation should hold the right list, but not the left one") {
+				REQUIRE(left->ref_count == 2);
+				REQUIRE(BLOCK_OF(right)->ref_count == 3);
+				REQUIRE(BLOCK_OF(forced)->ref_count == 1);
+				list_release(&concat);
+				REQUIRE(left->ref_count == 1);
+				REQUIRE(BLOCK_OF(right)->ref_count == 1);
+			}
+		}
+
+		WHEN("The left list is reversed") {
+			auto reversed = list_acquire(list_reverse(left));
+			auto reversal = (struct suspension *)reversed;
+
+			THEN("Reversing it again should return the original list") {
+				REQUIRE(list_reverse(reversed) == left);
+				REQUIRE(reversal->forced == nullptr);
+			}
+
+			THEN("It should be evaluated once, on the first pop, and hold its source until released") {
+				void *element;
+				auto rest = list_pop(reversed, &element);
+				REQUIRE(element == (void *)1);
+				auto forced = reversal->forced;
+				REQUIRE(list_pop(reversed, &element) == rest);
+				REQUIRE(reversal->forced == forced);
+				REQUIRE(list_peek(rest) == (void *)2);
+				REQUIRE(list_peek(rest->tail) == (void *)3);
+				REQUIRE(rest->tail->tail == empty_list);
+				REQUIRE(BLOCK_OF(forced)->ref_count == 1);
+				REQUIRE(left->ref_count == 3);
+				list_release(&reversed);
+				REQUIRE(left->ref_count == 2);
+			}
+
+			if (reversed) list_release(&reversed);
+		}
+
+		if (concat) list_release(&concat);
+		list_release(&right);
+		list_release(&left);
+	}
 }
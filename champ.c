@@ -33,6 +33,10 @@
 #include <stdio.h>
 #include <stdatomic.h> // reference counting
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "champ.h"
 
@@ -48,10 +52,15 @@
 
 static unsigned bitcount(uint32_t value)
 {
+#if defined(__POPCNT__) || defined(__ARM_NEON)
+	// a single instruction when compiling for a target that has one, see CHAMP_NATIVE in CMakeLists.txt
+	return (unsigned)__builtin_popcount(value);
+#else
 	// taken from http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetParallel
 	value = value - ((value >> 1u) & 0x55555555u);                    // reuse input as temporary
 	value = (value & 0x33333333u) + ((value >> 2u) & 0x33333333u);     // temp
 	return (((value + (value >> 4u)) & 0xF0F0F0Fu) * 0x1010101u) >> 24u;  // count
+#endif
 }
 
 static uint32_t champ_mask(uint32_t hash, unsigned shift)
@@ -64,6 +73,112 @@ static unsigned champ_index(uint32_t bitmap, uint32_t bitpos)
 	return bitcount(bitmap & (bitpos - 1));
 }
 
+// the bitpos of the index-th bit set in bitmap
+static uint32_t champ_bitpos(uint32_t bitmap, unsigned index)
+{
+	while (index--) {
+		bitmap &= bitmap - 1;
+	}
+	return bitmap & (~bitmap + 1);
+}
+
+/*
+ * Maps whose type has a seed place their keys by a mix of the user's hash and the seed, see champ_type.seed. The mix
+ * is murmur3's finalizer, a bijection, so distinct hashes stay distinct and hash_unmix gets the user's hash back.
+ */
+
+static inline uint32_t hash_mix(uint32_t hash, uint32_t seed)
+{
+	hash ^= seed;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static inline uint32_t hash_unmix(uint32_t hash, uint32_t seed)
+{
+	hash ^= hash >> 16;
+	hash *= 0x7ed1b41du; // inverse of 0xc2b2ae35u
+	hash ^= (hash >> 13) ^ (hash >> 26);
+	hash *= 0xa5cb9243u; // inverse of 0x85ebca6bu
+	hash ^= hash >> 16;
+	return hash ^ seed;
+}
+
+// the hash by which key is placed in maps of type, see champ_key_hash
+static inline uint32_t type_key_hash(const struct champ_type *type, const CHAMP_KEY_T key)
+{
+	const uint32_t hash = type->hash(key);
+	return type->seed ? hash_mix(hash, type->seed) : hash;
+}
+
+/*
+ * Instrumentation
+ *
+ * With CHAMP_STATS defined, every thread counts the operations listed in CHAMP_COUNTERS in a block of its own, so
+ * counting never contends. Blocks are chained into a list when a thread first counts something, and are kept after
+ * the thread exits so that its counts still show up in champ_counters_read. Without CHAMP_STATS, COUNT compiles to
+ * nothing.
+ */
+
+#ifdef CHAMP_STATS
+
+struct counter_block {
+#define CHAMP_COUNTER_FIELD(name) _Atomic unsigned long name;
+	CHAMP_COUNTERS(CHAMP_COUNTER_FIELD)
+#undef CHAMP_COUNTER_FIELD
+	struct counter_block *next;
+};
+
+static struct counter_block *_Atomic counter_blocks = NULL;
+static _Thread_local struct counter_block *thread_counter_block = NULL;
+
+static struct counter_block *counter_block_register(void)
+{
+	struct counter_block *block = calloc(1, sizeof *block);
+	block->next = atomic_load(&counter_blocks);
+	while (!atomic_compare_exchange_weak(&counter_blocks, &block->next, block));
+	return thread_counter_block = block;
+}
+
+// only the owning thread writes to a block, so a relaxed load and store are enough and avoid a locked instruction
+#define COUNT(name) do { \
+	struct counter_block *block_ = thread_counter_block ? thread_counter_block : counter_block_register(); \
+	atomic_store_explicit(&block_->name, atomic_load_explicit(&block_->name, memory_order_relaxed) + 1, memory_order_relaxed); \
+} while (0)
+
+#else
+
+#define COUNT(name) do {} while (0)
+
+#endif
+
+void champ_counters_read(struct champ_counters *counters)
+{
+	memset(counters, 0, sizeof *counters);
+#ifdef CHAMP_STATS
+	for (struct counter_block *block = atomic_load(&counter_blocks); block; block = block->next) {
+#define CHAMP_COUNTER_SUM(name) counters->name += atomic_load_explicit(&block->name, memory_order_relaxed);
+		CHAMP_COUNTERS(CHAMP_COUNTER_SUM)
+#undef CHAMP_COUNTER_SUM
+	}
+#endif
+}
+
+void champ_counters_reset(void)
+{
+#ifdef CHAMP_STATS
+	for (struct counter_block *block = atomic_load(&counter_blocks); block; block = block->next) {
+#define CHAMP_COUNTER_RESET(name) atomic_store_explicit(&block->name, 0, memory_order_relaxed);
+		CHAMP_COUNTERS(CHAMP_COUNTER_RESET)
+#undef CHAMP_COUNTER_RESET
+	}
+#endif
+}
+
 /*
  * Data structure definitions
  */
@@ -80,6 +195,8 @@ struct node {
 	uint8_t element_arity;
 	uint8_t branch_arity;
 	volatile uint16_t ref_count; // reference counting
+	uint32_t size; // number of entries in this subtree
+	uint32_t hash; // sum of the entry hashes of all entries in this subtree, see entry_hash
 	uint32_t element_map;
 	uint32_t branch_map;
 	CHAMP_NODE_ELEMENT_T content[];
@@ -89,13 +206,42 @@ struct collision_node {
 	uint8_t element_arity; // MUST SHARE LAYOUT WITH struct node
 	uint8_t branch_arity; // MUST SHARE LAYOUT WITH struct node
 	volatile uint16_t ref_count; // MUST SHARE LAYOUT WITH struct node // reference counting
+	uint32_t size; // MUST SHARE LAYOUT WITH struct node
+	uint32_t hash; // MUST SHARE LAYOUT WITH struct node
+	uint32_t element_map; // always 0, keeps content at the same offset as in struct node
+	uint32_t branch_map; // always 0
 	CHAMP_NODE_ELEMENT_T content[];
 };
 
+/*
+ * Nodes with a ref_count of at least NODE_PINNED are never reference counted, let alone freed. This is the case for the
+ * empty node, for nodes that live in a memory-mapped snapshot, and for inline roots.
+ *
+ * Counts of heap nodes must never reach that range, so they saturate at NODE_SATURATED: a node referenced that often
+ * stays at that count for good, ignoring further acquires and releases. It is never freed, but remains an ordinary
+ * heap node otherwise.
+ *
+ * Inline roots are allocated together with their map, which sits right in front of them, see node_new. They hold
+ * references to their branches like any other node, but are freed along with the map instead of on their own.
+ *
+ * Mapped nodes store their branches as offsets relative to the branch slot itself, and depending on the snapshot, the
+ * same goes for keys and values. Always read the content of a node that might be mapped through element_load,
+ * branch_load, node_elements or node_branches.
+ */
+#define NODE_SATURATED 0xffefu
+#define NODE_PINNED 0xfff0u
+#define NODE_INLINE 0xfff1u
+#define NODE_MAPPED 0xfff4u
+#define NODE_MAPPED_KEYS 0x1u
+#define NODE_MAPPED_VALUES 0x2u
+#define NODE_MAPPED_MASK (~(NODE_MAPPED_KEYS | NODE_MAPPED_VALUES) & 0xffffu)
+
 static const struct node empty_node = {
 	.branch_arity = 0,
 	.element_arity = 0,
-	.ref_count = 1,
+	.ref_count = NODE_PINNED,
+	.size = 0,
+	.hash = 0,
 	.branch_map = 0,
 	.element_map = 0,
 };
@@ -106,8 +252,71 @@ static const struct node empty_node = {
 #define CHAMP_NODE_ELEMENTS_SIZE(length) (sizeof(CHAMP_NODE_ELEMENT_T) * (length))
 #define CHAMP_NODE_BRANCHES_SIZE(length) (sizeof(CHAMP_NODE_BRANCH_T) * (length))
 
-#define CHAMP_NODE_ELEMENT_AT(node, bitpos) CHAMP_NODE_ELEMENTS(node)[champ_index(node->element_map, bitpos)]
-#define CHAMP_NODE_BRANCH_AT(node, bitpos) CHAMP_NODE_BRANCHES(node)[champ_index(node->branch_map, bitpos)]
+#define CHAMP_NODE_ELEMENT_AT(node, bitpos) element_load(&CHAMP_NODE_ELEMENTS(node)[champ_index(node->element_map, bitpos)], node->ref_count)
+#define CHAMP_NODE_BRANCH_AT(node, bitpos) branch_load(&CHAMP_NODE_BRANCHES(node)[champ_index(node->branch_map, bitpos)], node->ref_count)
+
+#define RELOCATE(slot, offset) ((uintptr_t)(slot) + (uintptr_t)(offset))
+
+static inline int is_mapped(uint16_t ref_count)
+{
+	return (ref_count & NODE_MAPPED_MASK) == NODE_MAPPED;
+}
+
+static inline CHAMP_NODE_ELEMENT_T element_load(const CHAMP_NODE_ELEMENT_T *element, uint16_t ref_count)
+{
+	CHAMP_NODE_ELEMENT_T result = *element;
+	if (is_mapped(ref_count)) {
+		if (ref_count & NODE_MAPPED_KEYS)
+			result.key = (CHAMP_KEY_T)RELOCATE(&element->key, result.key);
+		if (ref_count & NODE_MAPPED_VALUES)
+			result.val = (CHAMP_VALUE_T)RELOCATE(&element->val, result.val);
+	}
+	return result;
+}
+
+static inline struct node *branch_load(CHAMP_NODE_BRANCH_T const *branch, uint16_t ref_count)
+{
+	if (is_mapped(ref_count))
+		return (struct node *)RELOCATE(branch, *branch);
+	return *branch;
+}
+
+/**
+ * Returns the elements of node, translated into buffer if node is mapped.
+ */
+static inline const CHAMP_NODE_ELEMENT_T *node_elements(const struct node *node, CHAMP_NODE_ELEMENT_T *buffer)
+{
+	if (!is_mapped(node->ref_count))
+		return CHAMP_NODE_ELEMENTS(node);
+	for (unsigned i = 0; i < node->element_arity; ++i) {
+		buffer[i] = element_load(&CHAMP_NODE_ELEMENTS(node)[i], node->ref_count);
+	}
+	return buffer;
+}
+
+/**
+ * Returns the branches of node, translated into buffer if node is mapped.
+ */
+static inline CHAMP_NODE_BRANCH_T const *node_branches(const struct node *node, CHAMP_NODE_BRANCH_T *buffer)
+{
+	if (!is_mapped(node->ref_count))
+		return CHAMP_NODE_BRANCHES(node);
+	for (unsigned i = 0; i < node->branch_arity; ++i) {
+		buffer[i] = branch_load(&CHAMP_NODE_BRANCHES(node)[i], node->ref_count);
+	}
+	return buffer;
+}
+
+static inline const CHAMP_NODE_ELEMENT_T *collision_node_elements(const struct collision_node *node,
+								   CHAMP_NODE_ELEMENT_T *buffer)
+{
+	if (!is_mapped(node->ref_count))
+		return node->content;
+	for (unsigned i = 0; i < node->element_arity; ++i) {
+		buffer[i] = element_load(&node->content[i], node->ref_count);
+	}
+	return buffer;
+}
 
 /*
  * static function declarations
@@ -115,67 +324,87 @@ static const struct node empty_node = {
 
 // node constructor
 static struct node *node_new(uint32_t element_map, uint32_t branch_map, CHAMP_NODE_ELEMENT_T const *elements,
-			     uint8_t element_arity, CHAMP_NODE_BRANCH_T const *branches, uint8_t branch_arity);
+			     uint8_t element_arity, CHAMP_NODE_BRANCH_T const *branches, uint8_t branch_arity,
+			     unsigned shift);
 
 // collision node variant
 static struct collision_node *collision_node_new(const CHAMP_NODE_ELEMENT_T *values, uint8_t element_arity);
 
 // destructor
-static void node_destroy(struct node *node);
+static void node_destroy(struct node *node, const struct champ_type *type);
 
 // reference counting
 static inline struct node *champ_node_acquire(const struct node *node);
 
 // reference counting
-static inline void champ_node_release(const struct node *node);
+static inline void champ_node_release(const struct node *node, const struct champ_type *type);
+
+// deferred reclamation
+static void node_defer(struct node *node, const struct champ_type *type);
+
+// ownership of keys and values
+static void node_acquire_elements(const struct node *node, const struct champ_type *type);
+
+static void node_acquire_path(const struct node *node, const struct node *previous, uint32_t hash,
+			      const struct champ_type *type);
 
 
 // top-level functions
 static CHAMP_VALUE_T node_get(const struct node *node, CHAMP_EQUALSFN_T(equals), const CHAMP_KEY_T key, uint32_t hash,
 			      unsigned shift, int *found);
 
-static struct node *node_update(const struct node *node, CHAMP_HASHFN_T(hashfn), CHAMP_EQUALSFN_T(equals),
-				const CHAMP_KEY_T key, const CHAMP_VALUE_T value, uint32_t hash, unsigned shift,
-				int *found);
+static struct node *node_update(const struct node *node, const struct champ_type *type, const CHAMP_KEY_T key,
+				const CHAMP_VALUE_T value, uint32_t hash, unsigned shift, int *found, uint32_t *delta);
 
-static struct node *node_assoc(const struct node *node, CHAMP_HASHFN_T(hashfn), CHAMP_EQUALSFN_T(equals),
-			       const CHAMP_KEY_T key, CHAMP_ASSOCFN_T(fn), const void *user_data, uint32_t hash,
-			       unsigned shift, int *found);
+static struct node *node_assoc(const struct node *node, const struct champ_type *type, const CHAMP_KEY_T key,
+			       CHAMP_ASSOCFN_T(fn), const void *user_data, uint32_t hash, unsigned shift, int *found,
+			       uint32_t *delta);
 
-static struct node *node_del(const struct node *node, CHAMP_EQUALSFN_T(equals), const CHAMP_KEY_T key, uint32_t hash,
-			     unsigned shift, int *modified);
+static struct node *node_del(const struct node *node, const struct champ_type *type, const CHAMP_KEY_T key,
+			     uint32_t hash, unsigned shift, int *modified, uint32_t *delta);
 
 // collision node variants
 static CHAMP_VALUE_T collision_node_get(const struct collision_node *node, CHAMP_EQUALSFN_T(equals),
 					const CHAMP_KEY_T key, int *found);
 
-static struct collision_node *collision_node_update(const struct collision_node *node, CHAMP_EQUALSFN_T(equals),
-						    const CHAMP_KEY_T key, const CHAMP_VALUE_T value, int *found);
+static struct collision_node *collision_node_update(const struct collision_node *node, const struct champ_type *type,
+						    const CHAMP_KEY_T key, const CHAMP_VALUE_T value, uint32_t hash,
+						    int *found, uint32_t *delta);
 
-static struct collision_node *collision_node_assoc(const struct collision_node *node, CHAMP_EQUALSFN_T(equals),
+static struct collision_node *collision_node_assoc(const struct collision_node *node, const struct champ_type *type,
 						   const CHAMP_KEY_T key, CHAMP_ASSOCFN_T(fn), const void *user_data,
-						   int *found);
+						   uint32_t hash, int *found, uint32_t *delta);
 
-static struct collision_node *collision_node_del(const struct collision_node *node, CHAMP_EQUALSFN_T(equals),
-						 const CHAMP_KEY_T key, int *modified);
+static struct collision_node *collision_node_del(const struct collision_node *node, const struct champ_type *type,
+						 const CHAMP_KEY_T key, uint32_t hash, int *modified, uint32_t *delta);
 
 
 // helper functions for creation of modified nodes
 static struct node *node_merge(uint32_t hash_l, const CHAMP_KEY_T key_l, const CHAMP_VALUE_T value_l, uint32_t hash_r,
-			       const CHAMP_KEY_T key_r, const CHAMP_VALUE_T value_r, unsigned shift);
+			       const CHAMP_KEY_T key_r, const CHAMP_VALUE_T value_r, uint32_t entry_hashes,
+			       unsigned shift);
+
+// structural hashing
+static uint32_t entry_hash(const struct champ_type *type, uint32_t hash, const CHAMP_VALUE_T value);
+
+static struct node *node_rehash(struct node *clone, const struct node *original, uint32_t delta);
 
-static struct node *node_clone_pullup(const struct node *node, uint32_t bitpos, const struct kv element);
+static struct node *node_clone_pullup(const struct node *node, uint32_t bitpos, const struct kv element,
+				      unsigned shift);
 
-static struct node *node_clone_update_branch(const struct node *node, uint32_t bitpos, struct node *branch);
+static struct node *node_clone_update_branch(const struct node *node, uint32_t bitpos, struct node *branch,
+					     unsigned shift);
 
-static struct node *node_clone_pushdown(const struct node *node, uint32_t bitpos, struct node *branch);
+static struct node *node_clone_pushdown(const struct node *node, uint32_t bitpos, struct node *branch,
+					unsigned shift);
 
 static struct node *node_clone_insert_element(const struct node *node, uint32_t bitpos, const CHAMP_KEY_T key,
-					      const CHAMP_VALUE_T value);
+					      const CHAMP_VALUE_T value, unsigned shift);
 
-static struct node *node_clone_update_element(const struct node *node, uint32_t bitpos, const CHAMP_VALUE_T value);
+static struct node *node_clone_update_element(const struct node *node, uint32_t bitpos, const CHAMP_VALUE_T value,
+					      unsigned shift);
 
-static struct node *node_clone_remove_element(const struct node *node, uint32_t bitpos);
+static struct node *node_clone_remove_element(const struct node *node, uint32_t bitpos, unsigned shift);
 
 // collision node variants
 static struct collision_node *collision_node_clone_insert_element(const struct collision_node *node,
@@ -189,14 +418,14 @@ static struct collision_node *collision_node_clone_remove_element(const struct c
 
 // equality
 static int node_equals(const struct node *left, const struct node *right, CHAMP_EQUALSFN_T(key_equals),
-		       CHAMP_VALUE_EQUALSFN_T(value_equals), unsigned shift);
+		       CHAMP_VALUE_EQUALSFN_T(value_equals), int compare_hashes, unsigned shift);
 
 static int collision_node_equals(const struct collision_node *left, const struct collision_node *right,
 				 CHAMP_EQUALSFN_T(key_equals), CHAMP_VALUE_EQUALSFN_T(value_equals));
 
 
 // champ private constructor
-static struct champ *champ_from(struct node *root, unsigned length, CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals));
+static struct champ *champ_from(struct node *root, unsigned length, const struct champ_type *type);
 
 
 // iterator helper functions
@@ -209,14 +438,30 @@ static void iter_pop(struct champ_iter *iterator);
  * definitions
  */
 
-static void node_destroy(struct node *node)
+/**
+ * Collision nodes share the header of struct node and have no branches, so this frees either kind. <code>type</code>
+ * is NULL for nodes that never acquired their entries.
+ */
+static void node_destroy(struct node *node, const struct champ_type *type)
 {
+	COUNT(node_frees);
 	DEBUG_NOTICE("    destroying " champ_node_debug_fmt "@%p\n", champ_node_debug_args(node), (void *)node);
 
+	// ownership of keys and values
+	if (type && (type->key_release || type->value_release)) {
+		const CHAMP_NODE_ELEMENT_T *elements = CHAMP_NODE_ELEMENTS(node);
+		for (int i = 0; i < node->element_arity; ++i) {
+			if (type->key_release)
+				type->key_release(elements[i].key);
+			if (type->value_release)
+				type->value_release(elements[i].val);
+		}
+	}
+
 	// reference counting
 	CHAMP_NODE_BRANCH_T *branches = (CHAMP_NODE_BRANCH_T *)CHAMP_NODE_BRANCHES(node);
 	for (int i = 0; i < node->branch_arity; ++i) {
-		champ_node_release(branches[i]);
+		champ_node_release(branches[i], type);
 	}
 
 	free(node);
@@ -225,35 +470,84 @@ static void node_destroy(struct node *node)
 // reference counting
 static inline struct node *champ_node_acquire(const struct node *node)
 {
-	if (node == &empty_node)
-		return (struct node *)node;
-	atomic_fetch_add((uint16_t *)&node->ref_count, 1u);
+	uint16_t ref_count = atomic_load((uint16_t *)&node->ref_count);
+	do {
+		if (ref_count >= NODE_SATURATED)
+			return (struct node *)node;
+	} while (!atomic_compare_exchange_weak((uint16_t *)&node->ref_count, &ref_count, ref_count + 1u));
+	COUNT(node_acquires);
 	return (struct node *)node;
 }
 
 // reference counting
-static inline void champ_node_release(const struct node *node)
+static inline void champ_node_release(const struct node *node, const struct champ_type *type)
+{
+	uint16_t ref_count = atomic_load((uint16_t *)&node->ref_count);
+	do {
+		if (ref_count >= NODE_SATURATED)
+			return;
+	} while (!atomic_compare_exchange_weak((uint16_t *)&node->ref_count, &ref_count, ref_count - 1u));
+	COUNT(node_releases);
+	if (ref_count == 1)
+		node_defer((struct node *)node, type);
+}
+
+// ownership of keys and values
+static void node_acquire_elements(const struct node *node, const struct champ_type *type)
+{
+	if (!type->key_acquire && !type->value_acquire)
+		return;
+	const CHAMP_NODE_ELEMENT_T *elements = CHAMP_NODE_ELEMENTS(node);
+	for (int i = 0; i < node->element_arity; ++i) {
+		if (type->key_acquire)
+			type->key_acquire(elements[i].key);
+		if (type->value_acquire)
+			type->value_acquire(elements[i].val);
+	}
+}
+
+/**
+ * Acquires the entries of every node an update created. Updates only ever copy the nodes on the path of the updated
+ * key's hash, so these are the nodes on that path down to where it joins the previous version of the trie.
+ */
+static void node_acquire_path(const struct node *node, const struct node *previous, uint32_t hash,
+			      const struct champ_type *type)
 {
-	if (node == &empty_node)
+	if (!type->key_acquire && !type->value_acquire)
 		return;
-	if (atomic_fetch_sub((uint16_t *)&node->ref_count, 1u) == 1)
-		node_destroy((struct node *)node);
+	for (unsigned shift = 0; node != previous; shift += HASH_PARTITION_WIDTH) {
+		node_acquire_elements(node, type);
+		if (shift >= HASH_TOTAL_WIDTH)
+			return;
+		const uint32_t bitpos = 1u << champ_mask(hash, shift);
+		if (!(node->branch_map & bitpos))
+			return;
+		node = CHAMP_NODE_BRANCH_AT(node, bitpos);
+		previous = previous && previous->branch_map & bitpos ? CHAMP_NODE_BRANCH_AT(previous, bitpos) : NULL;
+	}
 }
 
 /**
  * WARNING: all branches in <code>branches</code> are "acquired", i.e. their reference count is incremented.
  * Do not pass an "almost correct" list of branches.
+ *
+ * A node at shift 0 is the root of a new version, so it is allocated as an inline root with room for its map in front
+ * of it. champ_from then only fills in that map.
  */
 static struct node *node_new(uint32_t element_map, uint32_t branch_map,
 			     CHAMP_NODE_ELEMENT_T const *elements, uint8_t element_arity,
-			     CHAMP_NODE_BRANCH_T const *branches, uint8_t branch_arity)
+			     CHAMP_NODE_BRANCH_T const *branches, uint8_t branch_arity, unsigned shift)
 {
+	COUNT(node_allocations);
 	const size_t content_size = CHAMP_NODE_ELEMENTS_SIZE(element_arity) + CHAMP_NODE_BRANCHES_SIZE(branch_arity);
-	struct node *result = malloc(sizeof(*result) + content_size);
+	const size_t map_size = shift == 0 ? sizeof(struct champ) : 0;
+	struct node *result = (struct node *)((char *)malloc(map_size + sizeof(*result) + content_size) + map_size);
 
 	result->element_arity = element_arity;
 	result->branch_arity = branch_arity;
-	result->ref_count = 0;
+	result->ref_count = shift == 0 ? NODE_INLINE : 0;
+	result->size = element_arity;
+	result->hash = 0;
 	result->element_map = element_map;
 	result->branch_map = branch_map;
 
@@ -263,6 +557,7 @@ static struct node *node_new(uint32_t element_map, uint32_t branch_map,
 	// reference counting
 	for (int i = 0; i < branch_arity; ++i) {
 		branches_dest[i] = champ_node_acquire(branches[i]);
+		result->size += branches[i]->size;
 	}
 
 	return result;
@@ -272,7 +567,7 @@ static CHAMP_VALUE_T collision_node_get(const struct collision_node *node, CHAMP
 					const CHAMP_KEY_T key, int *found)
 {
 	for (unsigned i = 0; i < node->element_arity; ++i) {
-		struct kv kv = node->content[i];
+		struct kv kv = element_load(&node->content[i], node->ref_count);
 		if (equals(kv.key, key)) {
 			*found = 1;
 			return kv.val;
@@ -308,94 +603,141 @@ static CHAMP_VALUE_T node_get(const struct node *node, CHAMP_EQUALSFN_T(equals),
 }
 
 static struct node *node_clone_insert_element(const struct node *node, uint32_t bitpos,
-					      const CHAMP_KEY_T key, const CHAMP_VALUE_T value)
+					      const CHAMP_KEY_T key, const CHAMP_VALUE_T value, unsigned shift)
 {
-	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH];
+	COUNT(insert_element);
+	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH], element_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	const CHAMP_NODE_ELEMENT_T *src_elements = node_elements(node, element_buffer);
 	const unsigned index = champ_index(node->element_map, bitpos);
 
 	// copy <element_arity> chunks in total
-	memcpy(elements, CHAMP_NODE_ELEMENTS(node), CHAMP_NODE_ELEMENTS_SIZE(index)); // copy first <index> chunks
+	memcpy(elements, src_elements, CHAMP_NODE_ELEMENTS_SIZE(index)); // copy first <index> chunks
 	elements[index].key = (CHAMP_KEY_T)key;
 	elements[index].val = (CHAMP_VALUE_T)value;
 	memcpy(
 		&elements[index + 1], // start copying into one-past-<index>
-		&CHAMP_NODE_ELEMENTS(node)[index], // start copying from <index>
+		&src_elements[index], // start copying from <index>
 		CHAMP_NODE_ELEMENTS_SIZE(node->element_arity - index) // <index> chunks already copied, <element_arity> - <index> remaining
 	);
 
 	return node_new(
 		node->element_map | bitpos, node->branch_map, elements,
-		node->element_arity + 1, CHAMP_NODE_BRANCHES(node), node->branch_arity);
+		node->element_arity + 1, node_branches(node, branch_buffer), node->branch_arity, shift);
 }
 
 static struct node *node_clone_update_element(const struct node *node,
-					      uint32_t bitpos, const CHAMP_VALUE_T value)
+					      uint32_t bitpos, const CHAMP_VALUE_T value, unsigned shift)
 {
-	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH];
+	COUNT(update_element);
+	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH], element_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
 	const unsigned index = champ_index(node->element_map, bitpos);
 
-	memcpy(elements, CHAMP_NODE_ELEMENTS(node), CHAMP_NODE_ELEMENTS_SIZE(node->element_arity));
+	memcpy(elements, node_elements(node, element_buffer), CHAMP_NODE_ELEMENTS_SIZE(node->element_arity));
 	elements[index].val = (CHAMP_VALUE_T)value;
-	return node_new(node->element_map, node->branch_map, elements, node->element_arity, CHAMP_NODE_BRANCHES(node), node->branch_arity);
+	return node_new(node->element_map, node->branch_map, elements, node->element_arity,
+			node_branches(node, branch_buffer), node->branch_arity, shift);
 }
 
 static struct node *node_clone_update_branch(const struct node *node,
-					     uint32_t bitpos, struct node *branch)
+					     uint32_t bitpos, struct node *branch, unsigned shift)
 {
+	COUNT(update_branch);
 	CHAMP_NODE_BRANCH_T branches[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_ELEMENT_T element_buffer[1u << HASH_PARTITION_WIDTH];
 	const unsigned index = champ_index(node->branch_map, bitpos);
 
-	memcpy(branches, CHAMP_NODE_BRANCHES(node), CHAMP_NODE_BRANCHES_SIZE(node->branch_arity));
+	memcpy(branches, node_branches(node, branch_buffer), CHAMP_NODE_BRANCHES_SIZE(node->branch_arity));
 	branches[index] = branch;
-	return node_new(node->element_map, node->branch_map, CHAMP_NODE_ELEMENTS(node), node->element_arity, branches, node->branch_arity);
+	return node_new(node->element_map, node->branch_map, node_elements(node, element_buffer), node->element_arity,
+			branches, node->branch_arity, shift);
 }
 
 static struct node *node_clone_pushdown(const struct node *node,
-					uint32_t bitpos, struct node *branch)
+					uint32_t bitpos, struct node *branch, unsigned shift)
 {
-	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH];
+	COUNT(pushdown);
+	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH], element_buffer[1u << HASH_PARTITION_WIDTH];
 	CHAMP_NODE_BRANCH_T branches[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	const CHAMP_NODE_ELEMENT_T *src_elements = node_elements(node, element_buffer);
+	CHAMP_NODE_BRANCH_T const *src_branches = node_branches(node, branch_buffer);
 	const unsigned element_index = champ_index(node->element_map, bitpos);
 	const unsigned branch_index = champ_index(node->branch_map, bitpos);
 
-	memcpy(elements, CHAMP_NODE_ELEMENTS(node), CHAMP_NODE_ELEMENTS_SIZE(element_index));
+	memcpy(elements, src_elements, CHAMP_NODE_ELEMENTS_SIZE(element_index));
 	memcpy(
 		&elements[element_index],
-		&CHAMP_NODE_ELEMENTS(node)[element_index + 1],
+		&src_elements[element_index + 1],
 		CHAMP_NODE_ELEMENTS_SIZE(node->element_arity - (element_index + 1))
 	);
 
-	memcpy(branches, CHAMP_NODE_BRANCHES(node), CHAMP_NODE_BRANCHES_SIZE(branch_index));
+	memcpy(branches, src_branches, CHAMP_NODE_BRANCHES_SIZE(branch_index));
 	memcpy(
 		&branches[branch_index + 1],
-		&CHAMP_NODE_BRANCHES(node)[branch_index],
+		&src_branches[branch_index],
 		CHAMP_NODE_BRANCHES_SIZE(node->branch_arity - branch_index)
 	);
 	branches[branch_index] = branch;
 
 	return node_new(
 		node->element_map & ~bitpos,
-		node->branch_map | bitpos, elements, node->element_arity - 1, branches, node->branch_arity + 1);
+		node->branch_map | bitpos, elements, node->element_arity - 1, branches, node->branch_arity + 1, shift);
 }
 
 static struct collision_node *collision_node_new(const CHAMP_NODE_ELEMENT_T *values, uint8_t element_arity)
 {
+	COUNT(collision_nodes);
+	COUNT(node_allocations);
 	size_t content_size = sizeof(CHAMP_NODE_ELEMENT_T) * element_arity;
 	struct collision_node *result = malloc(sizeof(*result) + content_size);
 
 	result->element_arity = element_arity;
 	result->branch_arity = 0;
 	result->ref_count = 0;
+	result->size = element_arity;
+	result->hash = 0;
+	result->element_map = 0;
+	result->branch_map = 0;
 
 	memcpy(result->content, values, CHAMP_NODE_ELEMENTS_SIZE(element_arity));
 
 	return result;
 }
 
+/**
+ * The hash of a node is the sum of the entry hashes of all entries below it, so it doesn't depend on the order of
+ * insertion, and every node on the path to a change is off by the same delta.
+ */
+static uint32_t entry_hash(const struct champ_type *type, uint32_t hash, const CHAMP_VALUE_T value)
+{
+	// the user's key hash, so that differently seeded maps with the same entries have the same hash
+	const uint32_t key_hash = type->seed ? hash_unmix(hash, type->seed) : hash;
+
+	// murmur3's finalizer, so that the sum doesn't cancel out for structured key and value hashes
+	uint32_t h = key_hash * 0x9e3779b1u + (type->value_hash ? type->value_hash(value) : 0u);
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static struct node *node_rehash(struct node *clone, const struct node *original, uint32_t delta)
+{
+	if (clone && clone != original)
+		clone->hash = original->hash + delta;
+	return clone;
+}
+
 static struct node *node_merge(uint32_t hash_l, const CHAMP_KEY_T key_l, const CHAMP_VALUE_T value_l,
 			       uint32_t hash_r, const CHAMP_KEY_T key_r, const CHAMP_VALUE_T value_r,
-			       unsigned shift)
+			       uint32_t entry_hashes, unsigned shift)
 {
+	COUNT(merge);
 	uint32_t bitpos_l = 1u << champ_mask(hash_l, shift);
 	uint32_t bitpos_r = 1u << champ_mask(hash_r, shift);
 
@@ -406,7 +748,9 @@ static struct node *node_merge(uint32_t hash_l, const CHAMP_KEY_T key_l, const C
 		elements[1].key = (CHAMP_KEY_T)key_r;
 		elements[1].val = (CHAMP_VALUE_T)value_r;
 
-		return (struct node *)collision_node_new(elements, 2);
+		struct node *result = (struct node *)collision_node_new(elements, 2);
+		result->hash = entry_hashes;
+		return result;
 
 	} else if (bitpos_l != bitpos_r) {
 		CHAMP_NODE_ELEMENT_T elements[2];
@@ -423,7 +767,9 @@ static struct node *node_merge(uint32_t hash_l, const CHAMP_KEY_T key_l, const C
 			elements[1].val = (CHAMP_VALUE_T)value_l;
 		}
 
-		return node_new(bitpos_l | bitpos_r, 0u, elements, 2, NULL, 0);
+		struct node *result = node_new(bitpos_l | bitpos_r, 0u, elements, 2, NULL, 0, shift);
+		result->hash = entry_hashes;
+		return result;
 
 	} else {
 		struct node *sub_node = node_merge(
@@ -433,19 +779,22 @@ static struct node *node_merge(uint32_t hash_l, const CHAMP_KEY_T key_l, const C
 			hash_r,
 			key_r,
 			value_r,
+			entry_hashes,
 			shift + HASH_PARTITION_WIDTH
 		);
 
-		return node_new(0, bitpos_l, NULL, 0, &sub_node, 1);
+		struct node *result = node_new(0, bitpos_l, NULL, 0, &sub_node, 1, shift);
+		result->hash = entry_hashes;
+		return result;
 	}
 }
 
 static struct collision_node *collision_node_clone_update_element(const struct collision_node *node,
 								  unsigned index, const CHAMP_VALUE_T value)
 {
-	CHAMP_NODE_ELEMENT_T elements[node->element_arity];
+	CHAMP_NODE_ELEMENT_T elements[node->element_arity], element_buffer[node->element_arity];
 
-	memcpy(elements, node->content, CHAMP_NODE_ELEMENTS_SIZE(node->element_arity));
+	memcpy(elements, collision_node_elements(node, element_buffer), CHAMP_NODE_ELEMENTS_SIZE(node->element_arity));
 	elements[index].val = (CHAMP_VALUE_T)value;
 
 	return collision_node_new(elements, node->element_arity);
@@ -455,9 +804,9 @@ static struct collision_node *collision_node_clone_insert_element(const struct c
 								  const CHAMP_KEY_T key,
 								  const CHAMP_VALUE_T value)
 {
-	CHAMP_NODE_ELEMENT_T elements[node->element_arity + 1];
+	CHAMP_NODE_ELEMENT_T elements[node->element_arity + 1], element_buffer[node->element_arity];
 
-	memcpy(elements, node->content, CHAMP_NODE_ELEMENTS_SIZE(node->element_arity));
+	memcpy(elements, collision_node_elements(node, element_buffer), CHAMP_NODE_ELEMENTS_SIZE(node->element_arity));
 	elements[node->element_arity].key = (CHAMP_KEY_T)key;
 	elements[node->element_arity].val = (CHAMP_VALUE_T)value;
 
@@ -465,80 +814,98 @@ static struct collision_node *collision_node_clone_insert_element(const struct c
 }
 
 static struct collision_node *collision_node_update(const struct collision_node *node,
-						    CHAMP_EQUALSFN_T(equals),
-						    const CHAMP_KEY_T key, const CHAMP_VALUE_T value,
-						    int *found)
+						    const struct champ_type *type, const CHAMP_KEY_T key, const CHAMP_VALUE_T value, uint32_t hash,
+						    int *found, uint32_t *delta)
 {
 	for (unsigned i = 0; i < node->element_arity; ++i) {
-		struct kv kv = node->content[i];
-		if (equals(kv.key, key)) {
+		struct kv kv = element_load(&node->content[i], node->ref_count);
+		if (type->equals(kv.key, key)) {
 			*found = 1;
+			if (kv.val == value)
+				return (struct collision_node *)node;
 
+			*delta = entry_hash(type, hash, value) - entry_hash(type, hash, kv.val);
 			return collision_node_clone_update_element(node, i, value);
 		}
 	}
 
+	*delta = entry_hash(type, hash, value);
 	return collision_node_clone_insert_element(node, key, value);
 }
 
-static struct node *node_update(const struct node *node, CHAMP_HASHFN_T(hashfn), CHAMP_EQUALSFN_T(equals),
-				const CHAMP_KEY_T key, const CHAMP_VALUE_T value, uint32_t hash, unsigned shift,
-				int *found)
+static struct node *node_update(const struct node *node, const struct champ_type *type, const CHAMP_KEY_T key,
+				const CHAMP_VALUE_T value, uint32_t hash, unsigned shift, int *found, uint32_t *delta)
 {
-	if (shift >= HASH_TOTAL_WIDTH)
-		return (struct node *)collision_node_update((const struct collision_node *)node, equals, key, value, found);
+	if (shift >= HASH_TOTAL_WIDTH) {
+		// *delta is only set by this call, so it can't be passed to node_rehash in the same expression
+		struct node *result = (struct node *)collision_node_update((const struct collision_node *)node, type,
+			key, value, hash, found, delta);
+		return node_rehash(result, node, *delta);
+	}
 
 	const uint32_t bitpos = 1u << champ_mask(hash, shift);
 
 	if (node->branch_map & bitpos) {
 		const struct node *sub_node = CHAMP_NODE_BRANCH_AT(node, bitpos);
-		struct node *new_sub_node = node_update(sub_node, hashfn, equals, key, value, hash,
-			shift + HASH_PARTITION_WIDTH, found);
-		return node_clone_update_branch(node, bitpos, new_sub_node);
+		struct node *new_sub_node = node_update(sub_node, type, key, value, hash,
+			shift + HASH_PARTITION_WIDTH, found, delta);
+		if (new_sub_node == sub_node)
+			return (struct node *)node;
+		return node_rehash(node_clone_update_branch(node, bitpos, new_sub_node, shift), node, *delta);
 
 	} else if (node->element_map & bitpos) {
 		const CHAMP_KEY_T current_key = CHAMP_NODE_ELEMENT_AT(node, bitpos).key;
+		const CHAMP_VALUE_T current_value = CHAMP_NODE_ELEMENT_AT(node, bitpos).val;
 
-		if (equals(current_key, key)) {
+		if (type->equals(current_key, key)) {
 			*found = 1;
-			return node_clone_update_element(node, bitpos, value);
+			if (current_value == value)
+				return (struct node *)node;
+			*delta = entry_hash(type, hash, value) - entry_hash(type, hash, current_value);
+			return node_rehash(node_clone_update_element(node, bitpos, value, shift), node, *delta);
 
 		} else {
-			const CHAMP_VALUE_T current_value = CHAMP_NODE_ELEMENT_AT(node, bitpos).val;
+			const uint32_t current_hash = type_key_hash(type, current_key);
+			*delta = entry_hash(type, hash, value);
 			struct node *sub_node = node_merge(
-				hashfn(current_key),
+				current_hash,
 				current_key,
 				current_value,
-				hashfn(key),
+				hash,
 				key,
 				value,
+				entry_hash(type, current_hash, current_value) + *delta,
 				shift + HASH_PARTITION_WIDTH
 			);
-			return node_clone_pushdown(node, bitpos, sub_node);
+			return node_rehash(node_clone_pushdown(node, bitpos, sub_node, shift), node, *delta);
 		}
 
 	} else {
-		return node_clone_insert_element(node, bitpos, key, value);
+		*delta = entry_hash(type, hash, value);
+		return node_rehash(node_clone_insert_element(node, bitpos, key, value, shift), node, *delta);
 	}
 }
 
-static struct node *node_clone_remove_element(const struct node *node, uint32_t bitpos)
+static struct node *node_clone_remove_element(const struct node *node, uint32_t bitpos, unsigned shift)
 {
+	COUNT(remove_element);
 	DEBUG_NOTICE("removing element with bit position 0x%x\n", bitpos);
 
-	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH], element_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	const CHAMP_NODE_ELEMENT_T *src_elements = node_elements(node, element_buffer);
 	const unsigned index = champ_index(node->element_map, bitpos);
 
-	memcpy(elements, CHAMP_NODE_ELEMENTS(node), CHAMP_NODE_ELEMENTS_SIZE(index));
+	memcpy(elements, src_elements, CHAMP_NODE_ELEMENTS_SIZE(index));
 	memcpy(
 		&elements[index],
-		&CHAMP_NODE_ELEMENTS(node)[index + 1],
+		&src_elements[index + 1],
 		CHAMP_NODE_ELEMENTS_SIZE(node->element_arity - (index + 1))
 	);
 
 	return node_new(
 		node->element_map & ~bitpos, node->branch_map, elements,
-		node->element_arity - 1, CHAMP_NODE_BRANCHES(node), node->branch_arity);
+		node->element_arity - 1, node_branches(node, branch_buffer), node->branch_arity, shift);
 }
 
 /*
@@ -546,40 +913,45 @@ static struct node *node_clone_remove_element(const struct node *node, uint32_t
  * It's the process of 'pulling an entry up' from a branch, inlining it as an element instead.
  */
 static struct node *node_clone_pullup(const struct node *node, uint32_t bitpos,
-				      const struct kv element)
+				      const struct kv element, unsigned shift)
 {
+	COUNT(pullup);
 	CHAMP_NODE_BRANCH_T branches[1u << HASH_PARTITION_WIDTH];
-	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH], element_buffer[1u << HASH_PARTITION_WIDTH];
+	const CHAMP_NODE_ELEMENT_T *src_elements = node_elements(node, element_buffer);
+	CHAMP_NODE_BRANCH_T const *src_branches = node_branches(node, branch_buffer);
 	const unsigned branch_index = champ_index(node->branch_map, bitpos);
 	const unsigned element_index = champ_index(node->element_map, bitpos);
 
-	memcpy(branches, CHAMP_NODE_BRANCHES(node), CHAMP_NODE_BRANCHES_SIZE(branch_index));
+	memcpy(branches, src_branches, CHAMP_NODE_BRANCHES_SIZE(branch_index));
 	memcpy(
 		&branches[branch_index],
-		&CHAMP_NODE_BRANCHES(node)[branch_index + 1],
+		&src_branches[branch_index + 1],
 		CHAMP_NODE_BRANCHES_SIZE(node->branch_arity - (branch_index + 1))
 	);
 
-	memcpy(elements, CHAMP_NODE_ELEMENTS(node), CHAMP_NODE_ELEMENTS_SIZE(element_index));
+	memcpy(elements, src_elements, CHAMP_NODE_ELEMENTS_SIZE(element_index));
 	elements[element_index] = element;
 	memcpy(
 		&elements[element_index + 1],
-		&CHAMP_NODE_ELEMENTS(node)[element_index],
+		&src_elements[element_index],
 		CHAMP_NODE_ELEMENTS_SIZE(node->element_arity - element_index)
 	);
 
 	return node_new(
 		node->element_map | bitpos,
-		node->branch_map & ~bitpos, elements, node->element_arity + 1, branches, node->branch_arity - 1);
+		node->branch_map & ~bitpos, elements, node->element_arity + 1, branches, node->branch_arity - 1, shift);
 }
 
 static struct collision_node *collision_node_clone_remove_element(const struct collision_node *node,
 								  unsigned index)
 {
-	CHAMP_NODE_ELEMENT_T elements[node->element_arity - 1];
+	CHAMP_NODE_ELEMENT_T elements[node->element_arity - 1], element_buffer[node->element_arity];
+	const CHAMP_NODE_ELEMENT_T *src_elements = collision_node_elements(node, element_buffer);
 
-	memcpy(elements, node->content, CHAMP_NODE_ELEMENTS_SIZE(index));
-	memcpy(elements, &node->content[index + 1], CHAMP_NODE_ELEMENTS_SIZE(node->element_arity - (index + 1)));
+	memcpy(elements, src_elements, CHAMP_NODE_ELEMENTS_SIZE(index));
+	memcpy(&elements[index], &src_elements[index + 1], CHAMP_NODE_ELEMENTS_SIZE(node->element_arity - (index + 1)));
 
 	return collision_node_new(elements, node->element_arity - 1);
 }
@@ -595,17 +967,17 @@ static struct collision_node *collision_node_clone_remove_element(const struct c
  *
  * @return
  */
-static struct collision_node *collision_node_del(const struct collision_node *node,
-						 CHAMP_EQUALSFN_T(equals), const CHAMP_KEY_T key,
-						 int *modified)
+static struct collision_node *collision_node_del(const struct collision_node *node, const struct champ_type *type,
+						 const CHAMP_KEY_T key, uint32_t hash, int *modified, uint32_t *delta)
 {
 	for (unsigned i = 0; i < node->element_arity; ++i) {
-		struct kv kv = node->content[i];
-		if (equals(kv.key, key)) {
+		struct kv kv = element_load(&node->content[i], node->ref_count);
+		if (type->equals(kv.key, key)) {
 			*modified = 1;
+			*delta = -entry_hash(type, hash, kv.val);
 			if (node->element_arity == 2) {
-				CHAMP_NODE_ELEMENT_T elements[1] = {node->content[i ? 0 : 1]};
-				return (struct collision_node *)node_new(0, 0, elements, 1, NULL, 0);
+				CHAMP_NODE_ELEMENT_T elements[1] = {element_load(&node->content[i ? 0 : 1], node->ref_count)};
+				return (struct collision_node *)node_new(0, 0, elements, 1, NULL, 0, HASH_TOTAL_WIDTH);
 
 			} else {
 				return collision_node_clone_remove_element(node, i);
@@ -616,29 +988,34 @@ static struct collision_node *collision_node_del(const struct collision_node *no
 	return NULL;
 }
 
-static struct node *node_del(const struct node *node, CHAMP_EQUALSFN_T(equals),
-			     const CHAMP_KEY_T key, uint32_t hash, unsigned shift, int *modified)
+static struct node *node_del(const struct node *node, const struct champ_type *type, const CHAMP_KEY_T key,
+			     uint32_t hash, unsigned shift, int *modified, uint32_t *delta)
 {
-	if (shift >= HASH_TOTAL_WIDTH)
-		return (struct node *)collision_node_del((const struct collision_node *)node, equals, key, modified);
+	if (shift >= HASH_TOTAL_WIDTH) {
+		struct node *result = (struct node *)collision_node_del((const struct collision_node *)node, type,
+			key, hash, modified, delta);
+		return node_rehash(result, node, *delta);
+	}
 
 	const uint32_t bitpos = 1u << champ_mask(hash, shift);
 
 	if (node->element_map & bitpos) {
-		if (equals(CHAMP_NODE_ELEMENT_AT(node, bitpos).key, key)) {
+		const struct kv element = CHAMP_NODE_ELEMENT_AT(node, bitpos);
+		if (type->equals(element.key, key)) {
 			*modified = 1;
+			*delta = -entry_hash(type, hash, element.val);
 			if (node->element_arity + node->branch_arity == 1) // only possible for the root node
 				return (struct node *)&empty_node;
 			else
-				return node_clone_remove_element(node, bitpos);
+				return node_rehash(node_clone_remove_element(node, bitpos, shift), node, *delta);
 		} else {
 			return NULL; // returning from node_del with *modified == 0 means abort immediately
 		}
 
 	} else if (node->branch_map & bitpos) {
 		struct node *sub_node = CHAMP_NODE_BRANCH_AT(node, bitpos);
-		struct node *new_sub_node = node_del(sub_node, equals, key, hash,
-			shift + HASH_PARTITION_WIDTH, modified);
+		struct node *new_sub_node = node_del(sub_node, type, key, hash,
+			shift + HASH_PARTITION_WIDTH, modified, delta);
 
 		if (!*modified)
 			return NULL; // returning from node_del with *modified == 0 means abort immediately
@@ -648,16 +1025,16 @@ static struct node *node_del(const struct node *node, CHAMP_EQUALSFN_T(equals),
 				new_sub_node->element_map = bitpos;
 				return new_sub_node;
 			} else { // canonical, bubble modified trie to the top
-				return node_clone_update_branch(node, bitpos, new_sub_node);
+				return node_rehash(node_clone_update_branch(node, bitpos, new_sub_node, shift), node, *delta);
 			}
 
 		} else if (new_sub_node->branch_arity * 2 + new_sub_node->element_arity == 1) { // new_sub_node is non-canonical
 			const struct kv remaining_element = CHAMP_NODE_ELEMENTS(new_sub_node)[0];
-			node_destroy(new_sub_node);
-			return node_clone_pullup(node, bitpos, remaining_element);
+			node_destroy(new_sub_node, NULL);
+			return node_rehash(node_clone_pullup(node, bitpos, remaining_element, shift), node, *delta);
 
 		} else { // both node and new_sub_node are canonical
-			return node_clone_update_branch(node, bitpos, new_sub_node);
+			return node_rehash(node_clone_update_branch(node, bitpos, new_sub_node, shift), node, *delta);
 		}
 
 	} else {
@@ -665,69 +1042,83 @@ static struct node *node_del(const struct node *node, CHAMP_EQUALSFN_T(equals),
 	}
 }
 
-static struct collision_node *collision_node_assoc(const struct collision_node *node,
-						   CHAMP_EQUALSFN_T(equals),
+static struct collision_node *collision_node_assoc(const struct collision_node *node, const struct champ_type *type,
 						   const CHAMP_KEY_T key, CHAMP_ASSOCFN_T(fn),
-						   const void *user_data,
-						   int *found)
+						   const void *user_data, uint32_t hash,
+						   int *found, uint32_t *delta)
 {
 	CHAMP_VALUE_T new_value;
 	for (unsigned i = 0; i < node->element_arity; ++i) {
-		struct kv kv = node->content[i];
-		if (equals(kv.key, key)) {
+		struct kv kv = element_load(&node->content[i], node->ref_count);
+		if (type->equals(kv.key, key)) {
 			*found = 1;
 			CHAMP_VALUE_T old_value = kv.val;
 			new_value = fn(key, old_value, (void *)user_data);
+			if (new_value == old_value)
+				return (struct collision_node *)node;
+			*delta = entry_hash(type, hash, new_value) - entry_hash(type, hash, old_value);
 			return collision_node_clone_update_element(node, i, new_value);
 		}
 	}
 
 	new_value = fn((CHAMP_KEY_T)0, (CHAMP_VALUE_T)0, (void *)user_data);
+	*delta = entry_hash(type, hash, new_value);
 	return collision_node_clone_insert_element(node, key, new_value);
 }
 
-static struct node *node_assoc(const struct node *node, CHAMP_HASHFN_T(hashfn), CHAMP_EQUALSFN_T(equals),
-			       const CHAMP_KEY_T key, CHAMP_ASSOCFN_T(fn), const void *user_data, uint32_t hash,
-			       unsigned shift, int *found)
+static struct node *node_assoc(const struct node *node, const struct champ_type *type, const CHAMP_KEY_T key,
+			       CHAMP_ASSOCFN_T(fn), const void *user_data, uint32_t hash, unsigned shift, int *found,
+			       uint32_t *delta)
 {
-	if (shift >= HASH_TOTAL_WIDTH)
-		return (struct node *)collision_node_assoc((const struct collision_node *)node, equals, key, fn, user_data, found);
+	if (shift >= HASH_TOTAL_WIDTH) {
+		struct node *result = (struct node *)collision_node_assoc((const struct collision_node *)node, type,
+			key, fn, user_data, hash, found, delta);
+		return node_rehash(result, node, *delta);
+	}
 
 	const uint32_t bitpos = 1u << champ_mask(hash, shift);
 
 	if (node->branch_map & bitpos) {
 		const struct node *sub_node = CHAMP_NODE_BRANCH_AT(node, bitpos);
-		struct node *new_sub_node = node_assoc(sub_node, hashfn, equals, key, fn, user_data, hash,
-			shift + HASH_PARTITION_WIDTH, found);
-		return node_clone_update_branch(node, bitpos, new_sub_node);
+		struct node *new_sub_node = node_assoc(sub_node, type, key, fn, user_data, hash,
+			shift + HASH_PARTITION_WIDTH, found, delta);
+		if (new_sub_node == sub_node)
+			return (struct node *)node;
+		return node_rehash(node_clone_update_branch(node, bitpos, new_sub_node, shift), node, *delta);
 
 	} else if (node->element_map & bitpos) {
 		const CHAMP_KEY_T current_key = CHAMP_NODE_ELEMENT_AT(node, bitpos).key;
+		const CHAMP_VALUE_T current_value = CHAMP_NODE_ELEMENT_AT(node, bitpos).val;
 
-		if (equals(current_key, key)) {
+		if (type->equals(current_key, key)) {
 			*found = 1;
-			const CHAMP_VALUE_T old_value = CHAMP_NODE_ELEMENT_AT(node, bitpos).val;
-			CHAMP_VALUE_T new_value = fn(key, old_value, (void *)user_data);
-			return node_clone_update_element(node, bitpos, new_value);
+			CHAMP_VALUE_T new_value = fn(key, current_value, (void *)user_data);
+			if (new_value == current_value)
+				return (struct node *)node;
+			*delta = entry_hash(type, hash, new_value) - entry_hash(type, hash, current_value);
+			return node_rehash(node_clone_update_element(node, bitpos, new_value, shift), node, *delta);
 
 		} else {
-			const CHAMP_VALUE_T current_value = CHAMP_NODE_ELEMENT_AT(node, bitpos).val;
+			const uint32_t current_hash = type_key_hash(type, current_key);
 			const CHAMP_VALUE_T new_value = fn((CHAMP_KEY_T)0, (CHAMP_VALUE_T)0, (void *)user_data);
+			*delta = entry_hash(type, hash, new_value);
 			struct node *sub_node = node_merge(
-				hashfn(current_key),
+				current_hash,
 				current_key,
 				current_value,
 				hash,
 				key,
 				new_value,
+				entry_hash(type, current_hash, current_value) + *delta,
 				shift + HASH_PARTITION_WIDTH
 			);
-			return node_clone_pushdown(node, bitpos, sub_node);
+			return node_rehash(node_clone_pushdown(node, bitpos, sub_node, shift), node, *delta);
 		}
 
 	} else {
 		const CHAMP_VALUE_T value = fn((CHAMP_KEY_T)0, (CHAMP_VALUE_T)0, (void *)user_data);
-		return node_clone_insert_element(node, bitpos, key, value);
+		*delta = entry_hash(type, hash, value);
+		return node_rehash(node_clone_insert_element(node, bitpos, key, value, shift), node, *delta);
 	}
 }
 
@@ -741,10 +1132,10 @@ static int collision_node_equals(const struct collision_node *left, const struct
 
 
 	for (unsigned left_i = 0; left_i < left->element_arity; ++left_i) {
-		struct kv left_element = CHAMP_NODE_ELEMENTS(left)[left_i];
+		struct kv left_element = element_load(&CHAMP_NODE_ELEMENTS(left)[left_i], left->ref_count);
 
 		for (unsigned right_i = 0; right_i < right->element_arity; ++right_i) {
-			struct kv right_element = CHAMP_NODE_ELEMENTS(right)[right_i];
+			struct kv right_element = element_load(&CHAMP_NODE_ELEMENTS(right)[right_i], right->ref_count);
 
 			if (key_equals(left_element.key, right_element.key) && value_equals(left_element.val, right_element.val))
 				goto found_matching_element;
@@ -758,8 +1149,10 @@ static int collision_node_equals(const struct collision_node *left, const struct
 }
 
 static int node_equals(const struct node *left, const struct node *right, CHAMP_EQUALSFN_T(key_equals),
-		       CHAMP_VALUE_EQUALSFN_T(value_equals), unsigned shift)
+		       CHAMP_VALUE_EQUALSFN_T(value_equals), int compare_hashes, unsigned shift)
 {
+	if (compare_hashes && left->hash != right->hash)
+		return 0;
 	if (shift >= HASH_TOTAL_WIDTH)
 		return collision_node_equals((struct collision_node *)left, (struct collision_node *)right, key_equals, value_equals);
 	if (left == right)
@@ -769,54 +1162,252 @@ static int node_equals(const struct node *left, const struct node *right, CHAMP_
 	if (left->branch_map != right->branch_map)
 		return 0;
 	for (unsigned i = 0; i < left->element_arity; ++i) {
-		struct kv left_element = CHAMP_NODE_ELEMENTS(left)[i];
-		struct kv right_element = CHAMP_NODE_ELEMENTS(right)[i];
+		struct kv left_element = element_load(&CHAMP_NODE_ELEMENTS(left)[i], left->ref_count);
+		struct kv right_element = element_load(&CHAMP_NODE_ELEMENTS(right)[i], right->ref_count);
 		if (!key_equals(left_element.key, right_element.key) || !value_equals(left_element.val, right_element.val))
 			return 0;
 	}
 	for (unsigned i = 0; i < left->branch_arity; ++i) {
-		struct node *left_branch = CHAMP_NODE_BRANCHES(left)[i];
-		struct node *right_branch = CHAMP_NODE_BRANCHES(right)[i];
-		if (!node_equals(left_branch, right_branch, key_equals, value_equals, shift + HASH_PARTITION_WIDTH))
+		struct node *left_branch = branch_load(&CHAMP_NODE_BRANCHES(left)[i], left->ref_count);
+		struct node *right_branch = branch_load(&CHAMP_NODE_BRANCHES(right)[i], right->ref_count);
+		if (!node_equals(left_branch, right_branch, key_equals, value_equals, compare_hashes, shift + HASH_PARTITION_WIDTH))
 			return 0;
 	}
 	return 1;
 }
 
 
-static struct champ *champ_from(struct node *root, unsigned length,
-				CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals))
+/*
+ * Deferred reclamation
+ *
+ * Normally, a node is destroyed as soon as its last reference goes away, and takes its unshared subtree with it. With
+ * reclamation deferred, such a node is pushed onto a lock-free stack instead, and champ_reclaim frees a bounded number
+ * of nodes at a time. Releasing a map then costs the releasing thread at most one push per root branch.
+ *
+ * Dead nodes are linked through their size and hash fields, which nobody reads anymore. Only one thread pops at a
+ * time, so a node can't be freed and pushed again while a pop is looking at it.
+ */
+
+static atomic_int reclamation_deferred = 0;
+static struct node *_Atomic dead_nodes = NULL;
+static atomic_ulong dead_node_count = 0;
+static atomic_flag reclaiming = ATOMIC_FLAG_INIT;
+
+/*
+ * A dead node keeps its arities and entries for node_destroy, the rest of its header holds the link to the next dead
+ * node and the type it belonged to.
+ */
+#define DEAD_NODE_LINK(node) ((char *)(node) + offsetof(struct node, size))
+#define DEAD_NODE_TYPE(node) ((char *)(node) + offsetof(struct node, element_map))
+
+static struct node *dead_node_next(const struct node *node)
+{
+	struct node *next;
+	memcpy(&next, DEAD_NODE_LINK(node), sizeof next);
+	return next;
+}
+
+static void node_defer(struct node *node, const struct champ_type *type)
+{
+	if (!atomic_load_explicit(&reclamation_deferred, memory_order_relaxed)) {
+		node_destroy(node, type);
+		return;
+	}
+
+	COUNT(node_deferrals);
+	memcpy(DEAD_NODE_TYPE(node), &type, sizeof type);
+	struct node *head = atomic_load(&dead_nodes);
+	do {
+		memcpy(DEAD_NODE_LINK(node), &head, sizeof head);
+	} while (!atomic_compare_exchange_weak(&dead_nodes, &head, node));
+	atomic_fetch_add(&dead_node_count, 1);
+}
+
+void champ_defer_reclamation(int deferred)
+{
+	atomic_store(&reclamation_deferred, deferred);
+}
+
+size_t champ_reclaim(size_t budget)
+{
+	if (atomic_flag_test_and_set(&reclaiming))
+		return 0;
+
+	size_t freed = 0;
+	while (freed < budget) {
+		struct node *node = atomic_load(&dead_nodes);
+		do {
+			if (!node)
+				goto done;
+		} while (!atomic_compare_exchange_weak(&dead_nodes, &node, dead_node_next(node)));
+		atomic_fetch_sub(&dead_node_count, 1);
+		const struct champ_type *type;
+		memcpy(&type, DEAD_NODE_TYPE(node), sizeof type);
+		// releasing its branches may push more dead nodes, which are then reclaimed in later iterations
+		node_destroy(node, type);
+		++freed;
+	}
+
+done:
+	atomic_flag_clear(&reclaiming);
+	return freed;
+}
+
+unsigned long champ_reclaim_pending(void)
+{
+	return atomic_load(&dead_node_count);
+}
+
+/*
+ * Types
+ *
+ * Interned in a list that only ever grows, so readers need no lock.
+ */
+
+struct interned_type {
+	struct champ_type type;
+	struct interned_type *next;
+};
+
+static struct interned_type *_Atomic interned_types = NULL;
+
+const struct champ_type *champ_type_of(const struct champ_type *type)
+{
+	struct interned_type *head = atomic_load(&interned_types);
+	struct interned_type *created = NULL;
+	for (;;) {
+		for (struct interned_type *current = head; current; current = current->next) {
+			if (current->type.hash == type->hash && current->type.equals == type->equals &&
+			    current->type.value_hash == type->value_hash &&
+			    current->type.key_acquire == type->key_acquire && current->type.key_release == type->key_release &&
+			    current->type.value_acquire == type->value_acquire &&
+			    current->type.value_release == type->value_release && current->type.seed == type->seed) {
+				free(created);
+				return &current->type;
+			}
+		}
+		if (!created) {
+			created = malloc(sizeof *created);
+			created->type = *type;
+		}
+		created->next = head;
+		if (atomic_compare_exchange_weak(&interned_types, &head, created))
+			return &created->type;
+	}
+}
+
+const struct champ_type *champ_type_intern(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals),
+					   CHAMP_VALUE_HASHFN_T(value_hash))
+{
+	const struct champ_type type = {.hash = hash, .equals = equals, .value_hash = value_hash};
+	return champ_type_of(&type);
+}
+
+// type with its seed replaced
+static const struct champ_type *champ_type_seeded(const struct champ_type *type, uint32_t seed)
+{
+	if (type->seed == seed)
+		return type;
+	struct champ_type seeded = *type;
+	seeded.seed = seed;
+	return champ_type_of(&seeded);
+}
+
+/**
+ * Wraps root in a map. Inline roots already come with the memory for it, any other root gets a map of its own.
+ */
+static struct champ *champ_from(struct node *root, unsigned length, const struct champ_type *type)
 {
-	struct champ *result = malloc(sizeof(*result));
+	struct champ *result;
+	if (root->ref_count == NODE_INLINE) {
+		result = (struct champ *)root - 1;
+	} else {
+		COUNT(champ_allocations);
+		result = malloc(sizeof(*result));
+		champ_node_acquire(root);
+	}
 	result->ref_count = 0;
 	result->root = root;
 	result->length = length;
-	result->hash = hash;
-	result->equals = equals;
+	result->type = type;
 	return result;
 }
 
+/*
+ * Small maps whose root has no branches are updated by champ_set and champ_del directly, without walking the trie,
+ * as long as they have at most CHAMP_INLINE_ARITY entries and no two keys share a slot.
+ */
+#ifndef CHAMP_INLINE_ARITY
+#define CHAMP_INLINE_ARITY 8u
+#endif
+
+static inline int champ_is_inline(const struct champ *champ)
+{
+	return champ->root == (const struct node *)(champ + 1) && champ->root->ref_count == NODE_INLINE;
+}
+
+static struct champ *champ_from_elements(uint32_t element_map, CHAMP_NODE_ELEMENT_T const *elements,
+					 uint8_t element_arity, uint32_t root_hash, const struct champ_type *type)
+{
+	struct node *root = node_new(element_map, 0, elements, element_arity, NULL, 0, 0);
+	root->hash = root_hash;
+	node_acquire_elements(root, type);
+	return champ_from(root, element_arity, type);
+}
+
 void champ_destroy(struct champ **champ)
 {
+	COUNT(champ_frees);
 	DEBUG_NOTICE("destroying champ@%p\n", (void *)*champ);
-	champ_node_release((*champ)->root);
+	const struct node *root = (*champ)->root;
+	const struct champ_type *type = (*champ)->type;
+	if (champ_is_inline(*champ)) {
+		// ownership of keys and values
+		const CHAMP_NODE_ELEMENT_T *elements = CHAMP_NODE_ELEMENTS(root);
+		for (int i = 0; i < root->element_arity; ++i) {
+			if (type->key_release)
+				type->key_release(elements[i].key);
+			if (type->value_release)
+				type->value_release(elements[i].val);
+		}
+
+		// reference counting
+		CHAMP_NODE_BRANCH_T *branches = (CHAMP_NODE_BRANCH_T *)CHAMP_NODE_BRANCHES(root);
+		for (int i = 0; i < root->branch_arity; ++i) {
+			champ_node_release(branches[i], type);
+		}
+	} else {
+		champ_node_release(root, type);
+	}
 	free(*champ);
 	*champ = NULL;
 }
 
 struct champ *champ_new(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals))
 {
-	return champ_from((struct node *)&empty_node, 0, hash, equals);
+	return champ_from((struct node *)&empty_node, 0, champ_type_intern(hash, equals, NULL));
+}
+
+struct champ *champ_new_hashed(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals), CHAMP_VALUE_HASHFN_T(value_hash))
+{
+	return champ_from((struct node *)&empty_node, 0, champ_type_intern(hash, equals, value_hash));
+}
+
+struct champ *champ_new_typed(const struct champ_type *type)
+{
+	return champ_from((struct node *)&empty_node, 0, champ_type_of(type));
 }
 
 struct champ *champ_acquire(const struct champ *champ)
 {
+	COUNT(champ_acquires);
 	atomic_fetch_add((uint32_t *)&champ->ref_count, 1u);
 	return (struct champ *)champ;
 }
 
 void champ_release(struct champ **champ)
 {
+	COUNT(champ_releases);
 	if (atomic_fetch_sub((uint32_t *)&((*champ)->ref_count), 1u) == 1u)
 		champ_destroy((struct champ **)champ);
 	*champ = NULL;
@@ -828,88 +1419,508 @@ struct champ *champ_of(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals),
 	struct champ *result = champ_new(hash, equals);
 	while (length--) {
 		struct champ *tmp = champ_set(result, keys[length], values[length], NULL);
-		champ_destroy(&result);
-		result = tmp;
+		if (tmp != result) {
+			champ_destroy(&result);
+			result = tmp;
+		}
 	}
 	return result;
 }
 
-unsigned champ_length(const struct champ *champ)
+uint32_t champ_key_hash(const struct champ *champ, const CHAMP_KEY_T key)
 {
-	return champ->length;
+	return type_key_hash(champ->type, key);
 }
 
-struct champ *champ_set(const struct champ *champ,
-			const CHAMP_KEY_T key, const CHAMP_VALUE_T value, int *replaced)
+unsigned champ_length(const struct champ *champ)
 {
-	const uint32_t hash = champ->hash(key);
-	int found = 0;
-	int *found_p = replaced ? replaced : &found;
-	*found_p = 0;
-	struct node *new_root = champ_node_acquire(node_update(champ->root, champ->hash, champ->equals, key, value, hash, 0, found_p));
-	return champ_from(new_root, champ->length + (*found_p ? 0 : 1), champ->hash, champ->equals);
+	return champ->length;
 }
 
-CHAMP_VALUE_T champ_get(const struct champ *champ, const CHAMP_KEY_T key, int *found)
+uint32_t champ_hash(const struct champ *champ)
 {
-	uint32_t hash = champ->hash(key);
-	int tmp = 0;
-	return node_get(champ->root, champ->equals, key, hash, 0, found ? found : &tmp);
+	return champ->root->hash;
 }
 
-struct champ *champ_del(const struct champ *champ, const CHAMP_KEY_T key, int *modified)
+int champ_nth(const struct champ *champ, unsigned index, CHAMP_KEY_T *key, CHAMP_VALUE_T *value)
 {
-	const uint32_t hash = champ->hash(key);
-	int found = 0;
-	int *found_p = modified ? modified : &found;
-	*found_p = 0;
-	struct node *new_root = node_del(champ->root, champ->equals, key, hash, 0, found_p);
-	if (!*found_p)
-		return (struct champ *)champ;
-	return champ_from(champ_node_acquire(new_root), champ->length - 1, champ->hash, champ->equals);
-}
+	if (index >= champ->length)
+		return 0;
 
-struct champ *champ_assoc(const struct champ *champ, const CHAMP_KEY_T key, CHAMP_ASSOCFN_T(fn), const void *user_data)
-{
-	const uint32_t hash = champ->hash(key);
-	int found = 0;
-	struct node *new_root = champ_node_acquire(node_assoc(champ->root, champ->hash, champ->equals, key, fn, user_data, hash, 0, &found));
-	return champ_from(new_root, champ->length + (found ? 0 : 1), champ->hash, champ->equals);
+	const struct node *node = champ->root;
+	for (unsigned shift = 0;; shift += HASH_PARTITION_WIDTH) {
+		if (index < node->element_arity) {
+			const CHAMP_NODE_ELEMENT_T *elements = shift >= HASH_TOTAL_WIDTH ?
+				((const struct collision_node *)node)->content : CHAMP_NODE_ELEMENTS(node);
+			const CHAMP_NODE_ELEMENT_T element = element_load(&elements[index], node->ref_count);
+			if (key)
+				*key = element.key;
+			if (value)
+				*value = element.val;
+			return 1;
+		}
+
+		index -= node->element_arity;
+		for (unsigned i = 0;; ++i) {
+			const struct node *branch = branch_load(&CHAMP_NODE_BRANCHES(node)[i], node->ref_count);
+			if (index < branch->size) {
+				node = branch;
+				break;
+			}
+			index -= branch->size;
+		}
+	}
 }
 
-int champ_equals(const struct champ *left, const struct champ *right, CHAMP_VALUE_EQUALSFN_T(value_equals))
+unsigned champ_sample(const struct champ *champ, uint32_t (*random)(void *state), void *state, unsigned n,
+		      CHAMP_KEY_T *keys, CHAMP_VALUE_T *values)
 {
-	if (left == right)
-		return 1;
-	else if (champ_length(left) != champ_length(right))
+	if (champ->length == 0)
 		return 0;
-	else
-		return node_equals(left->root, right->root, left->equals, value_equals, 0);
-}
 
-static const char *indent(unsigned level)
-{
-	const char *spaces = "                                                                                ";
-	return spaces + 4 * (20 - level);
+	for (unsigned i = 0; i < n; ++i) {
+		// scales a 32 bit random number to [0, length) without a division
+		const unsigned index = (unsigned)(((uint64_t)random(state) * champ->length) >> 32u);
+		champ_nth(champ, index, keys ? &keys[i] : NULL, values ? &values[i] : NULL);
+	}
+	return n;
 }
 
-#define iprintf(level, fmt, ...) printf("%s" fmt, indent(level), __VA_ARGS__)
-
-static char *format_binary(uint32_t value, char *buffer)
+unsigned champ_split(const struct champ *champ, struct champ *out[32])
 {
-	for (char *pos = buffer + 31; pos >= buffer; --pos) {
-		if (value & 1u) *pos = '1';
-		else *pos = '0';
-		value = value >> 1u;
+	const struct node *root = champ->root;
+	unsigned parts = 0;
+	for (unsigned slot = 0; slot < 32; ++slot) {
+		const uint32_t bitpos = 1u << slot;
+		struct node *part;
+		if (root->element_map & bitpos) {
+			const CHAMP_NODE_ELEMENT_T element = CHAMP_NODE_ELEMENT_AT(root, bitpos);
+			part = node_new(bitpos, 0, &element, 1, NULL, 0, 0);
+			part->hash = entry_hash(champ->type, type_key_hash(champ->type, element.key), element.val);
+			node_acquire_elements(part, champ->type);
+		} else if (root->branch_map & bitpos) {
+			// a root with a single branch is canonical, since the branch holds at least two entries
+			CHAMP_NODE_BRANCH_T branch = CHAMP_NODE_BRANCH_AT(root, bitpos);
+			part = node_new(0, bitpos, NULL, 0, &branch, 1, 0);
+			part->hash = branch->hash;
+		} else {
+			out[slot] = champ_from((struct node *)&empty_node, 0, champ->type);
+			continue;
+		}
+		out[slot] = champ_from(part, part->size, champ->type);
+		++parts;
 	}
-	return buffer;
+	return parts;
 }
 
-static void champ_node_repr(const struct node *node, const char *kp, const char *vp, unsigned shift, unsigned i_level)
+struct champ *champ_join(struct champ *const parts[32])
 {
-	if (shift >= HASH_TOTAL_WIDTH) {
-		iprintf(i_level, "\"collision node (omitted)\"%s", "");
-		return;
+	const struct node *owners[32] = {NULL};
+	uint32_t element_map = 0, branch_map = 0, hash = 0;
+	unsigned length = 0;
+	for (unsigned i = 0; i < 32; ++i) {
+		const struct node *root = parts[i]->root;
+		const uint32_t slots = root->element_map | root->branch_map;
+		if ((element_map | branch_map) & slots || parts[i]->type != parts[0]->type)
+			return NULL;
+		for (unsigned slot = 0; slot < 32; ++slot) {
+			if (slots & (1u << slot))
+				owners[slot] = root;
+		}
+		element_map |= root->element_map;
+		branch_map |= root->branch_map;
+		hash += root->hash;
+		length += parts[i]->length;
+	}
+
+	CHAMP_NODE_ELEMENT_T elements[32];
+	CHAMP_NODE_BRANCH_T branches[32];
+	uint8_t element_arity = 0, branch_arity = 0;
+	for (unsigned slot = 0; slot < 32; ++slot) {
+		const uint32_t bitpos = 1u << slot;
+		if (element_map & bitpos)
+			elements[element_arity++] = CHAMP_NODE_ELEMENT_AT(owners[slot], bitpos);
+		else if (branch_map & bitpos)
+			branches[branch_arity++] = CHAMP_NODE_BRANCH_AT(owners[slot], bitpos);
+	}
+
+	struct node *root = (struct node *)&empty_node;
+	if (length) {
+		root = node_new(element_map, branch_map, elements, element_arity, branches, branch_arity, 0);
+		root->hash = hash;
+		node_acquire_elements(root, parts[0]->type);
+	}
+	return champ_from(root, length, parts[0]->type);
+}
+
+/*
+ * Reseeding
+ *
+ * A hash function that leaves some bits of its hashes alike makes for chains of nodes with a single branch each, which
+ * every lookup has to walk through. With evenly spread hashes, a node with a single branch almost never holds more than
+ * a few entries, so champ_clusters reports a map as soon as one such node holds CHAMP_RESEED_CHAIN entries or more.
+ * Rebuilding it with champ_reseed is left to the caller, as the result shares no nodes with any earlier version.
+ */
+#ifndef CHAMP_RESEED_CHAIN
+#define CHAMP_RESEED_CHAIN 8u
+#endif
+
+/**
+ * Returns whether there is a chain of single branch nodes at or below node that holds CHAMP_RESEED_CHAIN entries or
+ * more, unless it only leads to a collision node, since no seed can tell equal hashes apart.
+ */
+static int node_clusters(const struct node *node, unsigned shift)
+{
+	if (shift >= HASH_TOTAL_WIDTH)
+		return 0;
+	if (node->element_arity == 0 && node->branch_arity == 1 && node->size >= CHAMP_RESEED_CHAIN) {
+		const struct node *chain = node;
+		for (unsigned chain_shift = shift; chain_shift < HASH_TOTAL_WIDTH; chain_shift += HASH_PARTITION_WIDTH) {
+			if (chain->element_arity != 0 || chain->branch_arity != 1)
+				return 1;
+			chain = branch_load(&CHAMP_NODE_BRANCHES(chain)[0], chain->ref_count);
+		}
+		return 0;
+	}
+	for (unsigned i = 0; i < node->branch_arity; ++i) {
+		if (node_clusters(branch_load(&CHAMP_NODE_BRANCHES(node)[i], node->ref_count), shift + HASH_PARTITION_WIDTH))
+			return 1;
+	}
+	return 0;
+}
+
+int champ_clusters(const struct champ *champ)
+{
+	return node_clusters(champ->root, 0);
+}
+
+struct champ *champ_reseed(const struct champ *champ, uint32_t seed)
+{
+	if (champ->type->seed == seed)
+		return (struct champ *)champ;
+	COUNT(reseeds);
+	struct champ *result = champ_from((struct node *)&empty_node, 0, champ_type_seeded(champ->type, seed));
+	struct champ_iter iterator;
+	CHAMP_KEY_T key;
+	CHAMP_VALUE_T value;
+	champ_iter_init(&iterator, champ);
+	while (champ_iter_next(&iterator, &key, &value)) {
+		struct champ *tmp = champ_set(result, key, value, NULL);
+		if (tmp != result)
+			champ_destroy(&result);
+		result = tmp;
+	}
+	return result;
+}
+
+struct champ *champ_set(const struct champ *champ,
+			const CHAMP_KEY_T key, const CHAMP_VALUE_T value, int *replaced)
+{
+	const uint32_t hash = type_key_hash(champ->type, key);
+	int found = 0;
+	int *found_p = replaced ? replaced : &found;
+	*found_p = 0;
+
+	const struct node *root = champ->root;
+	if (root->branch_arity == 0 && root->element_arity <= CHAMP_INLINE_ARITY) {
+		const uint32_t bitpos = 1u << champ_mask(hash, 0);
+		const unsigned index = champ_index(root->element_map, bitpos);
+		CHAMP_NODE_ELEMENT_T elements[CHAMP_INLINE_ARITY + 1];
+		const CHAMP_NODE_ELEMENT_T *current = node_elements(root, elements);
+		if (current != elements)
+			memcpy(elements, current, CHAMP_NODE_ELEMENTS_SIZE(root->element_arity));
+
+		if (!(root->element_map & bitpos) && root->element_arity < CHAMP_INLINE_ARITY) {
+			memmove(&elements[index + 1], &elements[index], CHAMP_NODE_ELEMENTS_SIZE(root->element_arity - index));
+			elements[index].key = (CHAMP_KEY_T)key;
+			elements[index].val = (CHAMP_VALUE_T)value;
+			return champ_from_elements(root->element_map | bitpos, elements, root->element_arity + 1,
+				root->hash + entry_hash(champ->type, hash, value), champ->type);
+
+		} else if (root->element_map & bitpos && champ->type->equals(elements[index].key, key)) {
+			*found_p = 1;
+			if (elements[index].val == value)
+				return (struct champ *)champ;
+			const uint32_t root_hash = root->hash + entry_hash(champ->type, hash, value) -
+				entry_hash(champ->type, hash, elements[index].val);
+			elements[index].val = (CHAMP_VALUE_T)value;
+			return champ_from_elements(root->element_map, elements, root->element_arity, root_hash, champ->type);
+		}
+	}
+
+	uint32_t delta = 0;
+	struct node *new_root = node_update(champ->root, champ->type, key, value, hash, 0, found_p, &delta);
+	if (new_root == champ->root)
+		return (struct champ *)champ;
+	node_acquire_path(new_root, champ->root, hash, champ->type);
+	return champ_from(new_root, champ->length + (*found_p ? 0 : 1), champ->type);
+}
+
+CHAMP_VALUE_T champ_get(const struct champ *champ, const CHAMP_KEY_T key, int *found)
+{
+	uint32_t hash = type_key_hash(champ->type, key);
+	int tmp = 0;
+	return node_get(champ->root, champ->type->equals, key, hash, 0, found ? found : &tmp);
+}
+
+struct champ *champ_del(const struct champ *champ, const CHAMP_KEY_T key, int *modified)
+{
+	const uint32_t hash = type_key_hash(champ->type, key);
+	int found = 0;
+	int *found_p = modified ? modified : &found;
+	*found_p = 0;
+
+	const struct node *root = champ->root;
+	if (root->branch_arity == 0 && root->element_arity <= CHAMP_INLINE_ARITY) {
+		const uint32_t bitpos = 1u << champ_mask(hash, 0);
+		const unsigned index = champ_index(root->element_map, bitpos);
+		CHAMP_NODE_ELEMENT_T elements[CHAMP_INLINE_ARITY];
+		const CHAMP_NODE_ELEMENT_T *current = node_elements(root, elements);
+		if (!(root->element_map & bitpos) || !champ->type->equals(current[index].key, key))
+			return (struct champ *)champ;
+
+		*found_p = 1;
+		if (root->element_arity == 1)
+			return champ_from((struct node *)&empty_node, 0, champ->type);
+		const uint32_t root_hash = root->hash - entry_hash(champ->type, hash, current[index].val);
+		if (current != elements)
+			memcpy(elements, current, CHAMP_NODE_ELEMENTS_SIZE(root->element_arity));
+		memmove(&elements[index], &elements[index + 1], CHAMP_NODE_ELEMENTS_SIZE(root->element_arity - index - 1));
+		return champ_from_elements(root->element_map & ~bitpos, elements, root->element_arity - 1, root_hash,
+			champ->type);
+	}
+
+	uint32_t delta = 0;
+	struct node *new_root = node_del(champ->root, champ->type, key, hash, 0, found_p, &delta);
+	if (!*found_p)
+		return (struct champ *)champ;
+	node_acquire_path(new_root, champ->root, hash, champ->type);
+	return champ_from(new_root, champ->length - 1, champ->type);
+}
+
+struct champ *champ_assoc(const struct champ *champ, const CHAMP_KEY_T key, CHAMP_ASSOCFN_T(fn), const void *user_data)
+{
+	const uint32_t hash = type_key_hash(champ->type, key);
+	int found = 0;
+	uint32_t delta = 0;
+	struct node *new_root = node_assoc(champ->root, champ->type, key, fn, user_data, hash, 0, &found, &delta);
+	if (new_root == champ->root)
+		return (struct champ *)champ;
+	node_acquire_path(new_root, champ->root, hash, champ->type);
+	return champ_from(new_root, champ->length + (found ? 0 : 1), champ->type);
+}
+
+/*
+ * Bulk transforms
+ *
+ * A node is only copied if one of its entries or branches changed. Branches that end up empty are dropped, and
+ * branches that end up with a single entry are replaced by that entry, so the result is as canonical as after node_del.
+ */
+
+struct transform {
+	const struct champ_type *type;
+	CHAMP_MAPFN_T(map); // may be NULL
+	CHAMP_PREDFN_T(pred); // may be NULL
+	int keep; // entries are kept if pred returns keep
+	const void *user_data;
+};
+
+/**
+ * Applies transform to a single entry and keeps node_hash up to date. Returns 0 if the entry is to be removed.
+ */
+static int transform_entry(const struct transform *transform, CHAMP_NODE_ELEMENT_T *element, uint32_t *node_hash,
+			   int *changed)
+{
+	const struct champ_type *type = transform->type;
+	if (transform->pred &&
+	    !transform->pred(element->key, element->val, (void *)transform->user_data) != !transform->keep) {
+		*node_hash -= entry_hash(type, type_key_hash(type, element->key), element->val);
+		*changed = 1;
+		return 0;
+	}
+
+	if (transform->map) {
+		const CHAMP_VALUE_T value = transform->map(element->key, element->val, (void *)transform->user_data);
+		if (value != element->val) {
+			if (type->value_hash) {
+				const uint32_t key_hash = type_key_hash(type, element->key);
+				*node_hash += entry_hash(type, key_hash, value) - entry_hash(type, key_hash, element->val);
+			}
+			element->val = (CHAMP_VALUE_T)value;
+			*changed = 1;
+		}
+	}
+	return 1;
+}
+
+static struct node *node_transform(const struct node *node, const struct transform *transform, unsigned shift)
+{
+	uint32_t hash = node->hash;
+	int changed = 0;
+
+	if (shift >= HASH_TOTAL_WIDTH) {
+		CHAMP_NODE_ELEMENT_T elements[node->element_arity], element_buffer[node->element_arity];
+		const CHAMP_NODE_ELEMENT_T *src_elements =
+			collision_node_elements((const struct collision_node *)node, element_buffer);
+		uint8_t element_arity = 0;
+		for (unsigned i = 0; i < node->element_arity; ++i) {
+			CHAMP_NODE_ELEMENT_T element = src_elements[i];
+			if (transform_entry(transform, &element, &hash, &changed))
+				elements[element_arity++] = element;
+		}
+
+		if (!changed)
+			return (struct node *)node;
+		if (element_arity == 0)
+			return (struct node *)&empty_node;
+		// a single entry is returned in a collision node as well, the parent pulls it up
+		struct node *result = (struct node *)collision_node_new(elements, element_arity);
+		result->hash = hash;
+		node_acquire_elements(result, transform->type);
+		return result;
+	}
+
+	CHAMP_NODE_BRANCH_T branches[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_ELEMENT_T elements[1u << HASH_PARTITION_WIDTH], element_buffer[1u << HASH_PARTITION_WIDTH];
+	const CHAMP_NODE_ELEMENT_T *src_elements = node_elements(node, element_buffer);
+	CHAMP_NODE_BRANCH_T const *src_branches = node_branches(node, branch_buffer);
+	uint32_t element_map = 0, branch_map = 0;
+	uint8_t element_arity = 0, branch_arity = 0;
+	unsigned element_index = 0, branch_index = 0;
+
+	// slot order, so that pulled up entries end up in the right place
+	for (uint32_t slots = node->element_map | node->branch_map; slots; slots &= slots - 1) {
+		const uint32_t bitpos = slots & (~slots + 1);
+		if (node->element_map & bitpos) {
+			CHAMP_NODE_ELEMENT_T element = src_elements[element_index++];
+			if (transform_entry(transform, &element, &hash, &changed)) {
+				elements[element_arity++] = element;
+				element_map |= bitpos;
+			}
+			continue;
+		}
+
+		const struct node *branch = src_branches[branch_index++];
+		struct node *new_branch = node_transform(branch, transform, shift + HASH_PARTITION_WIDTH);
+		if (new_branch == branch) {
+			branches[branch_arity++] = new_branch;
+			branch_map |= bitpos;
+			continue;
+		}
+
+		changed = 1;
+		hash += new_branch->hash - branch->hash;
+		if (new_branch->size == 1) {
+			COUNT(pullup);
+			elements[element_arity++] = CHAMP_NODE_ELEMENTS(new_branch)[0];
+			element_map |= bitpos;
+			node_destroy(new_branch, transform->type);
+		} else if (new_branch->size > 1) {
+			branches[branch_arity++] = new_branch;
+			branch_map |= bitpos;
+		}
+	}
+
+	if (!changed)
+		return (struct node *)node;
+	if (element_arity + branch_arity == 0)
+		return (struct node *)&empty_node;
+	struct node *result = node_new(element_map, branch_map, elements, element_arity, branches, branch_arity, shift);
+	result->hash = hash;
+	node_acquire_elements(result, transform->type);
+	return result;
+}
+
+static struct champ *champ_transform(const struct champ *champ, const struct transform *transform)
+{
+	struct node *root = node_transform(champ->root, transform, 0);
+	if (root == champ->root)
+		return (struct champ *)champ;
+	return champ_from(root, root->size, champ->type);
+}
+
+struct champ *champ_map_values(const struct champ *champ, CHAMP_MAPFN_T(fn), const void *user_data)
+{
+	const struct transform transform = {.type = champ->type, .map = fn, .user_data = user_data};
+	return champ_transform(champ, &transform);
+}
+
+struct champ *champ_filter(const struct champ *champ, CHAMP_PREDFN_T(pred), const void *user_data)
+{
+	const struct transform transform = {.type = champ->type, .pred = pred, .keep = 1, .user_data = user_data};
+	return champ_transform(champ, &transform);
+}
+
+struct champ *champ_remove_if(const struct champ *champ, CHAMP_PREDFN_T(pred), const void *user_data)
+{
+	const struct transform transform = {.type = champ->type, .pred = pred, .keep = 0, .user_data = user_data};
+	return champ_transform(champ, &transform);
+}
+
+int champ_equals(const struct champ *left, const struct champ *right, CHAMP_VALUE_EQUALSFN_T(value_equals))
+{
+	if (left == right)
+		return 1;
+	else if (champ_length(left) != champ_length(right))
+		return 0;
+
+	const int compare_hashes = left->type->value_hash && left->type->value_hash == right->type->value_hash;
+	if (left->type->seed == right->type->seed)
+		return node_equals(left->root, right->root, left->type->equals, value_equals, compare_hashes, 0);
+
+	// the tries of differently seeded maps have different shapes, so look every entry up instead
+	if (compare_hashes && left->root->hash != right->root->hash)
+		return 0;
+	struct champ_iter iterator;
+	CHAMP_KEY_T key;
+	CHAMP_VALUE_T value;
+	champ_iter_init(&iterator, left);
+	while (champ_iter_next(&iterator, &key, &value)) {
+		int found;
+		const CHAMP_VALUE_T other = champ_get(right, key, &found);
+		if (!found || !value_equals(value, other))
+			return 0;
+	}
+	return 1;
+}
+
+static const char *indent(unsigned level)
+{
+	const char *spaces = "                                                                                ";
+	return spaces + 4 * (20 - level);
+}
+
+#define iprintf(level, fmt, ...) printf("%s" fmt, indent(level), __VA_ARGS__)
+
+static char *format_binary(uint32_t value, char *buffer)
+{
+	for (char *pos = buffer + 31; pos >= buffer; --pos) {
+		if (value & 1u) *pos = '1';
+		else *pos = '0';
+		value = value >> 1u;
+	}
+	return buffer;
+}
+
+static void champ_node_repr(const struct node *node, const char *kp, const char *vp, unsigned shift, unsigned i_level)
+{
+	if (shift >= HASH_TOTAL_WIDTH) {
+		const struct collision_node *collision_node = (const struct collision_node *)node;
+		printf("{\n");
+		iprintf(i_level, "\"collision_arity\": %u,\n", collision_node->element_arity);
+		iprintf(i_level, "\"elements\": {\n%s", "");
+		for (unsigned i = 0; i < collision_node->element_arity; ++i) {
+			CHAMP_NODE_ELEMENT_T el = element_load(&collision_node->content[i], collision_node->ref_count);
+			iprintf(i_level + 1, "\"%s", "");
+			printf(kp, el.key);
+			printf("\": ");
+			printf(vp, el.val);
+			printf(",\n");
+		}
+		iprintf(i_level, "},\n%s", "");
+		iprintf(i_level - 1, "}%s", "");
+		return;
 	}
 	char map_buf[33];
 	printf("{\n");
@@ -919,7 +1930,7 @@ static void champ_node_repr(const struct node *node, const char *kp, const char
 	iprintf(i_level, "\"branch_arity\": %u,\n", node->branch_arity);
 	iprintf(i_level, "\"elements\": {\n%s", "");
 	for (unsigned i = 0; i < node->element_arity; ++i) {
-		CHAMP_NODE_ELEMENT_T el = CHAMP_NODE_ELEMENTS(node)[i];
+		CHAMP_NODE_ELEMENT_T el = element_load(&CHAMP_NODE_ELEMENTS(node)[i], node->ref_count);
 		iprintf(i_level + 1, "\"%s", "");
 		printf(kp, el.key);
 		printf("\": ");
@@ -929,7 +1940,7 @@ static void champ_node_repr(const struct node *node, const char *kp, const char
 	iprintf(i_level, "},\n%s", "");
 	iprintf(i_level, "\"nodes\": [\n%s", "");
 	for (unsigned i = 0; i < node->branch_arity; ++i) {
-		CHAMP_NODE_BRANCH_T n = CHAMP_NODE_BRANCHES(node)[i];
+		CHAMP_NODE_BRANCH_T n = branch_load(&CHAMP_NODE_BRANCHES(node)[i], node->ref_count);
 		iprintf(i_level + 1, "%s", "");
 		champ_node_repr(n, kp, vp, shift + HASH_PARTITION_WIDTH, i_level + 2);
 		printf(",\n");
@@ -950,6 +1961,8 @@ void champ_repr(const struct champ *champ, const char *key_prefix, const char *v
 void champ_iter_init(struct champ_iter *iterator, const struct champ *champ)
 {
 	iterator->stack_level = 0;
+	iterator->base_level = 0;
+	iterator->slot_filter = ~0u;
 	iterator->element_cursor = 0;
 	iterator->element_arity = champ->root->element_arity;
 	iterator->branch_cursor_stack[0] = 0;
@@ -957,6 +1970,46 @@ void champ_iter_init(struct champ_iter *iterator, const struct champ *champ)
 	iterator->node_stack[0] = champ->root;
 }
 
+void champ_iter_init_prefix(struct champ_iter *iterator, const struct champ *champ, uint32_t prefix, unsigned bits)
+{
+	const struct node *node = champ->root;
+	unsigned shift = 0;
+	// descend as long as the partition lies entirely inside a single branch
+	while (shift + HASH_PARTITION_WIDTH <= bits && shift < HASH_TOTAL_WIDTH) {
+		const uint32_t bitpos = 1u << champ_mask(prefix, shift);
+		if (!(node->branch_map & bitpos))
+			break;
+		node = CHAMP_NODE_BRANCH_AT(node, bitpos);
+		shift += HASH_PARTITION_WIDTH;
+	}
+
+	const int level = (int)(shift / HASH_PARTITION_WIDTH);
+	iterator->stack_level = level - 1;
+	iterator->base_level = level;
+	iter_push(iterator, node);
+
+	const unsigned remaining = bits - shift;
+	if (shift >= HASH_TOTAL_WIDTH || remaining == 0) {
+		iterator->slot_filter = ~0u;
+
+	} else if (remaining < HASH_PARTITION_WIDTH) {
+		// every slot whose index ends in the remaining bits of the prefix
+		const uint32_t low_bits = (1u << remaining) - 1;
+		iterator->slot_filter = 0;
+		for (uint32_t slot = champ_mask(prefix, shift) & low_bits; slot < 32; slot += low_bits + 1) {
+			iterator->slot_filter |= 1u << slot;
+		}
+
+	} else {
+		// the partition is narrower than a slot, so at most the single element in it is part of it
+		const uint32_t bitpos = 1u << champ_mask(prefix, shift);
+		const uint32_t mask = bits >= HASH_TOTAL_WIDTH ? ~0u : (1u << bits) - 1;
+		iterator->slot_filter = 0;
+		if (node->element_map & bitpos && ((type_key_hash(champ->type, CHAMP_NODE_ELEMENT_AT(node, bitpos).key) ^ prefix) & mask) == 0)
+			iterator->slot_filter = bitpos;
+	}
+}
+
 static void iter_push(struct champ_iter *iterator, const struct node *node)
 {
 	iterator->stack_level += 1;
@@ -974,20 +2027,37 @@ static void iter_pop(struct champ_iter *iterator)
 
 int champ_iter_next(struct champ_iter *iterator, CHAMP_KEY_T *key, CHAMP_VALUE_T *value)
 {
-	if (iterator->stack_level == -1)
+	if (iterator->stack_level < iterator->base_level)
 		return 0;
 
 	const struct node *current_node = iterator->node_stack[iterator->stack_level];
 	unsigned *branch_cursor = iterator->branch_cursor_stack + iterator->stack_level;
+	if (iterator->stack_level == iterator->base_level && iterator->slot_filter != ~0u) {
+		// skip the slots of the base node that lie outside the partition, elements first
+		if (*branch_cursor == 0) {
+			while (iterator->element_cursor < current_node->element_arity &&
+			       !(iterator->slot_filter & champ_bitpos(current_node->element_map, iterator->element_cursor)))
+				++iterator->element_cursor;
+		}
+		if (*branch_cursor > 0 || iterator->element_cursor >= current_node->element_arity) {
+			while (*branch_cursor < current_node->branch_arity &&
+			       !(iterator->slot_filter & champ_bitpos(current_node->branch_map, *branch_cursor)))
+				++*branch_cursor;
+		}
+	}
 	if (*branch_cursor == 0 && iterator->element_cursor < current_node->element_arity) { // todo: write test for this
-		*key = CHAMP_NODE_ELEMENTS(current_node)[iterator->element_cursor].key;
-		*value = CHAMP_NODE_ELEMENTS(current_node)[iterator->element_cursor].val;
+		// the hash is exhausted at the deepest level, so any node there is a collision node
+		const CHAMP_NODE_ELEMENT_T *elements = iterator->stack_level * HASH_PARTITION_WIDTH >= HASH_TOTAL_WIDTH ?
+			((const struct collision_node *)current_node)->content : CHAMP_NODE_ELEMENTS(current_node);
+		const CHAMP_NODE_ELEMENT_T element = element_load(&elements[iterator->element_cursor], current_node->ref_count);
+		*key = element.key;
+		*value = element.val;
 		++iterator->element_cursor;
 		return 1;
 
 	} else {
 		if (*branch_cursor < iterator->branch_arity_stack[iterator->stack_level]) {
-			iter_push(iterator, CHAMP_NODE_BRANCHES(current_node)[*branch_cursor]);
+			iter_push(iterator, branch_load(&CHAMP_NODE_BRANCHES(current_node)[*branch_cursor], current_node->ref_count));
 			++*branch_cursor;
 			return champ_iter_next(iterator, key, value);
 
@@ -998,3 +2068,1710 @@ int champ_iter_next(struct champ_iter *iterator, CHAMP_KEY_T *key, CHAMP_VALUE_T
 	}
 }
 
+
+/*
+ * Address tables
+ *
+ * An open-addressing hash table from addresses to 64 bit values, used to find out whether a node or blob has been
+ * seen before while traversing a map.
+ */
+
+struct address_table {
+	size_t capacity;
+	size_t length;
+	struct {
+		const void *from;
+		uint64_t to;
+	} *entries;
+};
+
+static size_t address_table_slot(const struct address_table *table, const void *from)
+{
+	size_t i = (size_t)(((uintptr_t)from >> 3) * 0x9e3779b97f4a7c15ull) & (table->capacity - 1);
+	while (table->entries[i].from && table->entries[i].from != from)
+		i = (i + 1) & (table->capacity - 1);
+	return i;
+}
+
+static void address_table_put(struct address_table *table, const void *from, uint64_t to)
+{
+	if (2 * (table->length + 1) > table->capacity) {
+		struct address_table grown = {table->capacity ? 2 * table->capacity : 64, table->length, NULL};
+		grown.entries = calloc(grown.capacity, sizeof *grown.entries);
+		for (size_t i = 0; i < table->capacity; ++i) {
+			if (table->entries[i].from)
+				grown.entries[address_table_slot(&grown, table->entries[i].from)] = table->entries[i];
+		}
+		free(table->entries);
+		*table = grown;
+	}
+	size_t i = address_table_slot(table, from);
+	table->length += !table->entries[i].from;
+	table->entries[i].from = from;
+	table->entries[i].to = to;
+}
+
+static uint64_t address_table_get(const struct address_table *table, const void *from)
+{
+	if (!table->capacity)
+		return 0;
+	size_t i = address_table_slot(table, from);
+	return table->entries[i].from ? table->entries[i].to : 0;
+}
+
+/*
+ * Snapshots
+ *
+ * A snapshot file starts with a struct snapshot_header, followed by key and value blobs and node images. Children are
+ * written before their parents, so the root comes last. Node images have the same layout as their in-memory
+ * counterparts, except that their ref_count marks them as mapped, and that pointers are replaced with offsets relative
+ * to the slot that holds them. That way, a snapshot can be mapped at any address and used as is.
+ *
+ * Every blob is preceded by its size as a uint64_t. Blobs and nodes are aligned to SNAPSHOT_ALIGNMENT.
+ */
+
+#define SNAPSHOT_MAGIC "CHAMPSNP"
+#define SNAPSHOT_FORMAT 5u
+#define SNAPSHOT_ALIGNMENT 8u
+#define SNAPSHOT_BUFFER_SIZE 65536u
+#define SNAPSHOT_VALUE_HASHED 0x10000u // in the header flags, set if the node hashes include value hashes
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t format;
+	uint32_t flags;
+	uint32_t seed; // of the map's type
+	uint32_t reserved;
+	uint64_t length;
+	uint64_t root;
+	uint64_t size;
+};
+
+struct snapshot_writer {
+	int fd;
+	int failed;
+	uint16_t ref_count; // of the written nodes
+	uint64_t flushed; // file offset of buffer[0]
+	size_t used;
+	CHAMP_KEY_ENCODEFN_T(key_codec);
+	CHAMP_VALUE_ENCODEFN_T(value_codec);
+	void *scratch;
+	size_t scratch_capacity;
+	const char *region; // nodes and blobs in [region, region + region_size) are at their offset already
+	uint64_t region_size;
+	struct address_table *forward; // if not NULL, remembers where nodes and blobs have been written to
+	unsigned char buffer[SNAPSHOT_BUFFER_SIZE];
+};
+
+
+struct mapped_champ {
+	struct champ champ; // MUST BE FIRST
+	void *mapping; // NULL for images that belong to the caller, see champ_open_snapshot_image
+	size_t size;
+};
+
+static struct snapshot_writer *snapshot_writer_new(int fd, uint64_t offset, CHAMP_KEY_ENCODEFN_T(key_codec),
+						    CHAMP_VALUE_ENCODEFN_T(value_codec))
+{
+	struct snapshot_writer *writer = malloc(sizeof *writer);
+	writer->fd = fd;
+	writer->failed = 0;
+	writer->ref_count = NODE_MAPPED | (key_codec ? NODE_MAPPED_KEYS : 0) | (value_codec ? NODE_MAPPED_VALUES : 0);
+	writer->flushed = offset;
+	writer->used = 0;
+	writer->key_codec = key_codec;
+	writer->value_codec = value_codec;
+	writer->scratch = NULL;
+	writer->scratch_capacity = 0;
+	writer->region = NULL;
+	writer->region_size = 0;
+	writer->forward = NULL;
+	return writer;
+}
+
+static void snapshot_writer_destroy(struct snapshot_writer *writer)
+{
+	free(writer->scratch);
+	free(writer);
+}
+
+/**
+ * Returns the offset at which from has been written, or 0 if it hasn't been written yet.
+ */
+static uint64_t snapshot_written(const struct snapshot_writer *writer, const void *from)
+{
+	if ((uintptr_t)from - (uintptr_t)writer->region < writer->region_size)
+		return (uint64_t)((const char *)from - writer->region);
+	return writer->forward ? address_table_get(writer->forward, from) : 0;
+}
+
+static void snapshot_write_at(struct snapshot_writer *writer, const void *data, size_t size, uint64_t offset)
+{
+	while (!writer->failed && size > 0) {
+		ssize_t written = pwrite(writer->fd, data, size, (off_t)offset);
+		if (written < 0) {
+			writer->failed = 1;
+		} else {
+			data = (const unsigned char *)data + written;
+			size -= (size_t)written;
+			offset += (uint64_t)written;
+		}
+	}
+}
+
+static void snapshot_flush(struct snapshot_writer *writer)
+{
+	snapshot_write_at(writer, writer->buffer, writer->used, writer->flushed);
+	writer->flushed += writer->used;
+	writer->used = 0;
+}
+
+static uint64_t snapshot_tell(const struct snapshot_writer *writer)
+{
+	return (writer->flushed + writer->used + SNAPSHOT_ALIGNMENT - 1) & ~(uint64_t)(SNAPSHOT_ALIGNMENT - 1);
+}
+
+/**
+ * Appends data at the next aligned position and returns that position.
+ */
+static uint64_t snapshot_append(struct snapshot_writer *writer, const void *data, size_t size)
+{
+	const uint64_t offset = snapshot_tell(writer);
+	const size_t padding = (size_t)(offset - (writer->flushed + writer->used));
+
+	if (writer->used + padding + size > SNAPSHOT_BUFFER_SIZE)
+		snapshot_flush(writer);
+
+	if (padding + size > SNAPSHOT_BUFFER_SIZE) {
+		snapshot_write_at(writer, data, size, offset);
+		writer->flushed = offset + size;
+	} else {
+		memset(writer->buffer + writer->used, 0, padding);
+		memcpy(writer->buffer + writer->used + padding, data, size);
+		writer->used += padding + size;
+	}
+
+	return offset;
+}
+
+static void snapshot_reserve_scratch(struct snapshot_writer *writer, size_t size)
+{
+	if (size > writer->scratch_capacity) {
+		free(writer->scratch);
+		writer->scratch = malloc(size);
+		writer->scratch_capacity = size;
+	}
+}
+
+/**
+ * Appends the first size bytes of the scratch buffer as a blob, and returns the offset of its content.
+ */
+static uint64_t snapshot_append_blob(struct snapshot_writer *writer, size_t size)
+{
+	const uint64_t blob_size = size;
+	snapshot_append(writer, &blob_size, sizeof blob_size);
+	return snapshot_append(writer, writer->scratch, size);
+}
+
+static uint64_t snapshot_write_key(struct snapshot_writer *writer, const CHAMP_KEY_T key)
+{
+	uint64_t offset = snapshot_written(writer, (const void *)key);
+	if (offset)
+		return offset;
+
+	size_t size = writer->key_codec(key, writer->scratch, writer->scratch_capacity);
+	if (size > writer->scratch_capacity) {
+		snapshot_reserve_scratch(writer, size);
+		size = writer->key_codec(key, writer->scratch, writer->scratch_capacity);
+	}
+	offset = snapshot_append_blob(writer, size);
+	if (writer->forward)
+		address_table_put(writer->forward, (const void *)key, offset);
+	return offset;
+}
+
+static uint64_t snapshot_write_value(struct snapshot_writer *writer, const CHAMP_VALUE_T value)
+{
+	uint64_t offset = snapshot_written(writer, (const void *)value);
+	if (offset)
+		return offset;
+
+	size_t size = writer->value_codec(value, writer->scratch, writer->scratch_capacity);
+	if (size > writer->scratch_capacity) {
+		snapshot_reserve_scratch(writer, size);
+		size = writer->value_codec(value, writer->scratch, writer->scratch_capacity);
+	}
+	offset = snapshot_append_blob(writer, size);
+	if (writer->forward)
+		address_table_put(writer->forward, (const void *)value, offset);
+	return offset;
+}
+
+/**
+ * Writes node and everything below it, and returns the offset of its image.
+ */
+static uint64_t snapshot_write_node(struct snapshot_writer *writer, const struct node *node, unsigned shift)
+{
+	const uint64_t written = snapshot_written(writer, node);
+	if (written)
+		return written;
+
+	const int is_collision_node = shift >= HASH_TOTAL_WIDTH;
+	const size_t header_size = is_collision_node ? sizeof(struct collision_node) : sizeof(struct node);
+	const unsigned element_arity = node->element_arity;
+	const unsigned branch_arity = node->branch_arity;
+
+	CHAMP_NODE_ELEMENT_T element_buffer[element_arity ? element_arity : 1];
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	const CHAMP_NODE_ELEMENT_T *elements = is_collision_node ?
+		collision_node_elements((const struct collision_node *)node, element_buffer) :
+		node_elements(node, element_buffer);
+	CHAMP_NODE_BRANCH_T const *branches = node_branches(node, branch_buffer);
+
+	uint64_t branch_offsets[1u << HASH_PARTITION_WIDTH];
+	for (unsigned i = 0; i < branch_arity; ++i) {
+		branch_offsets[i] = snapshot_write_node(writer, branches[i], shift + HASH_PARTITION_WIDTH);
+	}
+
+	uint64_t key_offsets[element_arity ? element_arity : 1], value_offsets[element_arity ? element_arity : 1];
+	for (unsigned i = 0; i < element_arity; ++i) {
+		if (writer->key_codec)
+			key_offsets[i] = snapshot_write_key(writer, elements[i].key);
+		if (writer->value_codec)
+			value_offsets[i] = snapshot_write_value(writer, elements[i].val);
+	}
+
+	const size_t size = header_size + CHAMP_NODE_ELEMENTS_SIZE(element_arity) + CHAMP_NODE_BRANCHES_SIZE(branch_arity);
+	uint64_t image_buffer[(size + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+	unsigned char *image = (unsigned char *)image_buffer;
+	const uint64_t offset = snapshot_tell(writer);
+
+	memcpy(image, node, header_size);
+	((struct node *)image)->ref_count = writer->ref_count;
+
+	CHAMP_NODE_ELEMENT_T *image_elements = (CHAMP_NODE_ELEMENT_T *)(image + header_size);
+	for (unsigned i = 0; i < element_arity; ++i) {
+		const uint64_t slot = offset + header_size + i * sizeof(CHAMP_NODE_ELEMENT_T);
+		image_elements[i] = elements[i];
+		if (writer->key_codec)
+			image_elements[i].key = (CHAMP_KEY_T)(uintptr_t)(key_offsets[i] - (slot + offsetof(CHAMP_NODE_ELEMENT_T, key)));
+		if (writer->value_codec)
+			image_elements[i].val = (CHAMP_VALUE_T)(uintptr_t)(value_offsets[i] - (slot + offsetof(CHAMP_NODE_ELEMENT_T, val)));
+	}
+
+	CHAMP_NODE_BRANCH_T *image_branches = (CHAMP_NODE_BRANCH_T *)(image + header_size + CHAMP_NODE_ELEMENTS_SIZE(element_arity));
+	for (unsigned i = 0; i < branch_arity; ++i) {
+		const uint64_t slot = offset + header_size + CHAMP_NODE_ELEMENTS_SIZE(element_arity) + i * sizeof(CHAMP_NODE_BRANCH_T);
+		image_branches[i] = (CHAMP_NODE_BRANCH_T)(uintptr_t)(branch_offsets[i] - slot);
+	}
+
+	const uint64_t result = snapshot_append(writer, image, size);
+	if (writer->forward)
+		address_table_put(writer->forward, node, result);
+	return result;
+}
+
+int champ_write_snapshot(const struct champ *champ, int fd,
+			 CHAMP_KEY_ENCODEFN_T(key_codec), CHAMP_VALUE_ENCODEFN_T(value_codec))
+{
+	struct snapshot_writer *writer = snapshot_writer_new(fd, 0, key_codec, value_codec);
+
+	struct snapshot_header header;
+	memset(&header, 0, sizeof header);
+	snapshot_append(writer, &header, sizeof header); // placeholder until the root offset is known
+
+	header.root = snapshot_write_node(writer, champ->root, 0);
+	snapshot_flush(writer);
+
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+	header.format = SNAPSHOT_FORMAT;
+	header.flags = writer->ref_count | (champ->type->value_hash ? SNAPSHOT_VALUE_HASHED : 0);
+	header.seed = champ->type->seed;
+	header.length = champ->length;
+	header.size = writer->flushed;
+	snapshot_write_at(writer, &header, sizeof header, 0);
+	if (!writer->failed && ftruncate(fd, (off_t)header.size))
+		writer->failed = 1;
+
+	const int result = writer->failed ? -1 : 0;
+	snapshot_writer_destroy(writer);
+	return result;
+}
+
+/**
+ * Wraps the snapshot image at start in a map, or returns NULL if it isn't a valid snapshot. mapping is what
+ * champ_close_snapshot has to unmap, if anything.
+ */
+static struct champ *snapshot_open(const void *start, size_t size, void *mapping, CHAMP_HASHFN_T(hash),
+				   CHAMP_EQUALSFN_T(equals), CHAMP_VALUE_HASHFN_T(value_hash))
+{
+	const struct snapshot_header *header = start;
+	if (size < sizeof *header
+	    || (uintptr_t)start % SNAPSHOT_ALIGNMENT
+	    || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic) != 0
+	    || header->format != SNAPSHOT_FORMAT
+	    || !(header->flags & SNAPSHOT_VALUE_HASHED) != !value_hash
+	    || header->size > (uint64_t)size
+	    || header->root + sizeof(struct node) > header->size)
+		return NULL;
+
+	struct mapped_champ *result = malloc(sizeof *result);
+	result->champ.ref_count = 0;
+	result->champ.length = (unsigned)header->length;
+	result->champ.root = (struct node *)((const char *)start + header->root);
+	result->champ.type = champ_type_seeded(champ_type_intern(hash, equals, value_hash), header->seed);
+	result->mapping = mapping;
+	result->size = size;
+	return &result->champ;
+}
+
+struct champ *champ_open_snapshot(const char *path, CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals),
+				  CHAMP_VALUE_HASHFN_T(value_hash))
+{
+	struct stat stat;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &stat) || (size_t)stat.st_size < sizeof(struct snapshot_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *mapping = mmap(NULL, (size_t)stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	struct champ *result = snapshot_open(mapping, (size_t)stat.st_size, mapping, hash, equals, value_hash);
+	if (!result) {
+		DEBUG_WARN("%s is not a valid snapshot\n", path);
+		munmap(mapping, (size_t)stat.st_size);
+	}
+	return result;
+}
+
+struct champ *champ_open_snapshot_image(const void *image, size_t size, CHAMP_HASHFN_T(hash),
+					CHAMP_EQUALSFN_T(equals), CHAMP_VALUE_HASHFN_T(value_hash))
+{
+	struct champ *result = snapshot_open(image, size, NULL, hash, equals, value_hash);
+	if (!result)
+		DEBUG_WARN("image@%p is not a valid snapshot\n", image);
+	return result;
+}
+
+void champ_close_snapshot(struct champ **champ)
+{
+	struct mapped_champ *mapped = (struct mapped_champ *)*champ;
+	if (mapped->mapping)
+		munmap(mapped->mapping, mapped->size);
+	free(mapped);
+	*champ = NULL;
+}
+
+/*
+ * Stores
+ *
+ * A store is an append-only file of nodes and blobs in the snapshot format, plus a chain of root records. Committing a
+ * map only appends what isn't in the store yet: maps loaded from the store, and maps derived from those, share all
+ * untouched nodes with it. To keep pointers into the store valid while the file grows, the store reserves a large
+ * range of address space up front and maps the file to its start.
+ */
+
+#define STORE_MAGIC "CHAMPSTR"
+#define STORE_FORMAT 5u
+
+#ifndef CHAMP_STORE_RESERVE
+#define CHAMP_STORE_RESERVE ((size_t)1 << (sizeof(size_t) > 4 ? 38 : 29))
+#endif
+
+struct store_header {
+	char magic[8];
+	uint32_t format;
+	uint32_t flags;
+	uint64_t size;
+	uint64_t latest;
+};
+
+struct store_record {
+	uint64_t previous;
+	uint64_t root;
+	uint64_t length;
+	uint32_t seed; // of the committed map's type
+	uint32_t reserved;
+};
+
+struct champ_store {
+	int fd;
+	char *base;
+	uint64_t size;
+	const struct champ_type *type;
+	CHAMP_KEY_ENCODEFN_T(key_codec);
+	CHAMP_VALUE_ENCODEFN_T(value_codec);
+};
+
+static const struct store_header *store_header(const struct champ_store *store)
+{
+	return (const struct store_header *)store->base;
+}
+
+static int store_map(struct champ_store *store, uint64_t size)
+{
+	if (size > CHAMP_STORE_RESERVE)
+		return -1;
+	if (mmap(store->base, (size_t)size, PROT_READ, MAP_SHARED | MAP_FIXED, store->fd, 0) == MAP_FAILED)
+		return -1;
+	store->size = size;
+	return 0;
+}
+
+/**
+ * Writes a header and the root records in chain, oldest first, to writer. Returns the offset of the last record.
+ */
+static uint64_t store_write_records(struct snapshot_writer *writer, const struct champ_store *source,
+				    const uint64_t *records, unsigned count)
+{
+	uint64_t previous = 0;
+	for (unsigned i = count; i-- > 0;) {
+		const struct store_record *old = (const struct store_record *)(source->base + records[i]);
+		struct store_record record = {
+			.previous = previous,
+			.root = snapshot_write_node(writer, (const struct node *)(source->base + old->root), 0),
+			.length = old->length,
+			.seed = old->seed,
+		};
+		previous = snapshot_append(writer, &record, sizeof record);
+	}
+	return previous;
+}
+
+static int store_write_header(struct snapshot_writer *writer, uint64_t latest, const struct champ_type *type)
+{
+	struct store_header header;
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, STORE_MAGIC, sizeof header.magic);
+	header.format = STORE_FORMAT;
+	header.flags = writer->ref_count | (type->value_hash ? SNAPSHOT_VALUE_HASHED : 0);
+	header.size = snapshot_tell(writer);
+	header.latest = latest;
+
+	snapshot_flush(writer);
+	if (!writer->failed && fdatasync(writer->fd))
+		writer->failed = 1;
+	snapshot_write_at(writer, &header, sizeof header, 0);
+	if (!writer->failed && fdatasync(writer->fd))
+		writer->failed = 1;
+	return writer->failed ? -1 : 0;
+}
+
+struct champ_store *champ_store_open(const char *path, CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals),
+				     CHAMP_VALUE_HASHFN_T(value_hash), CHAMP_KEY_ENCODEFN_T(key_codec),
+				     CHAMP_VALUE_ENCODEFN_T(value_codec))
+{
+	const struct champ_type *type = champ_type_intern(hash, equals, value_hash);
+	struct stat stat;
+	int fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &stat) == 0 && stat.st_size == 0) {
+		struct snapshot_writer *writer = snapshot_writer_new(fd, 0, key_codec, value_codec);
+		struct store_header placeholder;
+		memset(&placeholder, 0, sizeof placeholder);
+		snapshot_append(writer, &placeholder, sizeof placeholder);
+		int failed = store_write_header(writer, 0, type);
+		snapshot_writer_destroy(writer);
+		if (failed || fstat(fd, &stat)) {
+			close(fd);
+			return NULL;
+		}
+	}
+
+	void *base = mmap(NULL, CHAMP_STORE_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	struct champ_store *store = malloc(sizeof *store);
+	store->fd = fd;
+	store->base = base;
+	store->size = 0;
+	store->type = type;
+	store->key_codec = key_codec;
+	store->value_codec = value_codec;
+
+	const uint32_t flags = NODE_MAPPED | (key_codec ? NODE_MAPPED_KEYS : 0) | (value_codec ? NODE_MAPPED_VALUES : 0)
+		| (value_hash ? SNAPSHOT_VALUE_HASHED : 0);
+	if ((size_t)stat.st_size < sizeof(struct store_header)
+	    || store_map(store, (uint64_t)stat.st_size)
+	    || memcmp(store_header(store)->magic, STORE_MAGIC, sizeof store_header(store)->magic) != 0
+	    || store_header(store)->format != STORE_FORMAT
+	    || store_header(store)->flags != flags
+	    || store_header(store)->size > store->size) {
+		DEBUG_WARN("%s is not a store written with these codecs and value hashes\n", path);
+		champ_store_close(&store);
+		return NULL;
+	}
+
+	// anything beyond the committed size is left over from an interrupted commit
+	store->size = store_header(store)->size;
+	return store;
+}
+
+void champ_store_close(struct champ_store **store)
+{
+	munmap((*store)->base, CHAMP_STORE_RESERVE);
+	close((*store)->fd);
+	free(*store);
+	*store = NULL;
+}
+
+uint64_t champ_store_commit(struct champ_store *store, const struct champ *champ)
+{
+	if (!champ->type->value_hash != !store->type->value_hash)
+		return 0;
+
+	struct snapshot_writer *writer = snapshot_writer_new(store->fd, store->size, store->key_codec, store->value_codec);
+	writer->region = store->base;
+	writer->region_size = store->size;
+
+	struct store_record record = {
+		.previous = store_header(store)->latest,
+		.root = snapshot_write_node(writer, champ->root, 0),
+		.length = champ->length,
+		.seed = champ->type->seed,
+	};
+	const uint64_t result = snapshot_append(writer, &record, sizeof record);
+	const int failed = store_write_header(writer, result, store->type) || store_map(store, snapshot_tell(writer));
+	snapshot_writer_destroy(writer);
+	return failed ? 0 : result;
+}
+
+struct champ *champ_store_load(const struct champ_store *store, uint64_t record)
+{
+	if (record < sizeof(struct store_header) || record + sizeof(struct store_record) > store->size)
+		return NULL;
+	const struct store_record *found = (const struct store_record *)(store->base + record);
+	return champ_from((struct node *)(store->base + found->root), (unsigned)found->length,
+		champ_type_seeded(store->type, found->seed));
+}
+
+uint64_t champ_store_latest(const struct champ_store *store)
+{
+	return store_header(store)->latest;
+}
+
+uint64_t champ_store_previous(const struct champ_store *store, uint64_t record)
+{
+	return ((const struct store_record *)(store->base + record))->previous;
+}
+
+int champ_store_compact(const struct champ_store *store, const char *path, unsigned versions)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+
+	uint64_t records[versions ? versions : 1];
+	unsigned count = 0;
+	for (uint64_t record = champ_store_latest(store); record && count < versions; record = champ_store_previous(store, record)) {
+		records[count++] = record;
+	}
+
+	struct address_table forward = {0, 0, NULL};
+	struct snapshot_writer *writer = snapshot_writer_new(fd, 0, store->key_codec, store->value_codec);
+	writer->forward = &forward;
+
+	struct store_header placeholder;
+	memset(&placeholder, 0, sizeof placeholder);
+	snapshot_append(writer, &placeholder, sizeof placeholder);
+	int result = store_write_header(writer, store_write_records(writer, store, records, count), store->type);
+	if (!result && ftruncate(fd, (off_t)snapshot_tell(writer)))
+		result = -1;
+
+	snapshot_writer_destroy(writer);
+	free(forward.entries);
+	close(fd);
+	return result;
+}
+
+/*
+ * Replica synchronization
+ *
+ * The pulling side sends a request for every node it needs, and the serving side answers each with the node. A
+ * request consists of the depth of the node, the slots on the path to it, and the digest and size of the node at that
+ * path on the pulling side, if any. If those match, the answer only says so. Otherwise, it consists of a sync_node
+ * header, the digests of the node's branches, and its entries. Every key and value is preceded by its size as a
+ * uint32_t. A request with a depth of SYNC_DONE ends the exchange.
+ */
+
+#define SYNC_DONE 0xffu
+#define SYNC_SAME 0xffffu
+#define SYNC_BUFFER_SIZE 4096u
+#define SYNC_MAX_DEPTH ((HASH_TOTAL_WIDTH + HASH_PARTITION_WIDTH - 1) / HASH_PARTITION_WIDTH)
+
+struct sync_request {
+	uint32_t hash;
+	uint32_t size; // UINT32_MAX if the pulling side has no such node, or nothing to compare it to
+	uint8_t depth;
+	uint8_t slots[SYNC_MAX_DEPTH];
+};
+
+struct sync_node {
+	uint32_t element_map;
+	uint32_t branch_map;
+	uint32_t hash;
+	uint32_t size;
+	uint32_t seed; // of the served map's type, since the shape of its trie depends on it
+	uint16_t element_arity; // SYNC_SAME if the node matches the one on the pulling side
+	uint16_t branch_arity;
+};
+
+struct sync_stream {
+	int fd_in;
+	int fd_out;
+	int failed;
+	size_t read_pos;
+	size_t read_end;
+	size_t write_used;
+	void *scratch;
+	size_t scratch_capacity;
+	unsigned char read_buffer[SYNC_BUFFER_SIZE];
+	unsigned char write_buffer[SYNC_BUFFER_SIZE];
+};
+
+static void sync_flush(struct sync_stream *stream)
+{
+	const unsigned char *data = stream->write_buffer;
+	while (!stream->failed && stream->write_used > 0) {
+		ssize_t written = write(stream->fd_out, data, stream->write_used);
+		if (written <= 0) {
+			stream->failed = 1;
+		} else {
+			data += written;
+			stream->write_used -= (size_t)written;
+		}
+	}
+	stream->write_used = 0;
+}
+
+static void sync_write(struct sync_stream *stream, const void *data, size_t size)
+{
+	while (size > 0) {
+		if (stream->write_used == SYNC_BUFFER_SIZE)
+			sync_flush(stream);
+		size_t chunk = SYNC_BUFFER_SIZE - stream->write_used;
+		chunk = chunk < size ? chunk : size;
+		memcpy(stream->write_buffer + stream->write_used, data, chunk);
+		stream->write_used += chunk;
+		data = (const unsigned char *)data + chunk;
+		size -= chunk;
+	}
+}
+
+/**
+ * Returns 0 if the stream ended before size bytes could be read, which is not a failure in itself.
+ */
+static int sync_read(struct sync_stream *stream, void *data, size_t size)
+{
+	while (!stream->failed && size > 0) {
+		if (stream->read_pos == stream->read_end) {
+			ssize_t bytes = read(stream->fd_in, stream->read_buffer, SYNC_BUFFER_SIZE);
+			if (bytes <= 0) {
+				stream->failed = bytes < 0;
+				return 0;
+			}
+			stream->read_pos = 0;
+			stream->read_end = (size_t)bytes;
+		}
+		size_t chunk = stream->read_end - stream->read_pos;
+		chunk = chunk < size ? chunk : size;
+		memcpy(data, stream->read_buffer + stream->read_pos, chunk);
+		stream->read_pos += chunk;
+		data = (unsigned char *)data + chunk;
+		size -= chunk;
+	}
+	return !stream->failed;
+}
+
+static void sync_reserve_scratch(struct sync_stream *stream, size_t size)
+{
+	if (size > stream->scratch_capacity) {
+		free(stream->scratch);
+		stream->scratch = malloc(size);
+		stream->scratch_capacity = size;
+	}
+}
+
+static void sync_write_blob(struct sync_stream *stream, size_t size)
+{
+	const uint32_t blob_size = (uint32_t)size;
+	sync_write(stream, &blob_size, sizeof blob_size);
+	sync_write(stream, stream->scratch, size);
+}
+
+static void sync_write_key(struct sync_stream *stream, const CHAMP_KEY_T key, CHAMP_KEY_ENCODEFN_T(key_codec))
+{
+	if (key_codec) {
+		size_t size = key_codec(key, stream->scratch, stream->scratch_capacity);
+		if (size > stream->scratch_capacity) {
+			sync_reserve_scratch(stream, size);
+			size = key_codec(key, stream->scratch, stream->scratch_capacity);
+		}
+		sync_write_blob(stream, size);
+	} else {
+		sync_write(stream, &key, sizeof key);
+	}
+}
+
+static void sync_write_value(struct sync_stream *stream, const CHAMP_VALUE_T value,
+			     CHAMP_VALUE_ENCODEFN_T(value_codec))
+{
+	if (value_codec) {
+		size_t size = value_codec(value, stream->scratch, stream->scratch_capacity);
+		if (size > stream->scratch_capacity) {
+			sync_reserve_scratch(stream, size);
+			size = value_codec(value, stream->scratch, stream->scratch_capacity);
+		}
+		sync_write_blob(stream, size);
+	} else {
+		sync_write(stream, &value, sizeof value);
+	}
+}
+
+/**
+ * Reads a blob into the scratch buffer and returns its size.
+ */
+static size_t sync_read_blob(struct sync_stream *stream)
+{
+	// unlike between requests, the end of the stream within a blob means it was cut short
+	uint32_t size = 0;
+	if (!sync_read(stream, &size, sizeof size)) {
+		stream->failed = 1;
+		return 0;
+	}
+	sync_reserve_scratch(stream, size ? size : 1);
+	if (!sync_read(stream, stream->scratch, size))
+		stream->failed = 1;
+	return size;
+}
+
+static int sync_read_key(struct sync_stream *stream, CHAMP_KEY_T *key, CHAMP_KEY_DECODEFN_T(key_decode))
+{
+	if (key_decode) {
+		const size_t size = sync_read_blob(stream);
+		if (!stream->failed)
+			*key = key_decode(stream->scratch, size);
+	} else if (!sync_read(stream, key, sizeof *key)) {
+		stream->failed = 1;
+	}
+	return !stream->failed;
+}
+
+static int sync_read_value(struct sync_stream *stream, CHAMP_VALUE_T *value, CHAMP_VALUE_DECODEFN_T(value_decode))
+{
+	if (value_decode) {
+		const size_t size = sync_read_blob(stream);
+		if (!stream->failed)
+			*value = value_decode(stream->scratch, size);
+	} else if (!sync_read(stream, value, sizeof *value)) {
+		stream->failed = 1;
+	}
+	return !stream->failed;
+}
+
+static struct sync_stream *sync_stream_new(int fd_in, int fd_out)
+{
+	struct sync_stream *stream = malloc(sizeof *stream);
+	stream->fd_in = fd_in;
+	stream->fd_out = fd_out;
+	stream->failed = 0;
+	stream->read_pos = 0;
+	stream->read_end = 0;
+	stream->write_used = 0;
+	stream->scratch = NULL;
+	stream->scratch_capacity = 0;
+	return stream;
+}
+
+static void sync_stream_destroy(struct sync_stream *stream)
+{
+	free(stream->scratch);
+	free(stream);
+}
+
+static void sync_serve_node(struct sync_stream *stream, const struct node *node, const struct sync_request *request,
+			    uint32_t seed, CHAMP_KEY_ENCODEFN_T(key_codec), CHAMP_VALUE_ENCODEFN_T(value_codec))
+{
+	struct sync_node header;
+	memset(&header, 0, sizeof header);
+	header.hash = node->hash;
+	header.size = node->size;
+	header.seed = seed;
+	if (request->size == node->size && request->hash == node->hash) {
+		header.element_arity = SYNC_SAME;
+		sync_write(stream, &header, sizeof header);
+		return;
+	}
+
+	const int is_collision_node = request->depth * HASH_PARTITION_WIDTH >= HASH_TOTAL_WIDTH;
+	header.element_map = node->element_map;
+	header.branch_map = node->branch_map;
+	header.element_arity = node->element_arity;
+	header.branch_arity = node->branch_arity;
+	sync_write(stream, &header, sizeof header);
+
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T const *branches = node_branches(node, branch_buffer);
+	for (unsigned i = 0; i < node->branch_arity; ++i) {
+		sync_write(stream, &branches[i]->hash, sizeof branches[i]->hash);
+	}
+
+	CHAMP_NODE_ELEMENT_T element_buffer[node->element_arity ? node->element_arity : 1];
+	const CHAMP_NODE_ELEMENT_T *elements = is_collision_node ?
+		collision_node_elements((const struct collision_node *)node, element_buffer) :
+		node_elements(node, element_buffer);
+	for (unsigned i = 0; i < node->element_arity; ++i) {
+		sync_write_key(stream, elements[i].key, key_codec);
+		sync_write_value(stream, elements[i].val, value_codec);
+	}
+}
+
+int champ_sync_serve(const struct champ *champ, int fd_in, int fd_out,
+		     CHAMP_KEY_ENCODEFN_T(key_codec), CHAMP_VALUE_ENCODEFN_T(value_codec))
+{
+	struct sync_stream *stream = sync_stream_new(fd_in, fd_out);
+	int result = -1;
+	for (;;) {
+		struct sync_request request;
+		if (!sync_read(stream, &request, sizeof request))
+			break;
+		if (request.depth == SYNC_DONE) {
+			result = 0;
+			break;
+		}
+		if (request.depth > SYNC_MAX_DEPTH)
+			break;
+
+		const struct node *node = champ->root;
+		for (unsigned depth = 0; node && depth < request.depth; ++depth) {
+			const uint32_t bitpos = 1u << (request.slots[depth] & 0x1fu);
+			node = node->branch_map & bitpos ? CHAMP_NODE_BRANCH_AT(node, bitpos) : NULL;
+		}
+		if (!node)
+			break;
+
+		sync_serve_node(stream, node, &request, champ->type->seed, key_codec, value_codec);
+		sync_flush(stream);
+		if (stream->failed)
+			break;
+	}
+	sync_stream_destroy(stream);
+	return result;
+}
+
+struct sync_pull {
+	struct sync_stream *stream;
+	const struct champ_type *type;
+	CHAMP_KEY_DECODEFN_T(key_decode);
+	CHAMP_VALUE_DECODEFN_T(value_decode);
+	unsigned long nodes_received;
+	struct sync_request request; // the path to the current node
+};
+
+/**
+ * Acquires and releases decoded keys and values that end up in no map, so that a type with ownership callbacks frees
+ * them. The last element may only have its key decoded.
+ */
+static void sync_discard(const struct champ_type *type, const CHAMP_NODE_ELEMENT_T *elements, unsigned count,
+			 int last_has_value)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		if (type->key_acquire && type->key_release) {
+			type->key_acquire(elements[i].key);
+			type->key_release(elements[i].key);
+		}
+		if ((i + 1 < count || last_has_value) && type->value_acquire && type->value_release) {
+			type->value_acquire(elements[i].val);
+			type->value_release(elements[i].val);
+		}
+	}
+}
+
+/**
+ * Requests the node at the current path, and returns it, local if it matches, or NULL if the exchange failed.
+ */
+static struct node *sync_pull_node(struct sync_pull *pull, const struct node *local)
+{
+	struct sync_request *request = &pull->request;
+	const unsigned depth = request->depth;
+	const unsigned shift = depth * HASH_PARTITION_WIDTH;
+	// without a value hash, equal digests don't imply equal values
+	const int compare = local && pull->type->value_hash;
+	request->hash = compare ? local->hash : 0;
+	request->size = compare ? local->size : UINT32_MAX;
+	sync_write(pull->stream, request, sizeof *request);
+	sync_flush(pull->stream);
+
+	struct sync_node header;
+	if (!sync_read(pull->stream, &header, sizeof header))
+		return NULL;
+	if (header.element_arity == SYNC_SAME)
+		return (struct node *)local;
+	++pull->nodes_received;
+	if (depth == 0 && header.seed != pull->type->seed) {
+		// the root digests agree regardless of the seed, but no other node of replica can be reused
+		pull->type = champ_type_seeded(pull->type, header.seed);
+		local = NULL;
+	}
+
+	// the header comes from the other side, so its arities must be checked before anything is sized by them
+	const int is_collision_node = shift >= HASH_TOTAL_WIDTH;
+	if (is_collision_node ?
+	    header.element_arity > UINT8_MAX || header.branch_arity != 0 :
+	    header.element_arity != bitcount(header.element_map) || header.branch_arity != bitcount(header.branch_map) ||
+	    header.element_map & header.branch_map)
+		return NULL;
+
+	uint32_t branch_hashes[1u << HASH_PARTITION_WIDTH];
+	if (!sync_read(pull->stream, branch_hashes, header.branch_arity * sizeof *branch_hashes))
+		return NULL;
+
+	// only collision nodes can have more elements than a node has slots
+	CHAMP_NODE_ELEMENT_T element_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_ELEMENT_T *elements = header.element_arity <= (1u << HASH_PARTITION_WIDTH) ?
+		element_buffer : malloc(header.element_arity * sizeof *elements);
+	for (unsigned i = 0; i < header.element_arity; ++i) {
+		if (!sync_read_key(pull->stream, &elements[i].key, pull->key_decode)) {
+			sync_discard(pull->type, elements, i, 1);
+			goto fail;
+		}
+		if (!sync_read_value(pull->stream, &elements[i].val, pull->value_decode)) {
+			sync_discard(pull->type, elements, i + 1, 0);
+			goto fail;
+		}
+	}
+
+	if (is_collision_node) {
+		struct node *result = (struct node *)collision_node_new(elements, (uint8_t)header.element_arity);
+		result->hash = header.hash;
+		node_acquire_elements(result, pull->type);
+		if (elements != element_buffer)
+			free(elements);
+		return result;
+	}
+	if (header.size == 0)
+		return (struct node *)&empty_node;
+
+	CHAMP_NODE_BRANCH_T branches[1u << HASH_PARTITION_WIDTH];
+	unsigned branch_arity = 0;
+	for (unsigned slot = 0; slot < 32 && branch_arity < header.branch_arity; ++slot) {
+		const uint32_t bitpos = 1u << slot;
+		if (!(header.branch_map & bitpos))
+			continue;
+		const struct node *local_branch = local && local->branch_map & bitpos ?
+			CHAMP_NODE_BRANCH_AT(local, bitpos) : NULL;
+		struct node *branch = (struct node *)local_branch;
+		if (!local_branch || !pull->type->value_hash || local_branch->hash != branch_hashes[branch_arity]) {
+			request->slots[depth] = (uint8_t)slot;
+			request->depth = (uint8_t)(depth + 1);
+			branch = sync_pull_node(pull, local_branch);
+			request->depth = (uint8_t)depth;
+		}
+		if (!branch) {
+			// reference counting
+			for (unsigned i = 0; i < branch_arity; ++i) {
+				if (branches[i]->ref_count == 0)
+					node_destroy(branches[i], pull->type);
+			}
+			sync_discard(pull->type, elements, header.element_arity, 1);
+			return NULL;
+		}
+		branches[branch_arity++] = branch;
+	}
+
+	struct node *result = node_new(header.element_map, header.branch_map, elements, (uint8_t)header.element_arity,
+		branches, (uint8_t)branch_arity, shift);
+	result->hash = header.hash;
+	node_acquire_elements(result, pull->type);
+	return result;
+
+fail:
+	if (elements != element_buffer)
+		free(elements);
+	return NULL;
+}
+
+struct champ *champ_sync_pull(const struct champ *replica, int fd_in, int fd_out,
+			      CHAMP_KEY_DECODEFN_T(key_decode), CHAMP_VALUE_DECODEFN_T(value_decode),
+			      unsigned long *nodes_received)
+{
+	struct sync_pull pull;
+	memset(&pull, 0, sizeof pull);
+	pull.stream = sync_stream_new(fd_in, fd_out);
+	pull.type = replica->type;
+	pull.key_decode = key_decode;
+	pull.value_decode = value_decode;
+
+	struct node *root = sync_pull_node(&pull, replica->root);
+
+	struct sync_request done;
+	memset(&done, 0, sizeof done);
+	done.depth = SYNC_DONE;
+	sync_write(pull.stream, &done, sizeof done);
+	sync_flush(pull.stream);
+	sync_stream_destroy(pull.stream);
+
+	if (nodes_received)
+		*nodes_received = pull.nodes_received;
+	if (!root || root == replica->root)
+		return root ? (struct champ *)replica : NULL;
+	return champ_from(root, root->size, pull.type);
+}
+
+/*
+ * Deltas
+ *
+ * A delta is a delta_header followed by operations, each an opcode followed by a key, and for DELTA_SET a value, in
+ * the encoding of the sync protocol. DELTA_END ends it. Subtrees that both versions share are skipped.
+ */
+
+#define DELTA_MAGIC "CHAMPDLT"
+#define DELTA_END 0u
+#define DELTA_SET 1u
+#define DELTA_DEL 2u
+
+struct delta_header {
+	char magic[8];
+	uint32_t base_hash;
+	uint32_t base_length;
+	uint32_t hash;
+	uint32_t length;
+};
+
+struct delta_writer {
+	struct sync_stream *stream;
+	CHAMP_EQUALSFN_T(equals);
+	CHAMP_KEY_ENCODEFN_T(key_codec);
+	CHAMP_VALUE_ENCODEFN_T(value_codec);
+};
+
+static void delta_write(struct delta_writer *writer, uint8_t op, const CHAMP_NODE_ELEMENT_T *element)
+{
+	sync_write(writer->stream, &op, sizeof op);
+	sync_write_key(writer->stream, element->key, writer->key_codec);
+	if (op == DELTA_SET)
+		sync_write_value(writer->stream, element->val, writer->value_codec);
+}
+
+/**
+ * Writes op for every entry below node. If other is given, an entry with the same key is written as DELTA_SET with
+ * the value of the newer one of them, if the values differ, and *found is set.
+ */
+static void delta_write_all(struct delta_writer *writer, const struct node *node, unsigned shift, uint8_t op,
+			    const CHAMP_NODE_ELEMENT_T *other, int *found)
+{
+	CHAMP_NODE_ELEMENT_T element_buffer[node->element_arity ? node->element_arity : 1];
+	const CHAMP_NODE_ELEMENT_T *elements = shift >= HASH_TOTAL_WIDTH ?
+		collision_node_elements((const struct collision_node *)node, element_buffer) :
+		node_elements(node, element_buffer);
+	for (unsigned i = 0; i < node->element_arity; ++i) {
+		if (other && !*found && writer->equals(elements[i].key, other->key)) {
+			*found = 1;
+			if (elements[i].val != other->val)
+				delta_write(writer, DELTA_SET, op == DELTA_SET ? &elements[i] : other);
+		} else {
+			delta_write(writer, op, &elements[i]);
+		}
+	}
+
+	if (shift >= HASH_TOTAL_WIDTH)
+		return;
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T const *branches = node_branches(node, branch_buffer);
+	for (unsigned i = 0; i < node->branch_arity; ++i) {
+		delta_write_all(writer, branches[i], shift + HASH_PARTITION_WIDTH, op, other, found);
+	}
+}
+
+static void collision_node_delta(struct delta_writer *writer, const struct collision_node *old,
+				 const struct collision_node *new)
+{
+	CHAMP_NODE_ELEMENT_T old_buffer[old->element_arity], new_buffer[new->element_arity];
+	const CHAMP_NODE_ELEMENT_T *old_elements = collision_node_elements(old, old_buffer);
+	const CHAMP_NODE_ELEMENT_T *new_elements = collision_node_elements(new, new_buffer);
+	char matched[new->element_arity];
+	memset(matched, 0, sizeof matched);
+
+	for (unsigned i = 0; i < old->element_arity; ++i) {
+		unsigned j = 0;
+		while (j < new->element_arity && !writer->equals(old_elements[i].key, new_elements[j].key))
+			++j;
+		if (j == new->element_arity) {
+			delta_write(writer, DELTA_DEL, &old_elements[i]);
+		} else {
+			matched[j] = 1;
+			if (old_elements[i].val != new_elements[j].val)
+				delta_write(writer, DELTA_SET, &new_elements[j]);
+		}
+	}
+	for (unsigned j = 0; j < new->element_arity; ++j) {
+		if (!matched[j])
+			delta_write(writer, DELTA_SET, &new_elements[j]);
+	}
+}
+
+static void node_delta(struct delta_writer *writer, const struct node *old, const struct node *new, unsigned shift)
+{
+	if (old == new)
+		return;
+	if (shift >= HASH_TOTAL_WIDTH) {
+		collision_node_delta(writer, (const struct collision_node *)old, (const struct collision_node *)new);
+		return;
+	}
+
+	CHAMP_NODE_ELEMENT_T old_element_buffer[1u << HASH_PARTITION_WIDTH], new_element_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T old_branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T new_branch_buffer[1u << HASH_PARTITION_WIDTH];
+	const CHAMP_NODE_ELEMENT_T *old_elements = node_elements(old, old_element_buffer);
+	const CHAMP_NODE_ELEMENT_T *new_elements = node_elements(new, new_element_buffer);
+	CHAMP_NODE_BRANCH_T const *old_branches = node_branches(old, old_branch_buffer);
+	CHAMP_NODE_BRANCH_T const *new_branches = node_branches(new, new_branch_buffer);
+	const unsigned sub_shift = shift + HASH_PARTITION_WIDTH;
+
+	for (uint32_t slots = old->element_map | old->branch_map | new->element_map | new->branch_map; slots;
+	     slots &= slots - 1) {
+		const uint32_t bitpos = slots & (~slots + 1);
+		const CHAMP_NODE_ELEMENT_T *old_element = old->element_map & bitpos ?
+			&old_elements[champ_index(old->element_map, bitpos)] : NULL;
+		const CHAMP_NODE_ELEMENT_T *new_element = new->element_map & bitpos ?
+			&new_elements[champ_index(new->element_map, bitpos)] : NULL;
+		const struct node *old_branch = old->branch_map & bitpos ?
+			old_branches[champ_index(old->branch_map, bitpos)] : NULL;
+		const struct node *new_branch = new->branch_map & bitpos ?
+			new_branches[champ_index(new->branch_map, bitpos)] : NULL;
+		int found = 0;
+
+		if (old_element && new_element) {
+			if (!writer->equals(old_element->key, new_element->key)) {
+				delta_write(writer, DELTA_DEL, old_element);
+				delta_write(writer, DELTA_SET, new_element);
+			} else if (old_element->val != new_element->val) {
+				delta_write(writer, DELTA_SET, new_element);
+			}
+		} else if (old_branch && new_branch) {
+			node_delta(writer, old_branch, new_branch, sub_shift);
+		} else if (old_element && new_branch) {
+			delta_write_all(writer, new_branch, sub_shift, DELTA_SET, old_element, &found);
+			if (!found)
+				delta_write(writer, DELTA_DEL, old_element);
+		} else if (old_branch && new_element) {
+			delta_write_all(writer, old_branch, sub_shift, DELTA_DEL, new_element, &found);
+			if (!found)
+				delta_write(writer, DELTA_SET, new_element);
+		} else if (old_element) {
+			delta_write(writer, DELTA_DEL, old_element);
+		} else if (new_element) {
+			delta_write(writer, DELTA_SET, new_element);
+		} else if (old_branch) {
+			delta_write_all(writer, old_branch, sub_shift, DELTA_DEL, NULL, NULL);
+		} else {
+			delta_write_all(writer, new_branch, sub_shift, DELTA_SET, NULL, NULL);
+		}
+	}
+}
+
+/**
+ * Writes the changes between two maps whose tries have different shapes, by looking up every entry of each in the
+ * other one.
+ */
+static void champ_delta_lookup(struct delta_writer *writer, const struct champ *from, const struct champ *to)
+{
+	struct champ_iter iterator;
+	CHAMP_NODE_ELEMENT_T element;
+	int found;
+	champ_iter_init(&iterator, from);
+	while (champ_iter_next(&iterator, &element.key, &element.val)) {
+		champ_get(to, element.key, &found);
+		if (!found)
+			delta_write(writer, DELTA_DEL, &element);
+	}
+	champ_iter_init(&iterator, to);
+	while (champ_iter_next(&iterator, &element.key, &element.val)) {
+		const CHAMP_VALUE_T value = champ_get(from, element.key, &found);
+		if (!found || value != element.val)
+			delta_write(writer, DELTA_SET, &element);
+	}
+}
+
+int champ_encode_delta(const struct champ *from, const struct champ *to, int fd,
+		       CHAMP_KEY_ENCODEFN_T(key_codec), CHAMP_VALUE_ENCODEFN_T(value_codec))
+{
+	// without value hashes, champ_apply_delta couldn't tell whether its base has the right values
+	if (!from->type->value_hash || !to->type->value_hash)
+		return -1;
+	struct delta_writer writer = {sync_stream_new(-1, fd), to->type->equals, key_codec, value_codec};
+
+	struct delta_header header;
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, DELTA_MAGIC, sizeof header.magic);
+	header.base_hash = champ_hash(from);
+	header.base_length = from->length;
+	header.hash = champ_hash(to);
+	header.length = to->length;
+	sync_write(writer.stream, &header, sizeof header);
+
+	if (from->type->seed == to->type->seed)
+		node_delta(&writer, from->root, to->root, 0);
+	else
+		champ_delta_lookup(&writer, from, to);
+	const uint8_t end = DELTA_END;
+	sync_write(writer.stream, &end, sizeof end);
+	sync_flush(writer.stream);
+
+	const int result = writer.stream->failed ? -1 : 0;
+	sync_stream_destroy(writer.stream);
+	return result;
+}
+
+/**
+ * Decoded keys and values start out unowned. Acquiring and releasing one frees it unless the map kept it.
+ */
+static void delta_settle(const struct champ_type *type, const CHAMP_KEY_T key, CHAMP_VALUE_T const *value)
+{
+	if (type->key_acquire && type->key_release) {
+		type->key_acquire(key);
+		type->key_release(key);
+	}
+	if (value && type->value_acquire && type->value_release) {
+		type->value_acquire(*value);
+		type->value_release(*value);
+	}
+}
+
+struct champ *champ_apply_delta(const struct champ *base, int fd,
+				CHAMP_KEY_DECODEFN_T(key_decode), CHAMP_VALUE_DECODEFN_T(value_decode))
+{
+	if (!base->type->value_hash)
+		return NULL;
+	struct sync_stream *stream = sync_stream_new(fd, -1);
+	struct champ *result = (struct champ *)base;
+
+	// the base hash covers values too, so a base with the same keys but other values is refused
+	struct delta_header header;
+	if (!sync_read(stream, &header, sizeof header) || memcmp(header.magic, DELTA_MAGIC, sizeof header.magic) ||
+	    header.base_hash != champ_hash(base) || header.base_length != base->length)
+		goto fail;
+
+	for (;;) {
+		uint8_t op;
+		CHAMP_KEY_T key;
+		CHAMP_VALUE_T value;
+		if (!sync_read(stream, &op, sizeof op) || op > DELTA_DEL)
+			goto fail;
+		if (op == DELTA_END)
+			break;
+		if (!sync_read_key(stream, &key, key_decode))
+			goto fail;
+		if (op == DELTA_SET && !sync_read_value(stream, &value, value_decode)) {
+			delta_settle(base->type, key, NULL);
+			goto fail;
+		}
+
+		struct champ *tmp = op == DELTA_SET ? champ_set(result, key, value, NULL) : champ_del(result, key, NULL);
+		if (tmp != result && result != base)
+			champ_destroy(&result);
+		result = tmp;
+		delta_settle(base->type, key, op == DELTA_SET ? &value : NULL);
+	}
+
+	if (result->length != header.length || champ_hash(result) != header.hash)
+		goto fail;
+	sync_stream_destroy(stream);
+	return result;
+
+fail:
+	if (result != base)
+		champ_destroy(&result);
+	sync_stream_destroy(stream);
+	return NULL;
+}
+
+/*
+ * Statistics
+ */
+
+static size_t node_bytes(const struct node *node, unsigned shift)
+{
+	const size_t header_size = shift >= HASH_TOTAL_WIDTH ? sizeof(struct collision_node) : sizeof(struct node);
+	return header_size + CHAMP_NODE_ELEMENTS_SIZE(node->element_arity) + CHAMP_NODE_BRANCHES_SIZE(node->branch_arity);
+}
+
+static void node_stats(const struct node *node, unsigned shift, struct champ_stats *stats)
+{
+	const unsigned depth = shift / HASH_PARTITION_WIDTH;
+	const size_t bytes = node_bytes(node, shift);
+
+	if (node->ref_count >= NODE_PINNED)
+		stats->pinned_bytes += bytes;
+	else
+		stats->bytes += bytes;
+	stats->nodes_by_depth[depth] += 1;
+	stats->entries_by_depth[depth] += node->element_arity;
+
+	if (shift >= HASH_TOTAL_WIDTH) {
+		stats->collision_nodes += 1;
+		stats->collision_entries += node->element_arity;
+		if (node->element_arity > stats->max_collision_arity)
+			stats->max_collision_arity = node->element_arity;
+		return;
+	}
+
+	stats->nodes += 1;
+	stats->nodes_by_arity[node->element_arity + node->branch_arity] += 1;
+	if (node->element_arity == 0 && node->branch_arity == 1)
+		stats->chain_nodes += 1;
+
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T const *branches = node_branches(node, branch_buffer);
+	for (unsigned i = 0; i < node->branch_arity; ++i) {
+		node_stats(branches[i], shift + HASH_PARTITION_WIDTH, stats);
+	}
+}
+
+void champ_stats(const struct champ *champ, struct champ_stats *stats)
+{
+	memset(stats, 0, sizeof *stats);
+	stats->entries = champ->length;
+	stats->seed = champ->type->seed;
+	stats->bytes = sizeof *champ;
+	node_stats(champ->root, 0, stats);
+	if (champ_is_inline(champ)) {
+		stats->pinned_bytes -= node_bytes(champ->root, 0);
+		stats->bytes += node_bytes(champ->root, 0);
+	}
+
+	unsigned long slots = 0;
+	for (unsigned arity = 0; arity <= 1u << HASH_PARTITION_WIDTH; ++arity) {
+		slots += arity * stats->nodes_by_arity[arity];
+	}
+	stats->average_fill = (double)slots / (double)(stats->nodes << HASH_PARTITION_WIDTH);
+	stats->bytes_per_entry = champ->length ? (double)(stats->bytes + stats->pinned_bytes) / champ->length : 0.;
+}
+
+static void node_collect(const struct node *node, unsigned shift, struct address_table *seen)
+{
+	if (address_table_get(seen, node))
+		return;
+	address_table_put(seen, node, node_bytes(node, shift));
+	if (shift >= HASH_TOTAL_WIDTH)
+		return;
+
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T const *branches = node_branches(node, branch_buffer);
+	for (unsigned i = 0; i < node->branch_arity; ++i) {
+		node_collect(branches[i], shift + HASH_PARTITION_WIDTH, seen);
+	}
+}
+
+static size_t node_shared_bytes(const struct node *node, unsigned shift, const struct address_table *left,
+				struct address_table *visited)
+{
+	if (address_table_get(visited, node))
+		return 0;
+	address_table_put(visited, node, 1);
+
+	size_t result = address_table_get(left, node);
+	if (shift >= HASH_TOTAL_WIDTH)
+		return result;
+
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T const *branches = node_branches(node, branch_buffer);
+	for (unsigned i = 0; i < node->branch_arity; ++i) {
+		result += node_shared_bytes(branches[i], shift + HASH_PARTITION_WIDTH, left, visited);
+	}
+	return result;
+}
+
+size_t champ_shared_bytes(const struct champ *left, const struct champ *right)
+{
+	struct address_table left_nodes = {0, 0, NULL}, visited = {0, 0, NULL};
+	node_collect(left->root, 0, &left_nodes);
+	const size_t result = node_shared_bytes(right->root, 0, &left_nodes, &visited);
+	free(left_nodes.entries);
+	free(visited.entries);
+	return result;
+}
+
+/*
+ * Freezing
+ *
+ * A frozen map lives in a single arena, with every node directly followed by its subtrees. Frozen nodes are pinned,
+ * so the arena is never freed.
+ */
+
+#define FREEZE_HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static size_t node_tree_bytes(const struct node *node, unsigned shift)
+{
+	size_t result = node_bytes(node, shift);
+	if (shift >= HASH_TOTAL_WIDTH)
+		return result;
+
+	CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+	CHAMP_NODE_BRANCH_T const *branches = node_branches(node, branch_buffer);
+	for (unsigned i = 0; i < node->branch_arity; ++i) {
+		result += node_tree_bytes(branches[i], shift + HASH_PARTITION_WIDTH);
+	}
+	return result;
+}
+
+static struct node *node_freeze(const struct node *node, const struct champ_type *type, unsigned shift,
+			       char **cursor)
+{
+	const int is_collision_node = shift >= HASH_TOTAL_WIDTH;
+	const size_t header_size = is_collision_node ? sizeof(struct collision_node) : sizeof(struct node);
+	struct node *result = (struct node *)*cursor;
+	*cursor += node_bytes(node, shift);
+
+	memcpy(result, node, header_size);
+	result->ref_count = NODE_PINNED;
+
+	// the element accessors only write to the buffer they are given if node is mapped
+	CHAMP_NODE_ELEMENT_T *elements = (CHAMP_NODE_ELEMENT_T *)((char *)result + header_size);
+	const CHAMP_NODE_ELEMENT_T *source = is_collision_node ?
+		collision_node_elements((const struct collision_node *)node, elements) :
+		node_elements(node, elements);
+	if (source != elements)
+		memcpy(elements, source, CHAMP_NODE_ELEMENTS_SIZE(node->element_arity));
+	// frozen nodes are never freed, so they keep their entries for good
+	node_acquire_elements(result, type);
+
+	if (!is_collision_node) {
+		CHAMP_NODE_BRANCH_T branch_buffer[1u << HASH_PARTITION_WIDTH];
+		CHAMP_NODE_BRANCH_T const *branches = node_branches(node, branch_buffer);
+		CHAMP_NODE_BRANCH_T *frozen_branches = (CHAMP_NODE_BRANCH_T *)CHAMP_NODE_BRANCHES(result);
+		for (unsigned i = 0; i < node->branch_arity; ++i) {
+			frozen_branches[i] = node_freeze(branches[i], type, shift + HASH_PARTITION_WIDTH, cursor);
+		}
+	}
+
+	return result;
+}
+
+struct champ *champ_freeze(const struct champ *champ, int flags)
+{
+	size_t size = node_tree_bytes(champ->root, 0);
+	char *arena;
+
+	if (flags & CHAMP_FREEZE_HUGE_PAGES) {
+		size = (size + FREEZE_HUGE_PAGE_SIZE - 1) & ~(FREEZE_HUGE_PAGE_SIZE - 1);
+		arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (arena == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(arena, size, MADV_HUGEPAGE);
+#endif
+	} else {
+		arena = malloc(size);
+		if (!arena)
+			return NULL;
+	}
+
+	char *cursor = arena;
+	struct node *root = node_freeze(champ->root, champ->type, 0, &cursor);
+	return champ_from(root, champ->length, champ->type);
+}
+
+/*
+ * Interning
+ *
+ * The intern table holds a reference to the canonical copy of every node interned so far, keyed by its type, its maps
+ * and its content, which are the keys and values it holds and the addresses of its branches. Branches are interned
+ * before their parents, so two subtrees with the same entries end up as the same node whenever their keys and values
+ * are the same pointers. Mapped and frozen nodes are left as they are.
+ */
+
+#ifndef CHAMP_INTERN_MAX_REFS
+#define CHAMP_INTERN_MAX_REFS 0xff00u // canonical nodes referenced this often are not handed out anymore
+#endif
+
+struct intern_entry {
+	struct node *node; // NULL if the slot is free
+	const struct champ_type *type;
+	uint32_t hash;
+};
+
+struct intern_table {
+	struct intern_entry *entries;
+	size_t capacity; // a power of two
+	size_t used;
+};
+
+static struct intern_table interned_nodes = {NULL, 0, 0};
+static atomic_flag interning = ATOMIC_FLAG_INIT;
+
+static void intern_lock(void)
+{
+	while (atomic_flag_test_and_set_explicit(&interning, memory_order_acquire));
+}
+
+static void intern_unlock(void)
+{
+	atomic_flag_clear_explicit(&interning, memory_order_release);
+}
+
+static size_t node_content_size(const struct node *node)
+{
+	return CHAMP_NODE_ELEMENTS_SIZE(node->element_arity) + CHAMP_NODE_BRANCHES_SIZE(node->branch_arity);
+}
+
+static uint32_t intern_hash(const struct node *node, const struct champ_type *type)
+{
+	uint32_t words[sizeof(uintptr_t) / sizeof(uint32_t)];
+	memcpy(words, &type, sizeof type);
+	uint32_t hash = hash_mix(node->element_map, node->branch_map);
+	for (size_t i = 0; i < sizeof words / sizeof *words; ++i) {
+		hash = hash_mix(hash, words[i]);
+	}
+
+	const uint32_t *content = (const uint32_t *)node->content;
+	for (size_t i = 0; i < node_content_size(node) / sizeof *content; ++i) {
+		hash = hash_mix(hash, content[i]);
+	}
+	return hash;
+}
+
+static int intern_same(const struct intern_entry *entry, const struct node *node, const struct champ_type *type,
+		       uint32_t hash)
+{
+	return entry->hash == hash && entry->type == type && entry->node->element_map == node->element_map &&
+	       entry->node->branch_map == node->branch_map && entry->node->element_arity == node->element_arity &&
+	       entry->node->branch_arity == node->branch_arity &&
+	       memcmp(entry->node->content, node->content, node_content_size(node)) == 0;
+}
+
+static void intern_put(struct intern_table *table, const struct intern_entry *entry)
+{
+	size_t slot = entry->hash & (table->capacity - 1);
+	while (table->entries[slot].node)
+		slot = (slot + 1) & (table->capacity - 1);
+	table->entries[slot] = *entry;
+	table->used += 1;
+}
+
+// rebuilds the table with the given capacity, leaving out the entries whose node is NULL
+static void intern_rehash(struct intern_table *table, size_t capacity)
+{
+	struct intern_table rehashed = {calloc(capacity, sizeof(struct intern_entry)), capacity, 0};
+	for (size_t i = 0; i < table->capacity; ++i) {
+		if (table->entries[i].node)
+			intern_put(&rehashed, &table->entries[i]);
+	}
+	free(table->entries);
+	*table = rehashed;
+}
+
+/**
+ * Returns the canonical node equal to node, and makes node the canonical one if there is none yet.
+ */
+static struct node *intern_find_or_add(struct node *node, const struct champ_type *type)
+{
+	struct intern_table *table = &interned_nodes;
+	const uint32_t hash = intern_hash(node, type);
+	if (table->capacity) {
+		for (size_t slot = hash & (table->capacity - 1); table->entries[slot].node;
+		     slot = (slot + 1) & (table->capacity - 1)) {
+			if (intern_same(&table->entries[slot], node, type, hash))
+				return table->entries[slot].node->ref_count < CHAMP_INTERN_MAX_REFS ? table->entries[slot].node : node;
+		}
+	}
+
+	if (2 * (table->used + 1) > table->capacity)
+		intern_rehash(table, table->capacity ? 2 * table->capacity : 64);
+	const struct intern_entry entry = {champ_node_acquire(node), type, hash};
+	intern_put(table, &entry);
+	return node;
+}
+
+static struct node *node_intern(struct node *node, const struct champ_type *type, unsigned shift)
+{
+	if (node->ref_count >= NODE_PINNED)
+		return node;
+
+	struct node *candidate = node;
+	if (shift < HASH_TOTAL_WIDTH && node->branch_arity) {
+		CHAMP_NODE_BRANCH_T branches[1u << HASH_PARTITION_WIDTH];
+		int changed = 0;
+		for (unsigned i = 0; i < node->branch_arity; ++i) {
+			branches[i] = node_intern(CHAMP_NODE_BRANCHES(node)[i], type, shift + HASH_PARTITION_WIDTH);
+			changed |= branches[i] != CHAMP_NODE_BRANCHES(node)[i];
+		}
+		if (changed) {
+			// never an inline root, not even at shift 0, since canonical nodes are shared between maps
+			candidate = node_new(node->element_map, node->branch_map, CHAMP_NODE_ELEMENTS(node), node->element_arity,
+				branches, node->branch_arity, HASH_PARTITION_WIDTH);
+			candidate->hash = node->hash;
+			node_acquire_elements(candidate, type);
+		}
+	}
+
+	struct node *canonical = intern_find_or_add(candidate, type);
+	if (candidate != node && canonical != candidate)
+		node_destroy(candidate, type);
+	return canonical;
+}
+
+struct champ *champ_intern(const struct champ *champ)
+{
+	const struct champ_type *type = champ->type;
+	struct node *root = champ->root;
+	if (root->ref_count >= NODE_PINNED && !champ_is_inline(champ))
+		return (struct champ *)champ;
+
+	intern_lock();
+	if (champ_is_inline(champ)) {
+		root = node_new(root->element_map, root->branch_map, CHAMP_NODE_ELEMENTS(root), root->element_arity,
+			CHAMP_NODE_BRANCHES(root), root->branch_arity, HASH_PARTITION_WIDTH);
+		root->hash = champ->root->hash;
+		node_acquire_elements(root, type);
+	}
+	struct node *canonical = node_intern(root, type, 0);
+	if (root != champ->root && canonical != root)
+		node_destroy(root, type);
+	intern_unlock();
+
+	if (canonical == champ->root)
+		return (struct champ *)champ;
+	return champ_from(canonical, champ->length, type);
+}
+
+size_t champ_intern_collect(void)
+{
+	size_t released = 0, before;
+	intern_lock();
+	struct intern_table *table = &interned_nodes;
+	do {
+		before = released;
+		for (size_t i = 0; i < table->capacity; ++i) {
+			struct intern_entry *entry = &table->entries[i];
+			if (entry->node && entry->node->ref_count == 1) {
+				champ_node_release(entry->node, entry->type);
+				entry->node = NULL;
+				++released;
+			}
+		}
+		if (released != before)
+			intern_rehash(table, table->capacity);
+	} while (released != before);
+	intern_unlock();
+	return released;
+}
+
+size_t champ_interned_nodes(void)
+{
+	intern_lock();
+	const size_t result = interned_nodes.used;
+	intern_unlock();
+	return result;
+}
@@ -52,6 +52,15 @@
 #define CHAMP_EQUALSFN_T(name) int (*name)(const CHAMP_KEY_T left, const CHAMP_KEY_T right)
 #define CHAMP_ASSOCFN_T(name) CHAMP_VALUE_T (*name)(const CHAMP_KEY_T key, const CHAMP_VALUE_T old_value, void *user_data)
 #define CHAMP_VALUE_EQUALSFN_T(name) int (*name)(const CHAMP_VALUE_T left, const CHAMP_VALUE_T right)
+#define CHAMP_VALUE_HASHFN_T(name) uint32_t (*name)(const CHAMP_VALUE_T)
+#define CHAMP_KEY_ENCODEFN_T(name) size_t (*name)(const CHAMP_KEY_T key, void *buffer, size_t capacity)
+#define CHAMP_VALUE_ENCODEFN_T(name) size_t (*name)(const CHAMP_VALUE_T value, void *buffer, size_t capacity)
+#define CHAMP_KEY_DECODEFN_T(name) CHAMP_KEY_T (*name)(const void *buffer, size_t size)
+#define CHAMP_VALUE_DECODEFN_T(name) CHAMP_VALUE_T (*name)(const void *buffer, size_t size)
+#define CHAMP_MAPFN_T(name) CHAMP_VALUE_T (*name)(const CHAMP_KEY_T key, const CHAMP_VALUE_T value, void *user_data)
+#define CHAMP_PREDFN_T(name) int (*name)(const CHAMP_KEY_T key, const CHAMP_VALUE_T value, void *user_data)
+#define CHAMP_KEY_OWNFN_T(name) void (*name)(const CHAMP_KEY_T key)
+#define CHAMP_VALUE_OWNFN_T(name) void (*name)(const CHAMP_VALUE_T value)
 
 
 /**
@@ -68,17 +77,71 @@
 #define CHAMP_MAKE_EQUALSFN(name, arg_l, arg_r) int name(const CHAMP_KEY_T arg_l, const CHAMP_KEY_T arg_r)
 #define CHAMP_MAKE_ASSOCFN(name, key_arg, value_arg, user_data_arg) CHAMP_VALUE_T name(const CHAMP_KEY_T key_arg, const CHAMP_VALUE_T value_arg, void *user_data_arg)
 #define CHAMP_MAKE_VALUE_EQUALSFN(name, arg_l, arg_r) int name(const CHAMP_VALUE_T arg_l, const CHAMP_VALUE_T arg_r)
+#define CHAMP_MAKE_VALUE_HASHFN(name, arg_1) uint32_t name(const CHAMP_VALUE_T arg_1)
+#define CHAMP_MAKE_KEY_ENCODEFN(name, key_arg, buffer_arg, capacity_arg) size_t name(const CHAMP_KEY_T key_arg, void *buffer_arg, size_t capacity_arg)
+#define CHAMP_MAKE_VALUE_ENCODEFN(name, value_arg, buffer_arg, capacity_arg) size_t name(const CHAMP_VALUE_T value_arg, void *buffer_arg, size_t capacity_arg)
+#define CHAMP_MAKE_KEY_DECODEFN(name, buffer_arg, size_arg) CHAMP_KEY_T name(const void *buffer_arg, size_t size_arg)
+#define CHAMP_MAKE_VALUE_DECODEFN(name, buffer_arg, size_arg) CHAMP_VALUE_T name(const void *buffer_arg, size_t size_arg)
+#define CHAMP_MAKE_MAPFN(name, key_arg, value_arg, user_data_arg) CHAMP_VALUE_T name(const CHAMP_KEY_T key_arg, const CHAMP_VALUE_T value_arg, void *user_data_arg)
+#define CHAMP_MAKE_PREDFN(name, key_arg, value_arg, user_data_arg) int name(const CHAMP_KEY_T key_arg, const CHAMP_VALUE_T value_arg, void *user_data_arg)
+#define CHAMP_MAKE_KEY_OWNFN(name, key_arg) void name(const CHAMP_KEY_T key_arg)
+#define CHAMP_MAKE_VALUE_OWNFN(name, value_arg) void name(const CHAMP_VALUE_T value_arg)
+
+/**
+ * The functions a map works with. Types are interned, see champ_type_intern, so every version of a map refers to the
+ * same immutable descriptor instead of carrying its own copy of the function pointers.
+ */
+struct champ_type {
+	CHAMP_HASHFN_T(hash);
+	CHAMP_EQUALSFN_T(equals);
+	CHAMP_VALUE_HASHFN_T(value_hash);
+
+	/*
+	 * Optional ownership callbacks, any of them may be NULL. Every node holds a reference to each key and value it
+	 * stores: *_acquire is called when an entry is copied into a new node, *_release when a node holding it dies.
+	 * A key or value is therefore released for the last time once no live version of the map refers to it.
+	 */
+	CHAMP_KEY_OWNFN_T(key_acquire);
+	CHAMP_KEY_OWNFN_T(key_release);
+	CHAMP_VALUE_OWNFN_T(value_acquire);
+	CHAMP_VALUE_OWNFN_T(value_release);
+
+	/*
+	 * If not 0, keys are placed by a mix of their hash and the seed instead of by their hash alone, which spreads out
+	 * hashes that only differ in a few bits. A map whose hash turns out to cluster can be rebuilt with a seed, see
+	 * champ_clusters and champ_reseed. Hashes that are equal stay equal though.
+	 */
+	uint32_t seed;
+};
 
 // todo: replace with something like: "typedef struct champ champ;" to hide implementation details.
 struct champ {
 	volatile uint32_t ref_count;
 	unsigned length;
-	struct node *root;
-
-	CHAMP_HASHFN_T(hash);
-	CHAMP_EQUALSFN_T(equals);
+	struct node *root; // usually allocated together with the map, right behind it
+	const struct champ_type *type;
 };
 
+/**
+ * Returns the one descriptor for the given functions, creating it on first use. Descriptors are never freed.
+ *
+ * @param hash
+ * @param equals
+ * @param value_hash may be NULL
+ * @return
+ */
+const struct champ_type *champ_type_intern(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals),
+					   CHAMP_VALUE_HASHFN_T(value_hash));
+
+/**
+ * Like champ_type_intern, but takes all functions of a type, including the ownership callbacks. <code>type</code>
+ * itself is copied and may live on the stack.
+ *
+ * @param type
+ * @return
+ */
+const struct champ_type *champ_type_of(const struct champ_type *type);
+
 /**
  * Creates a new map with the given hash and equals functions. This implementation is based on the assumption that if
  * two keys are equal, their hashes must be equal as well. This is commonly known as the Java Hashcode contract.
@@ -92,7 +155,30 @@ struct champ {
 struct champ *champ_new(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals));
 
 /**
- * Destroys a champ. Doesn't clean up the stored key-value-pairs.
+ * Like champ_new, but values are hashed with value_hash as well, so that champ_hash covers both keys and values, and
+ * champ_equals can tell most unequal maps apart in constant time. Equal values must have equal hashes.
+ *
+ * @param hash
+ * @param equals
+ * @param value_hash
+ * @return
+ */
+struct champ *champ_new_hashed(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals), CHAMP_VALUE_HASHFN_T(value_hash));
+
+/**
+ * Creates a new, empty map of the given type, see champ_type_of. If the type has ownership callbacks, the map and all
+ * versions derived from it acquire the keys and values they store, and release them as their nodes are freed.
+ *
+ * The reference count of a new map is zero.
+ *
+ * @param type
+ * @return
+ */
+struct champ *champ_new_typed(const struct champ_type *type);
+
+/**
+ * Destroys a champ. Doesn't clean up the stored key-value-pairs, unless its type has ownership callbacks: then the
+ * entries that no other version refers to any more are released (or queued, see champ_defer_reclamation).
  *
  * @param old
  */
@@ -115,6 +201,39 @@ struct champ *champ_acquire(const struct champ *champ);
  */
 void champ_release(struct champ **champ);
 
+/**
+ * Returns the hash by which champ places key, which is the hash of key unless champ has a seed, see champ_type.seed.
+ * Hash prefixes, as in champ_iter_init_prefix and champ_split, refer to this hash.
+ *
+ * @param champ
+ * @param key
+ * @return
+ */
+uint32_t champ_key_hash(const struct champ *champ, const CHAMP_KEY_T key);
+
+/**
+ * Returns whether the hash function of champ clusters: whether champ has a chain of nodes with a single branch each
+ * that holds CHAMP_RESEED_CHAIN entries or more, which lookups have to walk through. With evenly spread hashes, that
+ * practically never happens. Walks the whole trie.
+ *
+ * @param champ
+ * @return
+ */
+int champ_clusters(const struct champ *champ);
+
+/**
+ * Rebuilds champ with a copy of its type that has the given seed, see champ_type.seed. Takes as long as inserting
+ * every entry, and the result shares no nodes with champ or any other version, so deltas, stores and champ_equals lose
+ * their shortcuts between the two. Use the same seed for maps that are meant to share nodes.
+ *
+ * Reference count of the new map is zero.
+ *
+ * @param champ
+ * @param seed 0 to place keys by their hash alone again
+ * @return champ itself if it already has that seed
+ */
+struct champ *champ_reseed(const struct champ *champ, uint32_t seed);
+
 /**
  * Returns the number of entries in champ.
  *
@@ -123,6 +242,69 @@ void champ_release(struct champ **champ);
  */
 unsigned champ_length(const struct champ *champ);
 
+/**
+ * Returns a hash of the contents of champ in constant time. The hash is maintained incrementally and doesn't depend on
+ * the order in which entries were added, so equal maps have equal hashes, which makes maps usable as keys of other
+ * maps. For maps created with champ_new, only keys are hashed.
+ *
+ * Maps opened from snapshots and stores keep the hashes they were written with.
+ *
+ * @param champ
+ * @return
+ */
+uint32_t champ_hash(const struct champ *champ);
+
+/**
+ * Sets *key and *value to the entry at position index, counted in iteration order. Every node knows the size of its
+ * subtree, so this takes time proportional to the depth of the map rather than to index.
+ *
+ * @param champ
+ * @param index
+ * @param key may be NULL
+ * @param value may be NULL
+ * @return 0 if index is out of bounds
+ */
+int champ_nth(const struct champ *champ, unsigned index, CHAMP_KEY_T *key, CHAMP_VALUE_T *value);
+
+/**
+ * Draws n entries uniformly at random, with replacement, and stores them in keys and values. random must return
+ * uniformly distributed 32 bit numbers and is passed state.
+ *
+ * @param champ
+ * @param random
+ * @param state
+ * @param n
+ * @param keys NULL or an array of at least n keys
+ * @param values NULL or an array of at least n values
+ * @return the number of entries drawn, i.e. n, or 0 if champ is empty
+ */
+unsigned champ_sample(const struct champ *champ, uint32_t (*random)(void *state), void *state, unsigned n,
+		      CHAMP_KEY_T *keys, CHAMP_VALUE_T *values);
+
+/**
+ * Splits champ into 32 maps by the lowest 5 bits of their key hashes, see champ_key_hash: out[i] holds the entries of
+ * champ whose hash ends in i. Only the root is taken apart, the subtrees below it are shared with champ, so this takes
+ * constant time.
+ *
+ * The reference count of every map in out is zero. Maps without entries are empty, but never NULL.
+ *
+ * @param champ
+ * @param out
+ * @return the number of maps in out that are not empty
+ */
+unsigned champ_split(const struct champ *champ, struct champ *out[32]);
+
+/**
+ * The inverse of champ_split. Joins 32 maps whose roots don't overlap, which is the case if every parts[i] only holds
+ * keys whose hash ends in i, and takes constant time like champ_split. All parts must have the same type.
+ *
+ * Reference count of the new map is zero.
+ *
+ * @param parts
+ * @return the joined map, or NULL if the roots of two parts overlap or their types differ
+ */
+struct champ *champ_join(struct champ *const parts[32]);
+
 /**
  * Looks up key and sets *value_receiver to the associated value. Doesn't change value_receiver if key is not set.
  *
@@ -137,7 +319,8 @@ CHAMP_VALUE_T champ_get(const struct champ *champ, const CHAMP_KEY_T key, int *f
  * Returns a new map derived from champ but with key set to value.
  * If replaced is not NULL, sets it to indicate if the key is present in champ.
  *
- * Reference count of the new map is zero.
+ * Reference count of the new map is zero. If key is already set to the identical value, champ itself is returned
+ * instead, so don't destroy champ before comparing the result with it.
  *
  * @param champ
  * @param key
@@ -150,7 +333,7 @@ struct champ *champ_set(const struct champ *champ, const CHAMP_KEY_T key, const
 /**
  * Returns a new map derived from champ but without a mapping for key.
  *
- * Reference count of the new map is zero.
+ * Reference count of the new map is zero. If key is not present in champ, champ itself is returned instead.
  *
  * @param champ
  * @param key
@@ -179,7 +362,8 @@ struct champ *champ_of(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals), CHAMP_KEY
  * fn is passed the key, the current value for key, and user_data.
  * If key is not present in champ, NULL is passed in place of the key and current value.
  *
- * Reference count of the new map is zero.
+ * Reference count of the new map is zero. If fn returns the identical current value, champ itself is returned
+ * instead, so don't destroy champ before comparing the result with it.
  *
  * @param champ
  * @param key
@@ -189,11 +373,54 @@ struct champ *champ_of(CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals), CHAMP_KEY
  */
 struct champ *champ_assoc(const struct champ *champ, const CHAMP_KEY_T key, CHAMP_ASSOCFN_T(fn), const void *user_data);
 
+/**
+ * Returns a new map derived from champ, with every value replaced by the return value of fn. fn is passed each key, its
+ * current value, and user_data.
+ *
+ * The trie is walked once, and only nodes with a replaced value somewhere below them are copied. All other subtrees are
+ * shared with champ. If fn returns the identical value for every entry, champ itself is returned.
+ *
+ * @param champ
+ * @param fn
+ * @param user_data
+ * @return
+ */
+struct champ *champ_map_values(const struct champ *champ, CHAMP_MAPFN_T(fn), const void *user_data);
+
+/**
+ * Returns a new map derived from champ, containing only the entries for which pred returns non-zero. pred is passed
+ * each key, its value, and user_data.
+ *
+ * Like champ_map_values, only nodes with a removed entry somewhere below them are copied, and subtrees that are left
+ * with a single entry are inlined into their parents, just like champ_del would. If pred keeps every entry, champ
+ * itself is returned.
+ *
+ * @param champ
+ * @param pred
+ * @param user_data
+ * @return
+ */
+struct champ *champ_filter(const struct champ *champ, CHAMP_PREDFN_T(pred), const void *user_data);
+
+/**
+ * Like champ_filter, but removes the entries for which pred returns non-zero.
+ *
+ * @param champ
+ * @param pred
+ * @param user_data
+ * @return
+ */
+struct champ *champ_remove_if(const struct champ *champ, CHAMP_PREDFN_T(pred), const void *user_data);
+
 /**
  * Compares two maps for equality. A lot of short-circuiting is done on the assumption that unequal hashes
  * (for both keys and values) imply inequality. This is commonly known as the Java Hashcode contract: If two values
  * are equal, their hashes must be equal as well.
  *
+ * If both maps were created with the same value hash function, see champ_new_hashed, maps with different contents are
+ * usually rejected in constant time, and so are unequal subtrees. value_equals must agree with that hash function.
+ * Maps with different seeds, see champ_type.seed, are compared by looking up every entry of left in right.
+ *
  * @param left
  * @param right
  * @return
@@ -205,6 +432,8 @@ int champ_equals(const struct champ *left, const struct champ *right, CHAMP_VALU
  */
 struct champ_iter {
 	int stack_level;
+	int base_level;
+	uint32_t slot_filter;
 	unsigned element_cursor;
 	unsigned element_arity;
 	unsigned branch_cursor_stack[8];
@@ -232,6 +461,19 @@ struct champ_iter {
  */
 void champ_iter_init(struct champ_iter *iter, const struct champ *champ);
 
+/**
+ * Initializes an iterator that only visits the entries of champ whose key hash, see champ_key_hash, ends in the lowest
+ * bits bits of prefix.
+ * The iterator starts at the deepest node that covers the whole partition, and iterating over all 2^bits partitions
+ * visits every entry exactly once.
+ *
+ * @param iter
+ * @param champ
+ * @param prefix
+ * @param bits at most 32
+ */
+void champ_iter_init_prefix(struct champ_iter *iter, const struct champ *champ, uint32_t prefix, unsigned bits);
+
 /**
  * Advances iter and points key_receiver and value_receiver to the next pair.
  *
@@ -242,4 +484,399 @@ void champ_iter_init(struct champ_iter *iter, const struct champ *champ);
  */
 int champ_iter_next(struct champ_iter *iter, CHAMP_KEY_T *key_receiver, CHAMP_VALUE_T *value_receiver);
 
+/**
+ * Writes champ to fd as a snapshot that can later be opened with champ_open_snapshot. The snapshot is written from the
+ * start of the file, which is then truncated to the size of the snapshot.
+ *
+ * Keys and values are encoded with key_codec and value_codec. A codec gets a buffer of the given capacity and returns
+ * the number of bytes the encoding takes. If that is more than capacity, it is called again with a larger buffer. In
+ * the snapshot, keys and values then point to their encoding. If a codec is NULL, keys or values are stored as they
+ * are, which only makes sense if they are not pointers.
+ *
+ * @param champ
+ * @param fd
+ * @param key_codec may be NULL
+ * @param value_codec may be NULL
+ * @return 0 on success, -1 if writing failed
+ */
+int champ_write_snapshot(const struct champ *champ, int fd,
+			 CHAMP_KEY_ENCODEFN_T(key_codec), CHAMP_VALUE_ENCODEFN_T(value_codec));
+
+/**
+ * Maps a snapshot written by champ_write_snapshot into memory. Nothing is copied: nodes are read straight from the
+ * mapping, and keys and values written with a codec point into it. hash and equals must accept keys as encoded by
+ * the key codec, and value_hash values as encoded by the value codec.
+ *
+ * The node hashes in a snapshot include value hashes if the map it was written from had a value_hash, see
+ * champ_new_hashed. Such a snapshot must be opened with a value_hash that hashes values the same way, and any other
+ * snapshot without one, so that maps derived from it keep their hashes up to date.
+ *
+ * The returned map can be used like any other, and maps derived from it share its nodes. It must be closed with
+ * champ_close_snapshot instead of being destroyed or released, and not before all maps derived from it are gone.
+ *
+ * @param path
+ * @param hash
+ * @param equals
+ * @param value_hash may be NULL
+ * @return NULL if the file could not be mapped, is not a snapshot, or value_hash is given for a snapshot without
+ * value hashes or missing for one with them
+ */
+struct champ *champ_open_snapshot(const char *path, CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals),
+				  CHAMP_VALUE_HASHFN_T(value_hash));
+
+/**
+ * Like champ_open_snapshot, but for a snapshot image that is already in memory, for instance one compiled into the
+ * program's read-only data, see examples/static-map. Nodes, keys and values are read straight from the image, which
+ * is never written to, so a map known at build time costs neither hashing nor allocations at startup, apart from the
+ * map itself. The image must be aligned to 8 bytes and outlive the returned map, which must be closed with
+ * champ_close_snapshot.
+ *
+ * @param image the contents of a file written by champ_write_snapshot
+ * @param size of image in bytes
+ * @param hash
+ * @param equals
+ * @param value_hash may be NULL, see champ_open_snapshot
+ * @return NULL if image is not a snapshot, misaligned, or doesn't match value_hash
+ */
+struct champ *champ_open_snapshot_image(const void *image, size_t size, CHAMP_HASHFN_T(hash),
+					CHAMP_EQUALSFN_T(equals), CHAMP_VALUE_HASHFN_T(value_hash));
+
+/**
+ * Unmaps a snapshot opened with champ_open_snapshot or champ_open_snapshot_image and sets the reference to NULL.
+ *
+ * @param champ
+ */
+void champ_close_snapshot(struct champ **champ);
+
+/**
+ * An append-only file of map versions. Versions share nodes with each other, so committing a map only writes the nodes
+ * that aren't in the store yet. For this to pay off, keep working with the maps returned by champ_store_load, or maps
+ * derived from them, rather than with the maps that were committed.
+ *
+ * Maps loaded from a store can be released like any other map, but must not outlive the store.
+ */
+struct champ_store;
+
+/**
+ * Opens the store at path, creating it if it doesn't exist. Keys and values are encoded as with champ_write_snapshot,
+ * and a store must always be opened with the same kind of codecs it was created with. Likewise, a store created with
+ * a value_hash only holds maps whose node hashes include value hashes, and must always be opened with a value_hash
+ * that hashes values the same way, see champ_open_snapshot.
+ *
+ * @param path
+ * @param hash
+ * @param equals
+ * @param value_hash may be NULL
+ * @param key_codec may be NULL
+ * @param value_codec may be NULL
+ * @return NULL if the file could not be opened or was created with other codecs or without a matching value_hash
+ */
+struct champ_store *champ_store_open(const char *path, CHAMP_HASHFN_T(hash), CHAMP_EQUALSFN_T(equals),
+				     CHAMP_VALUE_HASHFN_T(value_hash), CHAMP_KEY_ENCODEFN_T(key_codec),
+				     CHAMP_VALUE_ENCODEFN_T(value_codec));
+
+/**
+ * Closes a store and sets the reference to NULL.
+ *
+ * @param store
+ */
+void champ_store_close(struct champ_store **store);
+
+/**
+ * Appends the nodes of champ that aren't in the store yet, followed by a record of the new version, and syncs the
+ * file. The cost is proportional to the number of nodes that changed since champ was loaded from the store.
+ *
+ * @param store
+ * @param champ
+ * @return the offset of the new record, or 0 if writing failed or champ has a value_hash and the store not, or vice
+ * versa
+ */
+uint64_t champ_store_commit(struct champ_store *store, const struct champ *champ);
+
+/**
+ * Returns a map of the version with the given record offset. Its nodes are read from the store in place.
+ *
+ * Reference count of the new map is zero.
+ *
+ * @param store
+ * @param record
+ * @return NULL if record is out of bounds
+ */
+struct champ *champ_store_load(const struct champ_store *store, uint64_t record);
+
+/**
+ * Returns the record offset of the most recently committed version, or 0 if the store is empty.
+ *
+ * @param store
+ * @return
+ */
+uint64_t champ_store_latest(const struct champ_store *store);
+
+/**
+ * Returns the record offset of the version committed before record, or 0 if there is none.
+ *
+ * @param store
+ * @param record
+ * @return
+ */
+uint64_t champ_store_previous(const struct champ_store *store, uint64_t record);
+
+/**
+ * Writes a new store to path that only contains the most recent versions, and thus only the nodes reachable from
+ * them. Record offsets are different in the new store. To replace a store, compact it to a temporary path and rename
+ * that over the original once the old store has been closed.
+ *
+ * @param store
+ * @param path
+ * @param versions the number of versions to keep
+ * @return 0 on success, -1 if writing failed
+ */
+int champ_store_compact(const struct champ_store *store, const char *path, unsigned versions);
+
+/**
+ * Answers the requests of a champ_sync_pull on the other end of fd_in and fd_out, which may be the same descriptor,
+ * until that side is done. Keys and values are encoded with key_codec and value_codec as in champ_write_snapshot, and
+ * sent as they are if a codec is NULL.
+ *
+ * @param champ the map the other side synchronizes to
+ * @param fd_in
+ * @param fd_out
+ * @param key_codec may be NULL
+ * @param value_codec may be NULL
+ * @return 0 once the other side is done, -1 if reading, writing or a request failed
+ */
+int champ_sync_serve(const struct champ *champ, int fd_in, int fd_out,
+		     CHAMP_KEY_ENCODEFN_T(key_codec), CHAMP_VALUE_ENCODEFN_T(value_codec));
+
+/**
+ * Returns a copy of the map served by champ_sync_serve on the other end of fd_in and fd_out, built on top of replica.
+ *
+ * The structural hash of every node serves as its digest. The trie is requested top-down, one node at a time, and a
+ * branch is only requested if its digest differs from that of the branch at the same position in replica. Everything
+ * else is shared with replica, so the traffic is proportional to the number of nodes on the paths to the differences.
+ * Digests only cover values if the maps have a value hash, see champ_new_hashed. Without one, nothing is shared.
+ *
+ * Keys and values are decoded with key_decode and value_decode, and taken as they are if NULL. Both sides must agree
+ * on that, and on the hash function, and run on machines with the same byte order. Decoded keys and values belong to
+ * the map, so use a type with ownership callbacks to have them freed, see champ_new_typed.
+ *
+ * The result has the seed of the served map, see champ_type.seed. If replica has another one, nothing is shared.
+ *
+ * @param replica the map to synchronize, with the same type as the result, except maybe for its seed
+ * @param fd_in
+ * @param fd_out
+ * @param key_decode may be NULL
+ * @param value_decode may be NULL
+ * @param nodes_received if not NULL, set to the number of nodes received
+ * @return NULL if reading or writing failed or the other side sent a malformed node, replica itself if it already was
+ * in sync, otherwise the new map
+ */
+struct champ *champ_sync_pull(const struct champ *replica, int fd_in, int fd_out,
+			      CHAMP_KEY_DECODEFN_T(key_decode), CHAMP_VALUE_DECODEFN_T(value_decode),
+			      unsigned long *nodes_received);
+
+/**
+ * Writes the changes between two versions of a map to fd, as a binary delta that champ_apply_delta applies. The tries
+ * are compared structurally, and subtrees both share are skipped, so the work and the size of the delta are
+ * proportional to the changes. Keys and values are encoded as with champ_sync_serve. Values are compared by identity.
+ * If from and to have different seeds, see champ_type.seed, every entry of each is looked up in the other one instead.
+ *
+ * Both maps must have a value hash, see champ_new_hashed: the delta carries the structural hash of from, and only then
+ * does that hash cover values, so that champ_apply_delta can tell a base with the same keys but other values apart.
+ *
+ * @param from the version the receiving side holds
+ * @param to
+ * @param fd
+ * @param key_codec may be NULL
+ * @param value_codec may be NULL
+ * @return 0 on success, -1 if writing failed or a map has no value hash
+ */
+int champ_encode_delta(const struct champ *from, const struct champ *to, int fd,
+		       CHAMP_KEY_ENCODEFN_T(key_codec), CHAMP_VALUE_ENCODEFN_T(value_codec));
+
+/**
+ * Reads a delta written by champ_encode_delta from fd and applies it to base, which must equal the version it was encoded
+ * against. Keys and values are decoded as with champ_sync_pull. Decoded keys and values the result doesn't
+ * keep, such as the keys of removed entries or everything decoded from a delta that turns out to be truncated or
+ * not to match base, are acquired and released once, so that a type with ownership callbacks frees them.
+ *
+ * @param base with a value hash, see champ_encode_delta
+ * @param fd
+ * @param key_decode may be NULL
+ * @param value_decode may be NULL
+ * @return NULL if reading failed, base has no value hash, or doesn't match the delta, base itself if the delta is
+ * empty, otherwise the new version
+ */
+struct champ *champ_apply_delta(const struct champ *base, int fd,
+				CHAMP_KEY_DECODEFN_T(key_decode), CHAMP_VALUE_DECODEFN_T(value_decode));
+
+/**
+ * Prints champ as JSON to stdout, formatting keys and values with the given printf formats.
+ *
+ * @param champ
+ * @param key_prefix format for keys
+ * @param value_prefix format for values
+ */
+void champ_repr(const struct champ *champ, const char *key_prefix, const char *value_prefix);
+
+/**
+ * Memory and shape statistics of a map, as reported by champ_stats.
+ */
+struct champ_stats {
+	unsigned long entries;
+	unsigned long nodes; // not counting collision nodes
+	unsigned long nodes_by_arity[33]; // indexed by the number of elements plus branches of a node
+	unsigned long nodes_by_depth[8]; // collision nodes are at depth 7
+	unsigned long entries_by_depth[8];
+	unsigned long collision_nodes;
+	unsigned long collision_entries;
+	unsigned max_collision_arity;
+	unsigned long chain_nodes; // nodes with a single branch and no elements, a sign of a clustering hash function
+	uint32_t seed; // of the map's type, not 0 if the map mixes its hashes, see champ_type.seed
+	unsigned long bytes; // of the map and all its heap-allocated nodes, not counting keys and values
+	unsigned long pinned_bytes; // of nodes that are never freed, such as those of snapshots and stores
+	double average_fill; // average fraction of the 32 slots of a node that are in use
+	double bytes_per_entry; // including pinned_bytes
+};
+
+/**
+ * Walks champ and fills stats. Nodes shared with other maps are counted in full.
+ *
+ * @param champ
+ * @param stats
+ */
+void champ_stats(const struct champ *champ, struct champ_stats *stats);
+
+/**
+ * Returns the number of bytes taken by nodes that are shared between left and right. Useful to see how much of a new
+ * version of a map is actually new.
+ *
+ * @param left
+ * @param right
+ * @return
+ */
+size_t champ_shared_bytes(const struct champ *left, const struct champ *right);
+
+/**
+ * The operations counted in builds with CHAMP_STATS defined, see champ_counters_read.
+ */
+#define CHAMP_COUNTERS(X) \
+	X(insert_element) \
+	X(update_element) \
+	X(remove_element) \
+	X(update_branch) \
+	X(pushdown) \
+	X(pullup) \
+	X(merge) \
+	X(collision_nodes) \
+	X(node_allocations) \
+	X(node_frees) \
+	X(node_acquires) \
+	X(node_releases) \
+	X(node_deferrals) \
+	X(champ_allocations) \
+	X(champ_frees) \
+	X(champ_acquires) \
+	X(champ_releases) \
+	X(reseeds)
+
+struct champ_counters {
+#define CHAMP_COUNTER_FIELD(name) unsigned long name;
+	CHAMP_COUNTERS(CHAMP_COUNTER_FIELD)
+#undef CHAMP_COUNTER_FIELD
+};
+
+/**
+ * Sums up the counters of all threads, including threads that have exited since. The counts of threads that are still
+ * running may be slightly behind.
+ *
+ * If champ.c was compiled without CHAMP_STATS, all counters are zero.
+ *
+ * @param counters
+ */
+void champ_counters_read(struct champ_counters *counters);
+
+/**
+ * Sets the counters of all threads to zero.
+ */
+void champ_counters_reset(void);
+
+/**
+ * Switches between destroying dead nodes right away, which is the default, and deferring it to champ_reclaim.
+ *
+ * Destroying a map frees all of its nodes that no other map shares, on the thread that drops the last reference. For
+ * a large map, that may take a long time. With reclamation deferred, releasing a map only pushes the nodes it held
+ * directly onto a list, and the rest is freed by whoever calls champ_reclaim, typically a background thread.
+ *
+ * Nodes that were deferred before reclamation is switched back are still only freed by champ_reclaim.
+ *
+ * @param deferred
+ */
+void champ_defer_reclamation(int deferred);
+
+/**
+ * Frees up to budget deferred nodes. Each node freed may add its own dead branches to the list, so the whole subtree
+ * of a released map is freed over as many calls as it takes. Only one thread reclaims at a time; calls made while
+ * another thread is reclaiming return 0 right away.
+ *
+ * @param budget the maximum number of nodes to free, e.g. SIZE_MAX to drain the list
+ * @return the number of nodes freed
+ */
+size_t champ_reclaim(size_t budget);
+
+/**
+ * @return the number of deferred nodes not yet freed
+ */
+unsigned long champ_reclaim_pending(void);
+
+#define CHAMP_FREEZE_HUGE_PAGES 0x1
+
+/**
+ * Copies champ into a single contiguous allocation, with every node placed right before its subtrees, so that
+ * lookups touch as few cache lines and pages as possible. With CHAMP_FREEZE_HUGE_PAGES, the allocation is backed by
+ * transparent huge pages where available.
+ *
+ * The frozen nodes are immortal: they are never reference counted nor freed, even after the frozen map and all maps
+ * derived from it have been released. This is meant for long-lived, read-mostly maps. Maps derived from a frozen map
+ * share its nodes and only copy the paths they change to the heap.
+ *
+ * Reference count of the new map is zero.
+ *
+ * @param champ
+ * @param flags 0 or CHAMP_FREEZE_HUGE_PAGES
+ * @return NULL if the allocation failed
+ */
+struct champ *champ_freeze(const struct champ *champ, int flags);
+
+/**
+ * Returns a map with the same entries as champ, whose nodes are shared with every map interned before wherever their
+ * subtrees are the same. Subtrees are the same if they hold the same key and value pointers in the same places and
+ * belong to maps of the same type. Maps built independently from the same keys and values thus end up sharing most of
+ * their nodes, and champ_equals, champ_shared_bytes and champ_encode_delta find them shared without looking inside.
+ *
+ * The intern table holds a reference to every node it hands out, until champ_intern_collect. Nodes of snapshots,
+ * stores and frozen maps are left as they are.
+ *
+ * Reference count of the new map is zero. If champ already was interned, champ itself is returned.
+ *
+ * @param champ
+ * @return
+ */
+struct champ *champ_intern(const struct champ *champ);
+
+/**
+ * Drops the nodes from the intern table that no map refers to anymore, and frees them. With reclamation deferred, see
+ * champ_defer_reclamation, their subtrees only become collectable once the nodes have been reclaimed.
+ *
+ * @return the number of nodes dropped
+ */
+size_t champ_intern_collect(void);
+
+/**
+ * Returns the number of nodes in the intern table.
+ *
+ * @return
+ */
+size_t champ_interned_nodes(void);
+
 #endif //CHAMP_CHAMP_H
@@ -0,0 +1,145 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Samuel Vogelsanger <vogelsangersamuel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "chunk_list.h"
+
+/*
+ * The number of elements a handle can see is stored in the low bits of the handle itself, which is why chunks are
+ * aligned to (1 << CHUNK_LIST_TAG_BITS) bytes and hold one element less than that.
+ */
+#define CHUNK_LIST_TAG_BITS 4u
+#define CHUNK_LIST_CAPACITY ((1u << CHUNK_LIST_TAG_BITS) - 1)
+#define CHUNK_LIST_ALIGNMENT (1u << CHUNK_LIST_TAG_BITS)
+
+#define CHUNK(list) ((struct chunk *)((uintptr_t)(list) & ~(uintptr_t)CHUNK_LIST_CAPACITY))
+#define COUNT(list) ((unsigned)((uintptr_t)(list) & (uintptr_t)CHUNK_LIST_CAPACITY))
+#define HANDLE(chunk, count) ((struct chunk_list *)((uintptr_t)(chunk) | (uintptr_t)(count)))
+
+struct chunk {
+	struct chunk_list *tail;
+	unsigned tail_length;
+	unsigned ref_count;
+	unsigned used; // number of slots claimed so far, only ever grows
+	void *elements[CHUNK_LIST_CAPACITY];
+};
+
+static _Alignas(CHUNK_LIST_ALIGNMENT) struct chunk static_instance = {
+	.tail = (struct chunk_list *)&static_instance,
+	.tail_length = 0,
+	.ref_count = 1,
+	.used = CHUNK_LIST_CAPACITY, // never append in place to the empty list
+};
+
+struct chunk_list *empty_chunk_list = (struct chunk_list *)&static_instance;
+
+static struct chunk_list *create(const struct chunk_list *tail, void *head)
+{
+	const size_t size = (sizeof(struct chunk) + CHUNK_LIST_ALIGNMENT - 1) & ~(size_t)(CHUNK_LIST_ALIGNMENT - 1);
+	struct chunk *ret = aligned_alloc(CHUNK_LIST_ALIGNMENT, size);
+	ret->tail = (struct chunk_list *)tail;
+	ret->tail_length = chunk_list_length(tail);
+	ret->ref_count = 0;
+	ret->used = 1;
+	ret->elements[0] = head;
+	return HANDLE(ret, 1);
+}
+
+struct chunk_list *chunk_list_push(const struct chunk_list *list, void *element)
+{
+	struct chunk *chunk = CHUNK(list);
+	unsigned count = COUNT(list);
+
+	// claim the slot right after the last element this handle sees, unless another version already did
+	if (count < CHUNK_LIST_CAPACITY && atomic_compare_exchange_strong(&chunk->used, &count, count + 1)) {
+		chunk->elements[count] = element;
+		return HANDLE(chunk, count + 1);
+	}
+
+	return create(chunk_list_acquire(list), element);
+}
+
+struct chunk_list *chunk_list_pop(const struct chunk_list *list, void **receiver)
+{
+	const struct chunk *chunk = CHUNK(list);
+	const unsigned count = COUNT(list);
+
+	if (count == 0) {
+		*receiver = NULL;
+		return (struct chunk_list *)list;
+	}
+
+	*receiver = chunk->elements[count - 1];
+	return count == 1 ? chunk->tail : HANDLE(chunk, count - 1);
+}
+
+void *chunk_list_peek(const struct chunk_list *list)
+{
+	const unsigned count = COUNT(list);
+	return count ? CHUNK(list)->elements[count - 1] : NULL;
+}
+
+unsigned chunk_list_length(const struct chunk_list *list)
+{
+	return CHUNK(list)->tail_length + COUNT(list);
+}
+
+struct chunk_list *chunk_list_reverse(const struct chunk_list *list)
+{
+	struct chunk_list *ret = empty_chunk_list;
+	while (list != empty_chunk_list) {
+		const struct chunk *chunk = CHUNK(list);
+		for (unsigned i = COUNT(list); i-- > 0;) {
+			ret = chunk_list_push(ret, chunk->elements[i]);
+		}
+		list = chunk->tail;
+	}
+	return ret;
+}
+
+struct chunk_list *chunk_list_acquire(const struct chunk_list *list)
+{
+	if (list == empty_chunk_list)
+		return (struct chunk_list *)list;
+	atomic_fetch_add(&CHUNK(list)->ref_count, 1u);
+	return (struct chunk_list *)list;
+}
+
+void chunk_list_release(struct chunk_list **list)
+{
+	struct chunk_list *current = *list;
+	*list = NULL;
+	tail_call:
+	if (current == empty_chunk_list) {
+		return;
+	} else if (atomic_fetch_sub(&CHUNK(current)->ref_count, 1u) == 1u) {
+		struct chunk_list *tail = CHUNK(current)->tail;
+		free(CHUNK(current));
+		current = tail;
+		goto tail_call;
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Samuel Vogelsanger <vogelsangersamuel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CHAMP_CHUNK_LIST_H
+#define CHAMP_CHUNK_LIST_H
+
+/*
+ * An unrolled variant of list.h. Every chunk holds up to CHUNK_LIST_CAPACITY elements, so pushing n elements
+ * allocates roughly n / CHUNK_LIST_CAPACITY chunks instead of n cells.
+ *
+ * A handle is a chunk together with the number of elements of that chunk it can see. Pushing onto a handle that sees
+ * every element written to its chunk so far claims the next free slot in place and returns a handle that sees one
+ * more element. Pushing onto any other handle, or onto a full chunk, starts a new chunk that shares the old one as its
+ * tail. Older handles never see slots claimed after them, so all versions stay immutable.
+ *
+ * Handles returned by chunk_list_push may share their chunk with the list that was passed in. Acquire the result
+ * before releasing the original list.
+ */
+
+struct chunk_list;
+
+extern struct chunk_list *empty_chunk_list;
+
+/**
+ * must be acquired
+ * @param list
+ * @param element
+ * @return
+ */
+struct chunk_list *chunk_list_push(const struct chunk_list *list, void *element);
+
+/**
+ * must be acquired
+ * @param list
+ * @param receiver
+ * @return
+ */
+struct chunk_list *chunk_list_pop(const struct chunk_list *list, void **receiver);
+
+void *chunk_list_peek(const struct chunk_list *list);
+
+unsigned chunk_list_length(const struct chunk_list *list);
+
+/**
+ * must be acquired
+ * @param list
+ * @return
+ */
+struct chunk_list *chunk_list_reverse(const struct chunk_list *list);
+
+struct chunk_list *chunk_list_acquire(const struct chunk_list *list);
+
+void chunk_list_release(struct chunk_list **list);
+
+#endif //CHAMP_CHUNK_LIST_H
@@ -0,0 +1,129 @@
+//
+// Sends a version of a map that differs from the previous one in a few entries over a socketpair, once as a delta
+// against the previous version and once as a delta against the empty map, i.e. as a full dump. Reports the size of
+// both and the time from the start of encoding to the end of applying.
+//
+// build: cc -O2 -I../.. bench.c ../../champ.c ../../champ_fns.c -o bench -lpthread
+// usage: bench <entries> <changes>
+//
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "champ.h"
+
+static uint32_t hash_int(const void *key)
+{
+	uint32_t h = (uint32_t)(uintptr_t)key;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static int equals_int(const void *left, const void *right)
+{
+	return left == right;
+}
+
+static uint32_t value_hash_int(const void *value)
+{
+	return hash_int(value);
+}
+
+static unsigned long nsecs_since(const struct timespec *a)
+{
+	struct timespec b;
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	return (unsigned long)(b.tv_sec - a->tv_sec) * 1000000000ul + (unsigned long)b.tv_nsec - (unsigned long)a->tv_nsec;
+}
+
+struct encoder {
+	const struct champ *from;
+	const struct champ *to;
+	int fd;
+};
+
+static void *encode(void *arg)
+{
+	const struct encoder *encoder = arg;
+	champ_encode_delta(encoder->from, encoder->to, encoder->fd, NULL, NULL);
+	return NULL;
+}
+
+static void round_trip(const char *name, const struct champ *from, const struct champ *to)
+{
+	FILE *sink = tmpfile();
+	champ_encode_delta(from, to, fileno(sink), NULL, NULL);
+	const long bytes = (long)lseek(fileno(sink), 0, SEEK_END);
+	fclose(sink);
+
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct encoder encoder = {from, to, pair[0]};
+	pthread_t thread;
+	pthread_create(&thread, NULL, encode, &encoder);
+	struct champ *applied = champ_apply_delta(from, pair[1], NULL, NULL);
+	pthread_join(thread, NULL);
+	const double usecs = nsecs_since(&start) / 1000.;
+
+	printf("  %-6s %12ld bytes %12.1f us %s\n", name, bytes, usecs,
+	       applied && champ_hash(applied) == champ_hash(to) ? "ok" : "MISMATCH");
+	if (applied && applied != from)
+		champ_destroy(&applied);
+	close(pair[0]);
+	close(pair[1]);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned n, changes;
+	if (argc != 3 || sscanf(argv[1], "%u", &n) != 1 || sscanf(argv[2], "%u", &changes) != 1 || n == 0) {
+		fprintf(stderr, "usage: bench <entries> <changes>\n");
+		return 1;
+	}
+
+	struct champ *empty = champ_new_hashed(hash_int, equals_int, value_hash_int);
+	struct champ *old = empty;
+	for (uintptr_t i = 1; i <= n; ++i) {
+		struct champ *tmp = champ_set(old, (void *)i, (void *)i, NULL);
+		if (old != empty)
+			champ_destroy(&old);
+		old = tmp;
+	}
+
+	struct champ *new = old;
+	uint32_t x = 2463534242u;
+	for (unsigned i = 0; i < changes; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		struct champ *tmp = champ_set(new, (void *)(uintptr_t)(x % n + 1), (void *)(uintptr_t)x, NULL);
+		if (new != old && tmp != new)
+			champ_destroy(&new);
+		new = tmp;
+	}
+
+	printf("%u entries, %u changes\n", n, changes);
+	round_trip("delta", old, new);
+	round_trip("full", empty, new);
+
+	if (new != old)
+		champ_destroy(&new);
+	champ_destroy(&old);
+	champ_destroy(&empty);
+	return 0;
+}
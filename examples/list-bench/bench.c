@@ -0,0 +1,164 @@
+//
+// Compares list.h and chunk_list.h: allocations and time for building, traversing, reversing and releasing a list.
+// For list.h, reversal is deferred until the first pop, so the reverse phase includes that pop.
+//
+// build: cc -O2 -I../.. bench.c ../../list.c ../../chunk_list.c -o bench
+// usage: bench <elements>
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "list.h"
+#include "chunk_list.h"
+
+/*
+ * Counting wrappers around the glibc allocator. Only allocations made while <counting> is set are recorded.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static int counting = 0;
+static unsigned long allocations = 0;
+static unsigned long frees = 0;
+
+void *malloc(size_t size)
+{
+	allocations += counting;
+	return __libc_malloc(size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	allocations += counting;
+	return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr)
+{
+	frees += counting && ptr;
+	__libc_free(ptr);
+}
+
+static unsigned long nsecs_since(const struct timespec *a)
+{
+	struct timespec b;
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	return (unsigned long)(b.tv_sec - a->tv_sec) * 1000000000ul + (unsigned long)b.tv_nsec - (unsigned long)a->tv_nsec;
+}
+
+#define PHASE(name, block) do { \
+	struct timespec start; \
+	allocations = frees = 0; \
+	counting = 1; \
+	clock_gettime(CLOCK_MONOTONIC, &start); \
+	block \
+	unsigned long nsecs = nsecs_since(&start); \
+	counting = 0; \
+	printf("  %-10s %10.3f ms %10lu allocs %10lu frees\n", name, nsecs / 1000000., allocations, frees); \
+} while (0)
+
+static void bench_list(unsigned n)
+{
+	struct list *list = empty_list;
+	uintptr_t sum = 0;
+
+	printf("list.h\n");
+	PHASE("push", {
+		for (uintptr_t i = 0; i < n; ++i) {
+			struct list *tmp = list_acquire(list_push(list, (void *)i));
+			list_release(&list);
+			list = tmp;
+		}
+	});
+	PHASE("traverse", {
+		const struct list *current = list;
+		for (unsigned i = list_length(list); i > 0; --i) {
+			void *element;
+			current = list_pop(current, &element);
+			sum += (uintptr_t)element;
+		}
+	});
+	struct list *reversed;
+	PHASE("reverse", {
+		reversed = list_acquire(list_reverse(list));
+		void *element;
+		list_pop(reversed, &element);
+	});
+	PHASE("release", {
+		list_release(&list);
+		list_release(&reversed);
+	});
+
+	void **elements = malloc(n * sizeof *elements);
+	for (uintptr_t i = 0; i < n; ++i) {
+		elements[i] = (void *)i;
+	}
+	PHASE("from array", {
+		list = list_acquire(list_from_array(elements, n));
+	});
+	PHASE("traverse", {
+		const struct list *current = list;
+		for (unsigned i = list_length(list); i > 0; --i) {
+			void *element;
+			current = list_pop(current, &element);
+			sum += (uintptr_t)element;
+		}
+	});
+	PHASE("release", {
+		list_release(&list);
+	});
+	free(elements);
+	printf("  checksum %lu\n", (unsigned long)sum);
+}
+
+static void bench_chunk_list(unsigned n)
+{
+	struct chunk_list *list = empty_chunk_list;
+	uintptr_t sum = 0;
+
+	printf("chunk_list.h\n");
+	PHASE("push", {
+		for (uintptr_t i = 0; i < n; ++i) {
+			struct chunk_list *tmp = chunk_list_acquire(chunk_list_push(list, (void *)i));
+			chunk_list_release(&list);
+			list = tmp;
+		}
+	});
+	PHASE("traverse", {
+		const struct chunk_list *current = list;
+		for (unsigned i = chunk_list_length(list); i > 0; --i) {
+			void *element;
+			current = chunk_list_pop(current, &element);
+			sum += (uintptr_t)element;
+		}
+	});
+	struct chunk_list *reversed;
+	PHASE("reverse", {
+		reversed = chunk_list_acquire(chunk_list_reverse(list));
+		void *element;
+		chunk_list_pop(reversed, &element);
+	});
+	PHASE("release", {
+		chunk_list_release(&list);
+		chunk_list_release(&reversed);
+	});
+	printf("  checksum %lu\n", (unsigned long)sum);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned n;
+	if (argc != 2 || sscanf(argv[1], "%u", &n) != 1) {
+		fprintf(stderr, "usage: bench <elements>\n");
+		return 1;
+	}
+
+	bench_list(n);
+	bench_chunk_list(n);
+	return 0;
+}
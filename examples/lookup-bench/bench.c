@@ -0,0 +1,95 @@
+//
+// Measures champ_get on maps of integer keys, in ns per lookup and ns per trie level visited. Keys are hashed with a
+// cheap integer mix so that the cost of walking the trie dominates.
+//
+// Compare the portable popcount with the hardware one by building twice:
+// build: cc -O2 -I../.. bench.c ../../champ.c ../../champ_fns.c -o bench
+// build: cc -O2 -march=native -I../.. bench.c ../../champ.c ../../champ_fns.c -o bench-native
+// usage: bench <entries> <lookups>
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "champ.h"
+
+static uint32_t hash_int(const void *key)
+{
+	uint32_t h = (uint32_t)(uintptr_t)key;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static int equals_int(const void *left, const void *right)
+{
+	return left == right;
+}
+
+static unsigned long nsecs_since(const struct timespec *a)
+{
+	struct timespec b;
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	return (unsigned long)(b.tv_sec - a->tv_sec) * 1000000000ul + (unsigned long)b.tv_nsec - (unsigned long)a->tv_nsec;
+}
+
+static void bench(unsigned n, unsigned lookups)
+{
+	struct champ *map = champ_new(hash_int, equals_int);
+	for (uintptr_t i = 1; i <= n; ++i) {
+		struct champ *tmp = champ_set(map, (void *)i, (void *)i, NULL);
+		if (tmp != map)
+			champ_destroy(&map);
+		map = tmp;
+	}
+
+	// an entry at depth d takes d + 1 levels to find
+	struct champ_stats stats;
+	champ_stats(map, &stats);
+	double levels = 0;
+	for (unsigned depth = 0; depth < 8; ++depth) {
+		levels += (double)stats.entries_by_depth[depth] * (depth + 1);
+	}
+	levels /= n;
+
+	uint32_t x = 2463534242u;
+	uintptr_t sum = 0;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned i = 0; i < lookups; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		sum += (uintptr_t)champ_get(map, (void *)(uintptr_t)(x % n + 1), NULL);
+	}
+	double nsecs = (double)nsecs_since(&start) / lookups;
+
+	printf("%10u entries %6.2f levels %8.2f ns/lookup %6.2f ns/level (checksum %lu)\n",
+	       n, levels, nsecs, nsecs / levels, (unsigned long)sum);
+	champ_destroy(&map);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned n, lookups;
+	if (argc != 3 || sscanf(argv[1], "%u", &n) != 1 || sscanf(argv[2], "%u", &lookups) != 1 || n == 0) {
+		fprintf(stderr, "usage: bench <entries> <lookups>\n");
+		return 1;
+	}
+
+#ifdef __POPCNT__
+	printf("hardware popcount\n");
+#else
+	printf("portable popcount\n");
+#endif
+	for (unsigned entries = 8; entries < n; entries *= 8) {
+		bench(entries, lookups);
+	}
+	bench(n, lookups);
+	return 0;
+}
@@ -21,8 +21,9 @@ static void do_n_lookups(struct champ *map, unsigned n, unsigned seed)
 {
 	unsigned length = champ_length(map);
 	for (unsigned i = 0; length > 0 && i < n && i < length; ++i) {
-		unsigned index = RANDRANGE(1u, length, &seed);
-		champ_get(map, &index, NULL);
+		CHAMP_KEY_T key;
+		champ_nth(map, RANDRANGE(0u, length - 1, &seed), &key, NULL);
+		champ_get(map, key, NULL);
 	}
 }
 
@@ -41,9 +42,6 @@ struct code_snippet *consume_next(struct consumer_context *ctx, struct user_stor
 	csp->next = ctx->pool;
 	while (!atomic_compare_exchange_strong(&ctx->pool, &csp->next, csp));
 
-	champ_release(&user_stories);
-	champ_release(&code_snippets);
-
 	return &csp->code_snippet;
 }
 
@@ -21,6 +21,11 @@ struct code_snippet {
 	char *code;
 };
 
+/**
+ * Produces the code snippet for next, looking around in user_stories and code_snippets. Both maps are only borrowed:
+ * they typically come from an atom_cache_deref, so consume_next neither acquires nor releases them, and must not keep
+ * them beyond its return, as the next atom_cache_deref on the same cache may release them.
+ */
 struct code_snippet *consume_next(struct consumer_context *ctx, struct user_story *next, struct champ *user_stories, struct champ *code_snippets);
 
 void consumer_destroy(struct consumer_context *ctx);
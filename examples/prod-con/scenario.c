@@ -6,8 +6,11 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
 #include <time.h>
 
+#include "histogram.h"
 #include "queue.h"
 #include "stm_rc.h"
 #include "champ.h"
@@ -65,6 +68,14 @@ struct thread_ret {
 	unsigned long nsecs_total;
 };
 
+static struct histogram produce_next_latency;
+static struct histogram consume_next_latency;
+
+static unsigned long nsecs_between(const struct timespec *a, const struct timespec *b)
+{
+	return (unsigned long)(b->tv_sec - a->tv_sec) * 1000000000ul + (unsigned long)b->tv_nsec - (unsigned long)a->tv_nsec;
+}
+
 struct producer_args {
 	struct atom *user_stories;
 	struct atom *tasks;
@@ -108,15 +119,14 @@ void *produce(union producer_thread_context *_arg)
 		struct user_story *next;
 
 		struct timespec a, b;
-		clock_gettime(CLOCK_REALTIME, &a);
+		clock_gettime(CLOCK_MONOTONIC, &a);
 
 		if ((next = produce_next(ctx, atom_deref(user_stories))) == NULL)
 			break;
 
-		clock_gettime(CLOCK_REALTIME, &b);
-		unsigned d = b.tv_sec == a.tv_sec ?
-			b.tv_nsec - a.tv_nsec :
-			b.tv_nsec - (a.tv_nsec - 1000000000);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		unsigned long d = nsecs_between(&a, &b);
+		histogram_record(&produce_next_latency, d);
 		nsecs_total += d;
 		++inserts;
 
@@ -223,18 +233,25 @@ void *consume(union consumer_thread_context *_arg)
 	unsigned long consumes = 0;
 	unsigned long nsecs_total = 0;
 
+	// the maps change far less often than they are read, so only take a reference when they do
+	struct atom_cache user_stories_cache, code_snippets_cache;
+	atom_cache_init(&user_stories_cache, user_stories);
+	atom_cache_init(&code_snippets_cache, code_snippets);
+
 	while (1) {
 		struct user_story *next;
 		if ((next = try_dequeue(tasks)) == NULL)
 			break;
 
 		struct timespec a, b;
-		clock_gettime(CLOCK_REALTIME, &a);
+		clock_gettime(CLOCK_MONOTONIC, &a);
 
-		struct code_snippet *code_snippet = consume_next(ctx, next, atom_deref(user_stories), atom_deref(code_snippets));
+		struct code_snippet *code_snippet = consume_next(ctx, next, atom_cache_deref(&user_stories_cache),
+			atom_cache_deref(&code_snippets_cache));
 
-		clock_gettime(CLOCK_REALTIME, &b);
-		unsigned d = b.tv_nsec - (a.tv_nsec - (1000000000 * (b.tv_sec - a.tv_sec)));
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		unsigned long d = nsecs_between(&a, &b);
+		histogram_record(&consume_next_latency, d);
 		nsecs_total += d;
 		++consumes;
 
@@ -249,7 +266,8 @@ void *consume(union consumer_thread_context *_arg)
 		struct champ *cs = atom_swap(code_snippets, (atom_compute_fn)champ_assoc_va, &assoc_args);
 		champ_release(&cs);
 	}
-
+	atom_cache_cleanup(&user_stories_cache);
+	atom_cache_cleanup(&code_snippets_cache);
 
 	_arg->ret.count = consumes;
 	_arg->ret.nsecs_total = nsecs_total;
@@ -270,13 +288,71 @@ void *consume(union consumer_thread_context *_arg)
 
 
 
+static void print_atom_stats(const struct atom *atom, const char *name)
+{
+	static struct atom_stats stats;
+	char label[64];
+	if (!atom_stats_read(atom, &stats))
+		return;
+
+	printf("%s: swaps %lu, elided %lu, retries %lu, cache hits %lu, cache misses %lu\n",
+	       name, stats.swaps, stats.elided, stats.retries, stats.cache_hits, stats.cache_misses);
+	snprintf(label, sizeof label, "%s atom_deref", name);
+	histogram_print(&stats.deref, label);
+	snprintf(label, sizeof label, "%s lock wait", name);
+	histogram_print(&stats.lock_wait, label);
+	snprintf(label, sizeof label, "%s atom_swap", name);
+	histogram_print(&stats.swap, label);
+}
+
+static size_t champ_unshared_bytes(atom_ref older, atom_ref newer)
+{
+	struct champ_stats stats;
+	champ_stats(older, &stats);
+	return stats.bytes - champ_shared_bytes(older, newer);
+}
+
+static void print_atom_history(struct atom *atom, const char *name)
+{
+	size_t versions;
+	const size_t bytes = atom_history_bytes(atom, champ_unshared_bytes, &versions);
+	struct champ *current = atom_deref(atom);
+	struct champ_stats stats;
+	champ_stats(current, &stats);
+	printf("%s history: %zu versions, %zu bytes on top of the current %lu bytes\n",
+	       name, versions, bytes, stats.bytes);
+	champ_release(&current);
+
+	struct champ *oldest = atom_deref_at(atom, atom->version - (versions - 1));
+	if (oldest) {
+		printf("%s %zu versions ago: %u entries\n", name, versions - 1, champ_length(oldest));
+		champ_release(&oldest);
+	}
+}
+
+// frees deferred champ nodes in small slices until told to stop, so that no consumer has to free a whole map
+static atomic_int reclaimer_stop = 0;
+
+static void *reclaim(void *arg)
+{
+	(void)arg;
+	const struct timespec pause = {.tv_sec = 0, .tv_nsec = 100000};
+	while (!atomic_load(&reclaimer_stop)) {
+		if (champ_reclaim(1024) == 0)
+			nanosleep(&pause, NULL);
+	}
+	champ_reclaim(SIZE_MAX);
+	return NULL;
+}
+
 int main(int argc, char **argv)
 {
-	if (argc != 3) {
+	if (argc != 3 && !(argc == 4 && strcmp(argv[3], "deferred") == 0)) {
 		exit:
-		fprintf(stderr, "usage: scenario <threads> <user stories>");
+		fprintf(stderr, "usage: scenario <threads> <user stories> [deferred]");
 		return 1;
 	}
+	const int deferred = argc == 4;
 
 	int consumers_count;
 	unsigned us_count;
@@ -290,6 +366,8 @@ int main(int argc, char **argv)
 	}
 
 	srand(1);
+	histogram_init(&produce_next_latency);
+	histogram_init(&consume_next_latency);
 
 	struct atom user_stories;
 	atom_init(
@@ -315,6 +393,11 @@ int main(int argc, char **argv)
 		(atom_ref_release)champ_release
 	);
 
+	atom_enable_stats(&user_stories);
+	atom_enable_stats(&tasks);
+	atom_enable_stats(&code_snippets);
+	atom_enable_history(&user_stories, 64);
+
 	struct producer_context p_ctx = PRODUCER_CONTEXT_INITIALIZER;
 	p_ctx.total = us_count;
 
@@ -333,6 +416,12 @@ int main(int argc, char **argv)
 		.consumer_context = &c_ctx,
 	};
 
+	pthread_t reclaimer;
+	if (deferred) {
+		champ_defer_reclamation(1);
+		pthread_create(&reclaimer, NULL, reclaim, NULL);
+	}
+
 	union consumer_thread_context cctx[consumers_count];
 	pthread_t consumers[consumers_count];
 	for (int i = 0; i < consumers_count; ++i) {
@@ -359,6 +448,12 @@ int main(int argc, char **argv)
 		consume_next_total_time += ret->nsecs_total;
 	}
 
+	if (deferred) {
+		atomic_store(&reclaimer_stop, 1);
+		pthread_join(reclaimer, NULL);
+		champ_defer_reclamation(0);
+	}
+
 	printf("user story updates pushed: %lu\n", us_produced);
 	printf("user story jobs pulled: %lu\n", us_consumed);
 
@@ -377,6 +472,22 @@ int main(int argc, char **argv)
 	if (us_consumed)
 		printf("microseconds per consume_next: %.3f\n", (consume_next_total_time / us_consumed) / 1000.);
 
+	printf("latencies in nanoseconds:\n");
+	histogram_print(&produce_next_latency, "produce_next");
+	histogram_print(&consume_next_latency, "consume_next");
+	print_atom_stats(&user_stories, "user_stories");
+	print_atom_stats(&tasks, "tasks");
+	print_atom_stats(&code_snippets, "code_snippets");
+	print_atom_history(&user_stories, "user_stories");
+
+#ifdef CHAMP_STATS
+	struct champ_counters counters;
+	champ_counters_read(&counters);
+#define PRINT_COUNTER(name) printf("champ %s: %lu\n", #name, counters.name);
+	CHAMP_COUNTERS(PRINT_COUNTER)
+#undef PRINT_COUNTER
+#endif
+
 //	if (total_consume > 20u * us_consumed)
 //		printf("total_consume: %u", consume_next_total_time);
 
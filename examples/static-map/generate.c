@@ -0,0 +1,91 @@
+//
+// Generates C source for a map known at build time: the map is built once, written as a snapshot and printed as an
+// aligned byte array, which champ_open_snapshot_image then reads straight from the program's read-only data. As
+// snapshots store pointers as relative offsets, the array needs no relocations either.
+//
+// The map here holds HTTP status codes and their reason phrases, keyed by the code as a decimal string. Both are
+// encoded into the snapshot by copying their characters.
+//
+// build: cc -O2 -I../.. generate.c ../../champ.c ../../champ_fns.c -o generate
+// usage: generate > status_table.c
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "champ.h"
+#include "champ_fns.h"
+
+static const char *statuses[][2] = {
+	{"100", "Continue"}, {"101", "Switching Protocols"}, {"200", "OK"}, {"201", "Created"}, {"202", "Accepted"},
+	{"203", "Non-Authoritative Information"}, {"204", "No Content"}, {"205", "Reset Content"},
+	{"206", "Partial Content"}, {"300", "Multiple Choices"}, {"301", "Moved Permanently"}, {"302", "Found"},
+	{"303", "See Other"}, {"304", "Not Modified"}, {"307", "Temporary Redirect"}, {"308", "Permanent Redirect"},
+	{"400", "Bad Request"}, {"401", "Unauthorized"}, {"402", "Payment Required"}, {"403", "Forbidden"},
+	{"404", "Not Found"}, {"405", "Method Not Allowed"}, {"406", "Not Acceptable"},
+	{"407", "Proxy Authentication Required"}, {"408", "Request Timeout"}, {"409", "Conflict"}, {"410", "Gone"},
+	{"411", "Length Required"}, {"412", "Precondition Failed"}, {"413", "Content Too Large"},
+	{"414", "URI Too Long"}, {"415", "Unsupported Media Type"}, {"416", "Range Not Satisfiable"},
+	{"417", "Expectation Failed"}, {"421", "Misdirected Request"}, {"422", "Unprocessable Content"},
+	{"426", "Upgrade Required"}, {"428", "Precondition Required"}, {"429", "Too Many Requests"},
+	{"431", "Request Header Fields Too Large"}, {"451", "Unavailable For Legal Reasons"},
+	{"500", "Internal Server Error"}, {"501", "Not Implemented"}, {"502", "Bad Gateway"},
+	{"503", "Service Unavailable"}, {"504", "Gateway Timeout"}, {"505", "HTTP Version Not Supported"},
+	{"511", "Network Authentication Required"},
+};
+
+CHAMP_MAKE_HASHFN(hash_str, key)
+{
+	return champ_hash_str(key);
+}
+
+CHAMP_MAKE_EQUALSFN(equals_str, left, right)
+{
+	return champ_equals_str(left, right);
+}
+
+CHAMP_MAKE_KEY_ENCODEFN(encode_str, key, buffer, capacity)
+{
+	size_t size = strlen(key) + 1;
+	if (size <= capacity)
+		memcpy(buffer, key, size);
+	return size;
+}
+
+CHAMP_MAKE_VALUE_ENCODEFN(encode_value_str, value, buffer, capacity)
+{
+	return encode_str(value, buffer, capacity);
+}
+
+int main(void)
+{
+	const size_t count = sizeof statuses / sizeof *statuses;
+	void *keys[count], *values[count];
+	for (size_t i = 0; i < count; ++i) {
+		keys[i] = (void *)statuses[i][0];
+		values[i] = (void *)statuses[i][1];
+	}
+	struct champ *map = champ_of(hash_str, equals_str, keys, values, count);
+
+	FILE *snapshot = tmpfile();
+	if (!snapshot || champ_write_snapshot(map, fileno(snapshot), encode_str, encode_value_str)) {
+		fprintf(stderr, "could not write snapshot\n");
+		return 1;
+	}
+	champ_destroy(&map);
+
+	printf("// generated by examples/static-map/generate.c, do not edit\n\n");
+	printf("#include <stddef.h>\n\n");
+	printf("_Alignas(8) const unsigned char status_table[] = {");
+	size_t size = 0;
+	int c;
+	rewind(snapshot);
+	while ((c = fgetc(snapshot)) != EOF) {
+		printf("%s0x%02x,", size % 16 ? " " : "\n\t", c);
+		++size;
+	}
+	printf("\n};\n\nconst size_t status_table_size = %zu;\n", size);
+	fclose(snapshot);
+	return 0;
+}
@@ -0,0 +1,55 @@
+//
+// Looks up HTTP status codes in the map generated by generate.c. The map is opened from the program's read-only data,
+// so startup neither hashes nor allocates anything but the map itself, and only the pages a lookup touches are ever
+// faulted in. Updates work as with any other map, sharing the generated nodes.
+//
+// build: ./generate > status_table.c && cc -O2 -I../.. lookup.c status_table.c ../../champ.c ../../champ_fns.c -o lookup
+// usage: lookup <status code>...
+//
+
+#include <stdio.h>
+
+#include "champ.h"
+#include "champ_fns.h"
+
+extern const unsigned char status_table[];
+extern const size_t status_table_size;
+
+CHAMP_MAKE_HASHFN(hash_str, key)
+{
+	return champ_hash_str(key);
+}
+
+CHAMP_MAKE_EQUALSFN(equals_str, left, right)
+{
+	return champ_equals_str(left, right);
+}
+
+int main(int argc, char **argv)
+{
+	struct champ *statuses = champ_open_snapshot_image(status_table, status_table_size, hash_str, equals_str, NULL);
+	if (!statuses) {
+		fprintf(stderr, "status_table is not a snapshot\n");
+		return 1;
+	}
+
+	// a local extension, the generated nodes stay untouched
+	struct champ *extended = champ_set(statuses, "418", "I'm a teapot", NULL);
+
+	for (int i = 1; i < argc; ++i) {
+		const char *reason = champ_get(extended, argv[i], NULL);
+		printf("%s %s\n", argv[i], reason ? reason : "(unknown)");
+	}
+	if (argc == 1) {
+		struct champ_iter iter;
+		void *code, *reason;
+		champ_iter_init(&iter, statuses);
+		while (champ_iter_next(&iter, &code, &reason)) {
+			printf("%s %s\n", (const char *)code, (const char *)reason);
+		}
+	}
+
+	champ_destroy(&extended);
+	champ_close_snapshot(&statuses);
+	return 0;
+}
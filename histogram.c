@@ -0,0 +1,110 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Samuel Vogelsanger <vogelsangersamuel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static unsigned histogram_index(uint64_t value)
+{
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return (unsigned)value;
+	const unsigned shift = 63u - (unsigned)__builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+	return shift * HISTOGRAM_SUB_BUCKETS + (unsigned)(value >> shift);
+}
+
+static uint64_t histogram_highest_equivalent(unsigned index)
+{
+	if (index < HISTOGRAM_SUB_BUCKETS)
+		return index;
+	const unsigned shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+	const uint64_t sub_bucket = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+	return ((sub_bucket + 1) << shift) - 1;
+}
+
+void histogram_init(struct histogram *histogram)
+{
+	memset(histogram, 0, sizeof *histogram);
+	histogram->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+	atomic_fetch_add((uint64_t *)&histogram->buckets[histogram_index(value)], 1u);
+	atomic_fetch_add((uint64_t *)&histogram->count, 1u);
+	atomic_fetch_add((uint64_t *)&histogram->sum, value);
+
+	uint64_t min = atomic_load((uint64_t *)&histogram->min);
+	while (value < min && !atomic_compare_exchange_weak((uint64_t *)&histogram->min, &min, value));
+	uint64_t max = atomic_load((uint64_t *)&histogram->max);
+	while (value > max && !atomic_compare_exchange_weak((uint64_t *)&histogram->max, &max, value));
+}
+
+void histogram_copy(struct histogram *snapshot, const struct histogram *histogram)
+{
+	snapshot->count = 0;
+	for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		snapshot->buckets[i] = atomic_load((uint64_t *)&histogram->buckets[i]);
+		snapshot->count += snapshot->buckets[i];
+	}
+	snapshot->sum = atomic_load((uint64_t *)&histogram->sum);
+	snapshot->min = atomic_load((uint64_t *)&histogram->min);
+	snapshot->max = atomic_load((uint64_t *)&histogram->max);
+}
+
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile)
+{
+	if (histogram->count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(percentile / 100. * (double)histogram->count + .5);
+	if (rank == 0)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		seen += histogram->buckets[i];
+		if (seen >= rank) {
+			const uint64_t value = histogram_highest_equivalent(i);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+void histogram_print(const struct histogram *histogram, const char *name)
+{
+	printf("%s: count %llu, mean %.1f, min %llu, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+	       name,
+	       (unsigned long long)histogram->count,
+	       histogram->count ? (double)histogram->sum / (double)histogram->count : 0.,
+	       (unsigned long long)(histogram->count ? histogram->min : 0),
+	       (unsigned long long)histogram_percentile(histogram, 50.),
+	       (unsigned long long)histogram_percentile(histogram, 90.),
+	       (unsigned long long)histogram_percentile(histogram, 99.),
+	       (unsigned long long)histogram_percentile(histogram, 99.9),
+	       (unsigned long long)histogram->max);
+}
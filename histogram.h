@@ -0,0 +1,89 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Samuel Vogelsanger <vogelsangersamuel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CHAMP_HISTOGRAM_H
+#define CHAMP_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * A log-linear histogram in the style of HdrHistogram. Values below HISTOGRAM_SUB_BUCKETS are counted exactly, larger
+ * ones in buckets that are 1 / HISTOGRAM_SUB_BUCKETS of their power of two wide, i.e. with a relative error of at most
+ * about 6%. Recording is wait-free and may happen from any number of threads at once.
+ */
+
+#define HISTOGRAM_SUB_BUCKET_BITS 4u
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64u - HISTOGRAM_SUB_BUCKET_BITS + 1u) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Initializes an empty histogram.
+ *
+ * @param histogram
+ */
+void histogram_init(struct histogram *histogram);
+
+/**
+ * Atomically adds value to histogram.
+ *
+ * @param histogram
+ * @param value
+ */
+void histogram_record(struct histogram *histogram, uint64_t value);
+
+/**
+ * Copies histogram to snapshot while values are possibly still being recorded. Every counter is read atomically, but
+ * not all of them at the same time.
+ *
+ * @param snapshot
+ * @param histogram
+ */
+void histogram_copy(struct histogram *snapshot, const struct histogram *histogram);
+
+/**
+ * Returns the highest value that is equivalent to the value at percentile, or 0 if histogram is empty.
+ *
+ * @param histogram
+ * @param percentile between 0 and 100
+ * @return
+ */
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile);
+
+/**
+ * Prints count, mean and a few percentiles of histogram to stdout on a single line, prefixed with name.
+ *
+ * @param histogram
+ * @param name
+ */
+void histogram_print(const struct histogram *histogram, const char *name);
+
+#endif //CHAMP_HISTOGRAM_H
@@ -23,10 +23,23 @@
  */
 
 #include <stdatomic.h>
+#include <stddef.h>
 #include <malloc.h>
 
 #include "list.h"
 
+/*
+ * Besides plain cells, a list can consist of
+ *  - cells that live in a block allocated by list_from_array or by evaluating a suspension. They share the reference
+ *    count of their block, and their own ref_count field holds their index in the block instead.
+ *  - suspensions, which stand for a list_concat or list_reverse that hasn't been evaluated yet. A suspension is
+ *    evaluated into a block the first time its head or tail is needed.
+ * Both are marked in the upper bits of ref_count.
+ */
+#define LIST_BLOCK_CELL 0x80000000u
+#define LIST_SUSPENSION 0x40000000u
+#define LIST_REF_COUNT_MASK 0x3fffffffu
+
 struct list {
 	struct list *tail;
 	void *head;
@@ -34,6 +47,21 @@ struct list {
 	unsigned ref_count;
 };
 
+struct block {
+	unsigned ref_count;
+	unsigned count;
+	struct list cells[];
+};
+
+struct suspension {
+	struct list list; // MUST BE FIRST
+	struct list *left;
+	struct list *right; // NULL for a reversal of left
+	struct list *_Atomic forced;
+};
+
+#define BLOCK_OF(cell) ((struct block *)((char *)((cell) - ((cell)->ref_count & LIST_REF_COUNT_MASK)) - offsetof(struct block, cells)))
+
 static struct list static_instance = {
 	.tail = &static_instance,
 	.head = NULL,
@@ -53,6 +81,74 @@ static struct list *create(const struct list *tail, void *head)
 	return ret;
 }
 
+/**
+ * Allocates <count> cells in one block, with the last one pointing to tail. The cell heads are left to the caller.
+ * WARNING: tail is not acquired.
+ */
+static struct block *block_new(unsigned count, const struct list *tail)
+{
+	struct block *block = malloc(sizeof *block + count * sizeof(struct list));
+	block->ref_count = 0;
+	block->count = count;
+
+	for (unsigned i = 0; i < count; ++i) {
+		block->cells[i].tail = i + 1 < count ? &block->cells[i + 1] : (struct list *)tail;
+		block->cells[i].length = tail->length + (count - i);
+		block->cells[i].ref_count = LIST_BLOCK_CELL | i;
+	}
+
+	return block;
+}
+
+static struct list *suspend(struct list *left, struct list *right, unsigned length)
+{
+	struct suspension *ret = malloc(sizeof *ret);
+	ret->list.tail = NULL;
+	ret->list.head = NULL;
+	ret->list.length = length;
+	ret->list.ref_count = LIST_SUSPENSION;
+	ret->left = list_acquire(left);
+	ret->right = right ? list_acquire(right) : NULL;
+	ret->forced = NULL;
+	return &ret->list;
+}
+
+static struct list *evaluate(const struct suspension *suspension)
+{
+	const struct list *source = suspension->left;
+	const unsigned count = source->length;
+	struct block *block = block_new(count, suspension->right ? list_acquire(suspension->right) : empty_list);
+
+	for (unsigned i = 0; i < count; ++i) {
+		void *element;
+		source = list_pop(source, &element);
+		block->cells[suspension->right ? i : count - 1 - i].head = element;
+	}
+
+	return &block->cells[0];
+}
+
+/**
+ * Returns the list a suspension stands for, evaluating it if needed. Any other list is returned as is.
+ */
+static const struct list *force(const struct list *list)
+{
+	if (!(list->ref_count & LIST_SUSPENSION))
+		return list;
+
+	struct suspension *suspension = (struct suspension *)list;
+	struct list *forced = atomic_load(&suspension->forced);
+	if (forced)
+		return forced;
+
+	struct list *result = list_acquire(evaluate(suspension));
+	if (!atomic_compare_exchange_strong(&suspension->forced, &forced, result)) {
+		list_release(&result); // another thread was faster
+		return forced;
+	}
+	return result;
+}
+
 struct list *list_push(const struct list *list, void *element)
 {
 	return create(list_acquire(list), element);
@@ -60,30 +156,63 @@ struct list *list_push(const struct list *list, void *element)
 
 struct list *list_pop(const struct list *list, void **receiver)
 {
+	list = force(list);
 	*receiver = list->head;
 	return list->tail;
 }
 
 void *list_peek(const struct list *list)
 {
-	return list->head;
+	return force(list)->head;
+}
+
+unsigned list_length(const struct list *list)
+{
+	return list->length;
 }
 
 struct list *list_reverse(const struct list *list)
 {
-	struct list *ret = empty_list;
-	while (list != empty_list) {
-		ret = list_push(ret, list->head);
-		list = list->tail;
+	if (list->length < 2)
+		return (struct list *)list;
+
+	const struct suspension *suspension = (const struct suspension *)list;
+	if ((list->ref_count & LIST_SUSPENSION) && suspension->right == NULL)
+		return suspension->left; // reversing a reversal
+
+	return suspend((struct list *)list, NULL, list->length);
+}
+
+struct list *list_from_array(void *const *elements, unsigned count)
+{
+	if (count == 0)
+		return empty_list;
+
+	struct block *block = block_new(count, empty_list);
+	for (unsigned i = 0; i < count; ++i) {
+		block->cells[i].head = elements[i];
 	}
-	return ret;
+	return &block->cells[0];
+}
+
+struct list *list_concat(const struct list *left, const struct list *right)
+{
+	if (left == empty_list)
+		return (struct list *)right;
+	if (right == empty_list)
+		return (struct list *)left;
+
+	return suspend((struct list *)left, (struct list *)right, left->length + right->length);
 }
 
 struct list *list_acquire(const struct list *list)
 {
 	if (list == empty_list)
 		return (struct list *)list;
-	atomic_fetch_add((unsigned *)&list->ref_count, 1u);
+	if (list->ref_count & LIST_BLOCK_CELL)
+		atomic_fetch_add(&BLOCK_OF(list)->ref_count, 1u);
+	else
+		atomic_fetch_add((unsigned *)&list->ref_count, 1u);
 	return (struct list *)list;
 }
 
@@ -94,7 +223,28 @@ void list_release(struct list **list)
 	tail_call:
 	if (current == empty_list) {
 		return;
-	} else if (atomic_fetch_sub((unsigned *)&current->ref_count, 1u) == 1u) {
+
+	} else if (current->ref_count & LIST_BLOCK_CELL) {
+		struct block *block = BLOCK_OF(current);
+		if (atomic_fetch_sub(&block->ref_count, 1u) == 1u) {
+			struct list *tail = block->cells[block->count - 1].tail;
+			free(block);
+			current = tail;
+			goto tail_call;
+		}
+
+	} else if ((atomic_fetch_sub((unsigned *)&current->ref_count, 1u) & LIST_REF_COUNT_MASK) == 1u) {
+		if (current->ref_count & LIST_SUSPENSION) {
+			struct suspension *suspension = (struct suspension *)current;
+			struct list *forced = atomic_load(&suspension->forced);
+			list_release(&suspension->left);
+			if (forced)
+				list_release(&forced);
+			current = suspension->right ? suspension->right : empty_list;
+			free(suspension);
+			goto tail_call;
+		}
+
 		struct list *tail = current->tail;
 		free(current);
 		current = tail;
@@ -50,12 +50,38 @@ void *list_peek(const struct list *list);
 unsigned list_length(const struct list *list);
 
 /**
+ * Reversal is deferred: this returns in O(1), and the reversed list is built in a single allocation the first time
+ * it is popped or peeked. Reversing a reversed list returns the original list.
+ *
  * must be acquired
  * @param list
  * @return
  */
 struct list *list_reverse(const struct list *list);
 
+/**
+ * Creates a list of the first count elements, with elements[0] at its head. All cells are allocated in one block,
+ * which is freed once none of its cells is referenced anymore.
+ *
+ * must be acquired
+ * @param elements
+ * @param count
+ * @return
+ */
+struct list *list_from_array(void *const *elements, unsigned count);
+
+/**
+ * Returns the elements of left followed by the elements of right. Concatenation is deferred: this returns in O(1),
+ * and the elements of left are copied into a single allocation in front of right the first time the result is
+ * popped or peeked.
+ *
+ * must be acquired
+ * @param left
+ * @param right
+ * @return
+ */
+struct list *list_concat(const struct list *left, const struct list *right);
+
 struct list *list_acquire(const struct list *list);
 
 void list_release(struct list **list);
@@ -23,15 +23,70 @@
  */
 
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "stm_rc.h"
 
+static uint64_t nsecs_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * A ring of the last versions published in an atom, oldest first, starting at entries[first]. Versions are
+ * consecutive, and the newest one is always the current reference of the atom.
+ */
+struct atom_history {
+	size_t capacity;
+	size_t first;
+	size_t length;
+	struct atom_history_entry {
+		atom_ref ref; // acquired for the history
+		unsigned long version;
+		uint64_t since; // nsecs_now at publication
+	} entries[];
+};
+
+#define HISTORY_AT(history, i) (&(history)->entries[((history)->first + (i)) % (history)->capacity])
+
+// returns 1 and sets evicted if the oldest entry had to make room
+static int history_push(struct atom_history *history, atom_ref ref, unsigned long version, atom_ref *evicted)
+{
+	int evicting = history->length == history->capacity;
+	if (evicting) {
+		*evicted = history->entries[history->first].ref;
+		history->first = (history->first + 1) % history->capacity;
+		--history->length;
+	}
+	struct atom_history_entry *entry = HISTORY_AT(history, history->length++);
+	entry->ref = ref;
+	entry->version = version;
+	entry->since = nsecs_now();
+	return evicting;
+}
+
+#define STATS_NOW(atom) ((atom)->stats ? nsecs_now() : 0)
+#define STATS_RECORD(atom, histogram, since) do { \
+	if ((atom)->stats) \
+		histogram_record(&(atom)->stats->histogram, nsecs_now() - (since)); \
+} while (0)
+#define STATS_COUNT(atom, counter, n) do { \
+	if ((atom)->stats) \
+		atomic_fetch_add((unsigned long *)&(atom)->stats->counter, (n)); \
+} while (0)
+
 void atom_init(struct atom *atom, atom_ref ref, atom_ref_acquire acquire, atom_ref_release release)
 {
 	atom->ref = ref;
 	atom->acquire = acquire;
 	atom->release = release;
+	atom->version = 0;
+	atom->stats = NULL;
+	atom->history = NULL;
 	pthread_rwlock_init(&atom->lock, NULL);
 }
 
@@ -40,33 +95,94 @@ void atom_cleanup(struct atom *atom)
 	pthread_rwlock_rdlock(&atom->lock);
 	atom->release((atom_ref *)&atom->ref);
 	pthread_rwlock_unlock(&atom->lock);
+	free(atom->stats);
+	atom->stats = NULL;
+	if (atom->history) {
+		for (size_t i = 0; i < atom->history->length; ++i) {
+			atom->release(&HISTORY_AT(atom->history, i)->ref);
+		}
+		free(atom->history);
+		atom->history = NULL;
+	}
+}
+
+void atom_enable_stats(struct atom *atom)
+{
+	if (atom->stats)
+		return;
+	struct atom_stats *stats = malloc(sizeof *stats);
+	histogram_init(&stats->deref);
+	histogram_init(&stats->lock_wait);
+	histogram_init(&stats->swap);
+	stats->swaps = 0;
+	stats->retries = 0;
+	stats->elided = 0;
+	stats->cache_hits = 0;
+	stats->cache_misses = 0;
+	atom->stats = stats;
+}
+
+int atom_stats_read(const struct atom *atom, struct atom_stats *snapshot)
+{
+	if (!atom->stats)
+		return 0;
+	histogram_copy(&snapshot->deref, &atom->stats->deref);
+	histogram_copy(&snapshot->lock_wait, &atom->stats->lock_wait);
+	histogram_copy(&snapshot->swap, &atom->stats->swap);
+	snapshot->swaps = atomic_load((unsigned long *)&atom->stats->swaps);
+	snapshot->retries = atomic_load((unsigned long *)&atom->stats->retries);
+	snapshot->elided = atomic_load((unsigned long *)&atom->stats->elided);
+	snapshot->cache_hits = atomic_load((unsigned long *)&atom->stats->cache_hits);
+	snapshot->cache_misses = atomic_load((unsigned long *)&atom->stats->cache_misses);
+	return 1;
 }
 
 void *atom_deref(struct atom *atom)
 {
+	const uint64_t start = STATS_NOW(atom);
 	pthread_rwlock_rdlock(&atom->lock);
+	STATS_RECORD(atom, lock_wait, start);
 	atom_ref ret = atom->acquire(atom->ref);
 	pthread_rwlock_unlock(&atom->lock);
+	STATS_RECORD(atom, deref, start);
 	return ret;
 }
 
 void *atom_swap(struct atom *atom, atom_compute_fn compute, void *compute_arg)
 {
+	const uint64_t start = STATS_NOW(atom);
 	atom_ref ret;
+	unsigned long attempts = 0;
 
 	int done = 0;
 	while (!done) {
 		atom_ref current;
 		atom_ref aspirant;
+		atom_ref evicted;
+		int evicting = 0;
 
 		current = atom_deref(atom);
 		aspirant = atom->acquire(compute(current, compute_arg));
+		++attempts;
+
+		if (aspirant == current) { // nothing to publish, current is as good as any later value
+			atom->release(&aspirant);
+			STATS_COUNT(atom, elided, 1u);
+			ret = current;
+			break;
+		}
 
+		const uint64_t lock_start = STATS_NOW(atom);
 		pthread_rwlock_wrlock(&atom->lock);
+		STATS_RECORD(atom, lock_wait, lock_start);
 		if (current == atom->ref) {
 			ret = aspirant;
 			atom_ref tmp = atom->ref;
 			atom->ref = atom->acquire(ret);
+			const unsigned long version =
+				atomic_fetch_add_explicit((unsigned long *)&atom->version, 1u, memory_order_release) + 1;
+			if (atom->history)
+				evicting = history_push(atom->history, atom->acquire(ret), version, &evicted);
 
 			done = 1;
 			aspirant = tmp;
@@ -75,7 +191,136 @@ void *atom_swap(struct atom *atom, atom_compute_fn compute, void *compute_arg)
 
 		atom->release(&current);
 		atom->release(&aspirant);
+		if (evicting)
+			atom->release(&evicted);
 	}
 
+	STATS_COUNT(atom, swaps, 1u);
+	STATS_COUNT(atom, retries, attempts - 1);
+	STATS_RECORD(atom, swap, start);
 	return ret;
 }
+
+void atom_cache_init(struct atom_cache *cache, struct atom *atom)
+{
+	cache->atom = atom;
+	cache->ref = NULL;
+	cache->version = 0;
+	cache->filled = 0;
+}
+
+void *atom_cache_deref(struct atom_cache *cache)
+{
+	struct atom *atom = cache->atom;
+	// the version only changes under the write lock, so a matching version means the cached reference is current
+	if (cache->filled &&
+	    atomic_load_explicit((unsigned long *)&atom->version, memory_order_acquire) == cache->version) {
+		STATS_COUNT(atom, cache_hits, 1u);
+		return cache->ref;
+	}
+
+	STATS_COUNT(atom, cache_misses, 1u);
+	const uint64_t start = STATS_NOW(atom);
+	pthread_rwlock_rdlock(&atom->lock);
+	STATS_RECORD(atom, lock_wait, start);
+	atom_ref ref = atom->acquire(atom->ref);
+	const unsigned long version = atom->version;
+	pthread_rwlock_unlock(&atom->lock);
+	STATS_RECORD(atom, deref, start);
+
+	if (cache->filled)
+		atom->release(&cache->ref);
+	cache->ref = ref;
+	cache->version = version;
+	cache->filled = 1;
+	return ref;
+}
+
+void atom_cache_cleanup(struct atom_cache *cache)
+{
+	if (cache->filled)
+		cache->atom->release(&cache->ref);
+	cache->filled = 0;
+}
+
+void atom_enable_history(struct atom *atom, size_t capacity)
+{
+	if (atom->history)
+		return;
+	if (capacity < 1)
+		capacity = 1;
+	struct atom_history *history = malloc(sizeof *history + capacity * sizeof *history->entries);
+	history->capacity = capacity;
+	history->first = 0;
+	history->length = 0;
+	atom_ref evicted;
+	history_push(history, atom->acquire(atom->ref), atom->version, &evicted);
+	atom->history = history;
+}
+
+void *atom_deref_at(struct atom *atom, unsigned long version)
+{
+	atom_ref ret = NULL;
+	pthread_rwlock_rdlock(&atom->lock);
+	const struct atom_history *history = atom->history;
+	if (history) {
+		const unsigned long oldest = HISTORY_AT(history, 0)->version;
+		if (version >= oldest && version - oldest < history->length)
+			ret = atom->acquire(HISTORY_AT(history, version - oldest)->ref);
+	} else if (version == atom->version) {
+		ret = atom->acquire(atom->ref);
+	}
+	pthread_rwlock_unlock(&atom->lock);
+	return ret;
+}
+
+void *atom_deref_before(struct atom *atom, uint64_t nsecs)
+{
+	atom_ref ret = NULL;
+	pthread_rwlock_rdlock(&atom->lock);
+	const struct atom_history *history = atom->history;
+	if (history) {
+		for (size_t i = history->length; i > 0; --i) {
+			const struct atom_history_entry *entry = HISTORY_AT(history, i - 1);
+			if (entry->since <= nsecs) {
+				ret = atom->acquire(entry->ref);
+				break;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&atom->lock);
+	return ret;
+}
+
+size_t atom_history_bytes(struct atom *atom, atom_unshared_bytes_fn unshared, size_t *versions)
+{
+	size_t length = 0;
+	size_t bytes = 0;
+	atom_ref *refs = NULL;
+
+	pthread_rwlock_rdlock(&atom->lock);
+	const struct atom_history *history = atom->history;
+	if (history) {
+		length = history->length;
+		bytes = sizeof *history + history->capacity * sizeof *history->entries;
+		refs = malloc(length * sizeof *refs);
+		for (size_t i = 0; i < length; ++i) {
+			refs[i] = atom->acquire(HISTORY_AT(history, i)->ref);
+		}
+	}
+	pthread_rwlock_unlock(&atom->lock);
+
+	// a node a version shares with its successor is counted with the successor, down to the current reference,
+	// which is not counted at all
+	for (size_t i = 0; i + 1 < length; ++i) {
+		bytes += unshared(refs[i], refs[i + 1]);
+	}
+	for (size_t i = 0; i < length; ++i) {
+		atom->release(&refs[i]);
+	}
+	free(refs);
+
+	if (versions)
+		*versions = length;
+	return bytes;
+}
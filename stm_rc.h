@@ -25,16 +25,51 @@
 #ifndef CHAMP_STM_RC_H
 #define CHAMP_STM_RC_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
 typedef void *atom_ref;
 typedef atom_ref(*atom_ref_acquire)(atom_ref);
 typedef void (*atom_ref_release)(atom_ref *);
 typedef atom_ref (*atom_compute_fn)(atom_ref current, void *compute_arg);
+typedef size_t (*atom_unshared_bytes_fn)(atom_ref older, atom_ref newer);
+
+struct atom_history;
+
+/**
+ * Latencies in nanoseconds and contention counters of an atom, see atom_enable_stats.
+ */
+struct atom_stats {
+	struct histogram deref; // duration of atom_deref
+	struct histogram lock_wait; // time spent waiting for the lock, in both atom_deref and atom_swap
+	struct histogram swap; // duration of atom_swap, including all retries
+	unsigned long swaps;
+	unsigned long retries; // calls to compute whose result was released unpublished because the atom changed meanwhile
+	unsigned long elided; // swaps that published nothing because compute returned the current reference
+	unsigned long cache_hits; // calls to atom_cache_deref that found the cached reference current
+	unsigned long cache_misses; // calls to atom_cache_deref that had to take the lock
+};
 
 struct atom {
 	atom_ref volatile ref;
 	atom_ref_acquire acquire;
 	atom_ref_release release;
 	pthread_rwlock_t lock;
+	volatile unsigned long version; // incremented whenever a new reference is published
+	struct atom_stats *stats; // NULL unless enabled
+	struct atom_history *history; // NULL unless enabled
+};
+
+/**
+ * The reference a single reader last saw in an atom, see atom_cache_deref. Not to be shared between threads.
+ */
+struct atom_cache {
+	struct atom *atom;
+	atom_ref ref; // acquired, unless version is stale
+	unsigned long version;
+	int filled;
 };
 
 /**
@@ -75,12 +110,43 @@ void atom_cleanup(struct atom *atom);
  */
 void *atom_deref(struct atom *atom);
 
+/**
+ * Starts caching the reference of atom for the calling thread. Caches hold nothing until the first atom_cache_deref.
+ *
+ * @param cache
+ * @param atom
+ */
+void atom_cache_init(struct atom_cache *cache, struct atom *atom);
+
+/**
+ * Returns the current reference of the atom of cache. As long as the atom hasn't changed since the last call, that is
+ * the cached reference, after a single load of the atom's version, without taking the lock or touching any reference
+ * count. Otherwise, the new reference is acquired as in atom_deref, and the previously cached one is released.
+ *
+ * The returned reference belongs to the cache: it must not be released, and it only stays valid until the next call
+ * to atom_cache_deref or atom_cache_cleanup with the same cache.
+ *
+ * @param cache
+ * @return
+ */
+void *atom_cache_deref(struct atom_cache *cache);
+
+/**
+ * Releases the reference held by cache, if any.
+ *
+ * @param cache
+ */
+void atom_cache_cleanup(struct atom_cache *cache);
+
 /**
  * Tries to update the wrapped reference with a replacement. Will call compute in a loop until succeeding, so compute
  * should be free of side effects. On success, increments the refcount of the new wrapped reference twice: Once for
  * the atom itself, once for the caller. If the return value is ignored at the call site, it should be decremented.
  * This also means that the return value of compute should have a reference count of zero.
  *
+ * If compute returns the current reference itself, nothing is published and the atom is not locked for writing.
+ * The current reference is returned, with its refcount incremented once for the caller.
+ *
  * @param atom
  * @param compute
  * @param ...
@@ -88,4 +154,70 @@ void *atom_deref(struct atom *atom);
  */
 void *atom_swap(struct atom *atom, atom_compute_fn compute, void *compute_arg);
 
+/**
+ * Starts recording latencies and contention of atom. Stats are off by default, which costs a single branch per
+ * operation. Must not be called while other threads use atom. The stats are freed by atom_cleanup.
+ *
+ * @param atom
+ */
+void atom_enable_stats(struct atom *atom);
+
+/**
+ * Copies the stats of atom to snapshot. Safe to call while other threads use atom. Returns 0 and leaves snapshot
+ * untouched if stats are not enabled.
+ *
+ * @param atom
+ * @param snapshot
+ * @return 1 if stats are enabled
+ */
+int atom_stats_read(const struct atom *atom, struct atom_stats *snapshot);
+
+/**
+ * Starts retaining the references atom_swap replaces, so that they can be looked up with atom_deref_at and
+ * atom_deref_before. At most capacity versions are kept, counting the current one; older ones are released as new
+ * ones are published. Must not be called while other threads use atom. The history is released by atom_cleanup.
+ *
+ * Each retained version is a reference like any other, so for persistent data structures such as champ maps, it only
+ * costs the nodes it doesn't share with its successor, see atom_history_bytes.
+ *
+ * @param atom
+ * @param capacity at least 1
+ */
+void atom_enable_history(struct atom *atom, size_t capacity);
+
+/**
+ * Like atom_deref, but returns the reference that was published as the given version of atom, see atom.version.
+ * Returns NULL if that version is not retained, either because it has been evicted from the history or because it
+ * hasn't been published yet. Without a history, only the current version is retained.
+ *
+ * @param atom
+ * @param version
+ * @return
+ */
+void *atom_deref_at(struct atom *atom, unsigned long version);
+
+/**
+ * Like atom_deref, but returns the reference that was current at the given time, in nanoseconds of CLOCK_MONOTONIC.
+ * Returns NULL if atom has no history, or if the oldest retained version was published after that time.
+ *
+ * @param atom
+ * @param nsecs
+ * @return
+ */
+void *atom_deref_before(struct atom *atom, uint64_t nsecs);
+
+/**
+ * Returns the number of bytes retained by the history of atom on top of its current reference: the history itself,
+ * plus for every retained version, what unshared reports it holds that its successor doesn't. For champ maps, that is
+ * the bytes of older minus champ_shared_bytes(older, newer). Returns 0 if atom has no history.
+ *
+ * unshared is called without holding the lock of atom, on references acquired for the duration of the call.
+ *
+ * @param atom
+ * @param unshared
+ * @param versions set to the number of retained versions, counting the current one, unless NULL
+ * @return
+ */
+size_t atom_history_bytes(struct atom *atom, atom_unshared_bytes_fn unshared, size_t *versions);
+
 #endif //CHAMP_STM_RC_H